@@ -1,162 +1,293 @@
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
 #include "BVH.h"
 #include "Log.h"
 #include "Stopwatch.h"
 #include <iostream>
 
-//! Node for storing state information during traversal.
-struct BVHTraversal {
-  uint32_t i; // Node
-  float mint; // Minimum hit time for this node.
-  BVHTraversal() { }
-  BVHTraversal(int _i, float _mint) : i(_i), mint(_mint) { }
-};
-
 //! - Compute the nearest intersection of all objects within the tree.
 //! - Return true if hit was found, false otherwise.
 //! - In the case where we want to find out of there is _ANY_ intersection at all,
 //!   set occlusion == true, in which case we exit on the first hit, rather
 //!   than find the closest.
 bool BVH::getIntersection(const Ray& ray, IntersectionInfo* intersection, bool occlusion) const {
-  intersection->t = 999999999.f;
-  intersection->object = NULL;
-  float bbhits[4];
-  int32_t closer, other;
-
-  // Working set
-  BVHTraversal todo[64];
-  int32_t stackptr = 0;
-
-  // "Push" on the root node to the working set
-  todo[stackptr].i = 0;
-  todo[stackptr].mint = -9999999.f;
-
-  while(stackptr>=0) {
-    // Pop off the next node to work on.
-    int ni = todo[stackptr].i;
-    float near = todo[stackptr].mint;
-    stackptr--;
-    const BVHFlatNode &node(flatTree[ ni ]);
-
-    // If this node is further than the closest found intersection, continue
-    if(near > intersection->t)
-      continue;
+  return getIntersection(ray, intersection, occlusion, [](const Object* obj, const Ray& r, IntersectionInfo* current) {
+    return obj->getIntersection(r, current);
+  });
+}
 
-    // Is leaf -> Intersect
-    if( node.rightOffset == 0 ) {
-      for(uint32_t o=0;o<node.nPrims;++o) {
-        IntersectionInfo current;
-
-        const Object* obj = (*build_prims)[node.start+o];
-        bool hit = obj->getIntersection(ray, &current);
-
-        if (hit) {
-          // If we're only looking for occlusion, then any hit is good enough
-          if(occlusion) {
-            return true;
-          }
-
-          // Otherwise, keep the closest intersection only
-          if (current.t < intersection->t) {
-            *intersection = current;
-          }
-        }
-      }
+bool BVH::occluded(const Ray& ray, float tmax) const {
+  IntersectionInfo I;
+  return traverse(ray, &I, true, [&](uint32_t start, uint32_t count, IntersectionInfo* closest) {
+    for(uint32_t o=0;o<count;++o)
+      if((*build_prims)[start+o]->occluded(ray, closest->t))
+        return true;
+    return false;
+  }, tmax);
+}
 
-    } else { // Not a leaf
+BVH::~BVH() {
+  if(ownsTree)
+    delete[] flatTree;
+  delete wide4;
+  delete wide8;
+}
 
-      bool hitc0 = flatTree[ni+1].bbox.intersect(ray, bbhits, bbhits+1);
-      bool hitc1 = flatTree[ni+node.rightOffset].bbox.intersect(ray, bbhits+2, bbhits+3);
+BVH::BVH(std::vector<Object*>* objects, const BVHBuildSettings& settings)
+  : nNodes(0), nLeafs(0), buildThreads(1), settings(settings), build_prims(objects), buildPool(NULL), flatTree(NULL), ownsTree(true),
+    wide4(NULL), wide8(NULL) {
+    Stopwatch sw;
 
-      // Did we hit both nodes?
-      if(hitc0 && hitc1) {
+    // Build the tree based on the input object data set.
+    build();
 
-        // We assume that the left child is a closer hit...
-        closer = ni+1;
-        other = ni+node.rightOffset;
+    // Output tree build time and statistics
+    double constructionTime = sw.read();
+    LOG_STAT("Built BVH (%d nodes, with %d leafs) in %d ms on %d threads, SAH cost %.2f", nNodes, nLeafs, (int)(1000*constructionTime), buildThreads, computeSAHCost());
 
-        // ... If the right child was actually closer, swap the relavent values.
-        if(bbhits[2] < bbhits[0]) {
-          std::swap(bbhits[0], bbhits[2]);
-          std::swap(bbhits[1], bbhits[3]);
-          std::swap(closer,other);
-        }
+    collapse();
+  }
 
-        // It's possible that the nearest object is still in the other side, but we'll
-        // check the further-awar node later...
+BVH::BVH(std::vector<Object*>* objects, const BVHFlatNode* nodes, uint32_t nNodes, const BVHBuildSettings& settings)
+  : nNodes(nNodes), nLeafs(0), buildThreads(0), settings(settings), build_prims(objects), buildPool(NULL), flatTree(nodes), ownsTree(false),
+    wide4(NULL), wide8(NULL) {
+    for(uint32_t n = 0; n < nNodes; ++n)
+      nLeafs += flatTree[n].rightOffset == 0;
+    collapse();
+  }
 
-        // Push the farther first
-        todo[++stackptr] = BVHTraversal(other, bbhits[2]);
+bool BVH::validTree(const BVHFlatNode* nodes, uint32_t nNodes, uint32_t nPrims) {
+  // Walk the tree in preorder and check each node is where the walk expects the next one
+  struct Entry { uint32_t node, depth; };
+  std::vector<Entry> todo;
+  todo.push_back({0, 0});
+  uint32_t next = 0;
+  while(!todo.empty()) {
+    Entry entry = todo.back();
+    todo.pop_back();
+    // The traversal stacks hold one node per level
+    if(entry.node != next || next >= nNodes || entry.depth >= 128)
+      return false;
+    ++next;
+    const BVHFlatNode& node = nodes[entry.node];
+    if(node.rightOffset == 0) {
+      if(node.start > nPrims || node.nPrims > nPrims - node.start)
+        return false;
+    } else {
+      if(node.rightOffset < 2 || node.rightOffset >= nNodes - entry.node)
+        return false;
+      todo.push_back({entry.node + node.rightOffset, entry.depth + 1});
+      todo.push_back({entry.node + 1, entry.depth + 1});
+    }
+  }
+  return next == nNodes;
+}
 
-        // And now the closer (with overlap test)
-        todo[++stackptr] = BVHTraversal(closer, bbhits[0]);
-      }
+void BVH::collapse() {
+  if(settings.width != 4 && settings.width != 8)
+    return;
+
+  // Collapse into a wide tree for traversal
+  Stopwatch sw;
+  uint32_t wideNodes;
+  size_t wideBytes;
+  if(settings.width == 4) {
+    wide4 = new WideBVH<4>(flatTree, nNodes);
+    wideNodes = wide4->getNodeCount();
+    wideBytes = wide4->getMemoryBytes();
+  } else {
+    wide8 = new WideBVH<8>(flatTree, nNodes);
+    wideNodes = wide8->getNodeCount();
+    wideBytes = wide8->getMemoryBytes();
+  }
+  LOG_STAT("Collapsed to BVH%d (%d nodes, %d KB vs %d KB binary) in %d ms", settings.width, wideNodes,
+           (int)(wideBytes / 1024), (int)(nNodes * sizeof(BVHFlatNode) / 1024), (int)(1000*sw.read()));
+}
 
-      else if (hitc0) {
-        todo[++stackptr] = BVHTraversal(ni+1, bbhits[0]);
-      }
+struct BVHBuildEntry {
+  // If non-zero then this is the index of the parent. (used in offsets)
+  uint32_t parent;
+  // The range of objects in the object list covered by this node.
+  uint32_t start, end;
+  // Distance from the root
+  uint32_t depth;
+};
 
-      else if(hitc1) {
-        todo[++stackptr] = BVHTraversal(ni + node.rightOffset, bbhits[2]);
-      }
+// Below this depth nodes are always median-split, which keeps the tree shallow
+// enough for the fixed-size build and traversal stacks.
+static const uint32_t MaxHeuristicDepth = 64;
+
+// Trees over fewer primitives than this are always built on the calling thread.
+static const uint32_t ParallelBuildThreshold = 1 << 14;
+
+// A node of the top of the tree gets one chunk, and so one thread, per this many
+// primitives; nodes with fewer than twice as many are handled on the calling thread.
+static const uint32_t MinChunkPrims = 1 << 12;
+
+//! The threads of one parallel build, started once and reused for every node.
+//! run() hands out tasks to the workers and the calling thread, and returns once
+//! every worker is done with them.
+struct BVHBuildPool {
+  explicit BVHBuildPool(uint32_t nThreads)
+    : task(NULL), taskCount(0), next(0), generation(0), busy(0), stop(false)
+  {
+    for(uint32_t t = 1; t < nThreads; ++t)
+      workers.emplace_back([this]() { workerLoop(); });
+  }
 
+  ~BVHBuildPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
     }
+    wake.notify_all();
+    for(std::thread& t : workers)
+      t.join();
   }
 
-  // If we hit something,
-  if(intersection->object != NULL)
-    intersection->hit = ray.o + ray.d * intersection->t;
+  //! Runs fn(i) for every i in [0, nTasks)
+  void run(uint32_t nTasks, const std::function<void(uint32_t)>& fn) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      task = &fn;
+      taskCount = nTasks;
+      next = 0;
+      busy = workers.size();
+      ++generation;
+    }
+    wake.notify_all();
+    work();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return busy == 0; });
+  }
 
-  return intersection->object != NULL;
-}
+private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  const std::function<void(uint32_t)>* task;
+  uint32_t taskCount;
+  std::atomic<uint32_t> next;
+  uint64_t generation;
+  size_t busy; // workers still in the current run
+  bool stop;
+
+  void work() {
+    for(uint32_t i = next++; i < taskCount; i = next++)
+      (*task)(i);
+  }
 
-BVH::~BVH() {
-  delete[] flatTree;
+  void workerLoop() {
+    uint64_t seen = 0;
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stop || generation != seen; });
+        if(stop)
+          return;
+        seen = generation;
+      }
+      work();
+      std::lock_guard<std::mutex> lock(mutex);
+      if(--busy == 0)
+        done.notify_one();
+    }
+  }
+};
+
+//! Splits [start, end) into nChunks contiguous chunks and runs fn(chunk, chunkStart, chunkEnd)
+//! on each, on the pool's threads. A single chunk runs on the calling thread.
+template <typename F>
+static void parallelChunks(BVHBuildPool* pool, uint32_t start, uint32_t end, uint32_t nChunks, const F& fn)
+{
+  uint32_t n = end - start;
+  auto chunkStart = [&](uint32_t c) { return start + (uint32_t)((uint64_t)n * c / nChunks); };
+  if(nChunks <= 1 || !pool) {
+    for(uint32_t c = 0; c < nChunks; ++c)
+      fn(c, chunkStart(c), chunkStart(c+1));
+    return;
+  }
+  pool->run(nChunks, [&](uint32_t c) { fn(c, chunkStart(c), chunkStart(c+1)); });
 }
 
-BVH::BVH(std::vector<Object*>* objects, uint32_t leafSize)
-  : nNodes(0), nLeafs(0), leafSize(leafSize), build_prims(objects), flatTree(NULL) {
-    Stopwatch sw;
+//! Node of the top of the tree, split by BVH::buildParallel before the subtrees are handed out.
+struct BVHTopNode {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  BBox bbox;
+  uint32_t start, nPrims;
+  int32_t left, right; // Children in the top node list, if this is an inner node
+  int32_t subtree;     // Index of the subtree built below this node, or -1
+};
 
-    // Build the tree based on the input object data set.
-    build();
+//! A subtree built independently on one thread. Its rightOffsets are relative,
+//! so it can be copied verbatim into the final preorder node array.
+struct BVHSubtree {
+  uint32_t start, end, depth;
+  std::vector<BVHFlatNode> nodes;
+  uint32_t nLeafs;
+};
 
-    // Output tree build time and statistics
-    double constructionTime = sw.read();
-    LOG_STAT("Built BVH (%d nodes, with %d leafs) in %d ms", nNodes, nLeafs, (int)(1000*constructionTime));
+/*! Build the BVH, given an input data set
+ *  - Small inputs go straight to buildRange() on this thread.
+ *  - Large inputs are split by buildParallel(), which runs the top levels with
+ *    every thread working on the same node, then builds the remaining subtrees
+ *    concurrently and stitches them together. Both produce the same preorder
+ *    BVHFlatNode layout, so traversal is unaffected.
+ */
+void BVH::build()
+{
+  uint32_t nThreads = settings.numThreads > 0 ? settings.numThreads : std::max(1u, std::thread::hardware_concurrency());
+  uint32_t nPrims = build_prims->size();
+
+  std::vector<BVHFlatNode> buildnodes;
+  if(nThreads <= 1 || nPrims < ParallelBuildThreshold) {
+    buildThreads = 1;
+    buildnodes.reserve(nPrims*2);
+    nLeafs = buildRange(0, nPrims, 0, buildnodes);
+  } else {
+    buildThreads = nThreads;
+    nLeafs = buildParallel(nThreads, buildnodes);
   }
+  nNodes = buildnodes.size();
 
-struct BVHBuildEntry {
-  // If non-zero then this is the index of the parent. (used in offsets)
-  uint32_t parent;
-  // The range of objects in the object list covered by this node.
-  uint32_t start, end;
-};
+  // Copy the temp node data to a flat array
+  BVHFlatNode *nodes = new BVHFlatNode[nNodes];
+  for(uint32_t n=0; n<nNodes; ++n)
+    nodes[n] = buildnodes[n];
+  flatTree = nodes;
+}
 
-/*! Build the BVH, given an input data set
+/*! Build the subtree over build_prims[rootStart, rootEnd), appending it to buildnodes in preorder
  *  - Handling our own stack is quite a bit faster than the recursive style.
  *  - Each build stack entry's parent field eventually stores the offset
  *    to the parent of that node. Before that is finally computed, it will
  *    equal exactly three other values. (These are the magic values Untouched,
  *    Untouched-1, and TouchedTwice).
  *  - The partition here was also slightly faster than std::partition.
+ *  - Node indices are relative to the first node appended here. Returns the number of leafs.
  */
-void BVH::build()
+uint32_t BVH::buildRange(uint32_t rootStart, uint32_t rootEnd, uint32_t rootDepth, std::vector<BVHFlatNode>& buildnodes)
 {
   BVHBuildEntry todo[128];
   uint32_t stackptr = 0;
   const uint32_t Untouched    = 0xffffffff;
   const uint32_t TouchedTwice = 0xfffffffd;
+  const uint32_t base = buildnodes.size();
+  uint32_t nodeCount = 0, leafCount = 0;
 
   // Push the root
-  todo[stackptr].start = 0;
-  todo[stackptr].end = build_prims->size();
+  todo[stackptr].start = rootStart;
+  todo[stackptr].end = rootEnd;
   todo[stackptr].parent = 0xfffffffc;
+  todo[stackptr].depth = rootDepth;
   stackptr++;
 
   BVHFlatNode node;
-  std::vector<BVHFlatNode> buildnodes;
-  buildnodes.reserve(build_prims->size()*2);
 
   while(stackptr > 0) {
     // Pop the next item off of the stack
@@ -164,8 +295,9 @@ void BVH::build()
     uint32_t start = bnode.start;
     uint32_t end = bnode.end;
     uint32_t nPrims = end - start;
+    uint32_t depth = bnode.depth;
 
-    nNodes++;
+    nodeCount++;
     node.start = start;
     node.nPrims = nPrims;
     node.rightOffset = Untouched;
@@ -180,11 +312,12 @@ void BVH::build()
     }
     node.bbox = bb;
 
-    // If the number of primitives at this point is less than the leaf
-    // size, then this will become a leaf. (Signified by rightOffset == 0)
-    if(nPrims <= leafSize) {
+    // Decide whether this becomes a leaf (signified by rightOffset == 0),
+    // and if not, where to split it.
+    uint32_t mid;
+    if(!chooseSplit(start, end, depth, bb, bc, 1, mid)) {
       node.rightOffset = 0;
-      nLeafs++;
+      leafCount++;
     }
 
     buildnodes.push_back(node);
@@ -192,12 +325,12 @@ void BVH::build()
     // Child touches parent...
     // Special case: Don't do this for the root.
     if(bnode.parent != 0xfffffffc) {
-      buildnodes[bnode.parent].rightOffset --;
+      buildnodes[base + bnode.parent].rightOffset --;
 
       // When this is the second touch, this is the right child.
       // The right child sets up the offset for the flat tree.
-      if( buildnodes[bnode.parent].rightOffset == TouchedTwice ) {
-        buildnodes[bnode.parent].rightOffset = nNodes - 1 - bnode.parent;
+      if( buildnodes[base + bnode.parent].rightOffset == TouchedTwice ) {
+        buildnodes[base + bnode.parent].rightOffset = nodeCount - 1 - bnode.parent;
       }
     }
 
@@ -205,42 +338,411 @@ void BVH::build()
     if(node.rightOffset == 0)
       continue;
 
+    // Push right child
+    todo[stackptr].start = mid;
+    todo[stackptr].end = end;
+    todo[stackptr].parent = nodeCount-1;
+    todo[stackptr].depth = depth+1;
+    stackptr++;
+
+    // Push left child
+    todo[stackptr].start = start;
+    todo[stackptr].end = mid;
+    todo[stackptr].parent = nodeCount-1;
+    todo[stackptr].depth = depth+1;
+    stackptr++;
+  }
+
+  return leafCount;
+}
+
+/*! Decide how to split build_prims[start, end), partitioning it around mid.
+ *  Returns false if the node should become a leaf instead.
+ */
+bool BVH::chooseSplit(uint32_t start, uint32_t end, uint32_t depth, const BBox& bounds, const BBox& centroidBounds,
+                      uint32_t nThreads, uint32_t& mid)
+{
+  uint32_t nPrims = end - start;
+  mid = start;
+
+  if(depth >= MaxHeuristicDepth) {
+    if(nPrims <= settings.leafSize)
+      return false;
+  } else if(settings.splitMethod == BVHSplitMethod::SAH) {
+    if(!findSAHSplit(start, end, bounds, centroidBounds, nThreads, mid))
+      return false;
+  } else {
+    // If the number of primitives at this point is less than the leaf
+    // size, then this will become a leaf.
+    if(nPrims <= settings.leafSize)
+      return false;
+
     // Set the split dimensions
-    uint32_t split_dim = bc.maxDimension();
+    uint32_t split_dim = centroidBounds.maxDimension();
 
     // Split on the center of the longest axis
-    float split_coord = .5f * (bc.min[split_dim] + bc.max[split_dim]);
+    float split_coord = .5f * (centroidBounds.min[split_dim] + centroidBounds.max[split_dim]);
 
     // Partition the list of objects on this split
+    mid = partition(start, end, nThreads, [&](const Object* obj) {
+      return obj->getCentroid()[split_dim] < split_coord;
+    });
+  }
+
+  // If we get a bad split, just choose the center...
+  if(mid == start || mid == end) {
+    mid = start + (end-start)/2;
+  }
+  return true;
+}
+
+/*! Move the objects in build_prims[start, end) for which goesLeft() holds to the front.
+ *  Returns the index of the first object that went right.
+ *  - With one thread this is the usual in-place swap loop.
+ *  - With more, every chunk counts its left objects, and the chunks then scatter
+ *    from a scratch copy to their prefix-summed offsets (stable, but not in place).
+ *    The flags and the copy live in partitionLeft and partitionScratch, which are
+ *    indexed like build_prims and sized once per build.
+ */
+template <typename Pred>
+uint32_t BVH::partition(uint32_t start, uint32_t end, uint32_t nThreads, const Pred& goesLeft)
+{
+  std::vector<Object*>& prims = *build_prims;
+  if(nThreads <= 1) {
     uint32_t mid = start;
     for(uint32_t i=start;i<end;++i) {
-      if( (*build_prims)[i]->getCentroid()[split_dim] < split_coord ) {
-        std::swap( (*build_prims)[i], (*build_prims)[mid] );
+      if(goesLeft(prims[i])) {
+        std::swap(prims[i], prims[mid]);
         ++mid;
       }
     }
+    return mid;
+  }
 
-    // If we get a bad split, just choose the center...
-    if(mid == start || mid == end) {
-      mid = start + (end-start)/2;
+  std::vector<uint8_t>& left = partitionLeft;
+  std::vector<uint32_t> leftCount(nThreads), leftOffset(nThreads), rightOffset(nThreads);
+  parallelChunks(buildPool, start, end, nThreads, [&](uint32_t c, uint32_t s, uint32_t e) {
+    uint32_t count = 0;
+    for(uint32_t i = s; i < e; ++i) {
+      left[i] = goesLeft(prims[i]);
+      count += left[i];
     }
+    leftCount[c] = count;
+  });
+
+  uint32_t totalLeft = 0;
+  for(uint32_t c = 0; c < nThreads; ++c)
+    totalLeft += leftCount[c];
+  uint32_t nextLeft = 0, nextRight = totalLeft;
+  for(uint32_t c = 0; c < nThreads; ++c) {
+    uint32_t chunkSize = (uint32_t)((uint64_t)(end - start) * (c+1) / nThreads) - (uint32_t)((uint64_t)(end - start) * c / nThreads);
+    leftOffset[c] = nextLeft;
+    rightOffset[c] = nextRight;
+    nextLeft += leftCount[c];
+    nextRight += chunkSize - leftCount[c];
+  }
 
-    // Push right child
-    todo[stackptr].start = mid;
-    todo[stackptr].end = end;
-    todo[stackptr].parent = nNodes-1;
-    stackptr++;
+  std::vector<Object*>& scratch = partitionScratch;
+  parallelChunks(buildPool, start, end, nThreads, [&](uint32_t, uint32_t s, uint32_t e) {
+    std::copy(prims.begin() + s, prims.begin() + e, scratch.begin() + s);
+  });
+  parallelChunks(buildPool, start, end, nThreads, [&](uint32_t c, uint32_t s, uint32_t e) {
+    uint32_t l = leftOffset[c], r = rightOffset[c];
+    for(uint32_t i = s; i < e; ++i)
+      prims[start + (left[i] ? l++ : r++)] = scratch[i];
+  });
+  return start + totalLeft;
+}
 
-    // Push left child
-    todo[stackptr].start = start;
-    todo[stackptr].end = mid;
-    todo[stackptr].parent = nNodes-1;
-    stackptr++;
+/*! Parallel build of the whole tree
+ *  - The top levels are split one node at a time, with the bounds, SAH bins and
+ *    partition of each node computed by all threads together.
+ *  - Once a node is small enough it becomes an independent subtree, and the
+ *    subtrees are built with buildRange() by a pool of threads, largest first.
+ *  - Finally the top nodes and subtrees are written out in preorder, the same
+ *    layout a single-threaded build produces.
+ */
+uint32_t BVH::buildParallel(uint32_t nThreads, std::vector<BVHFlatNode>& buildnodes)
+{
+  uint32_t nPrims = build_prims->size();
+  uint32_t subtreeSize = std::max(ParallelBuildThreshold / 4, nPrims / (nThreads * 8));
+  BVHBuildPool pool(nThreads);
+  buildPool = &pool;
+  partitionLeft.resize(nPrims);
+  partitionScratch.resize(nPrims);
+  std::vector<BBox> chunkBounds(nThreads), chunkCentroids(nThreads);
+
+  std::vector<BVHTopNode, Eigen::aligned_allocator<BVHTopNode>> top;
+  std::vector<BVHSubtree> subtrees;
+
+  // Split the top of the tree, depth first
+  struct TopEntry { int32_t node; uint32_t start, end, depth; };
+  std::vector<TopEntry> todo;
+  top.push_back(BVHTopNode());
+  todo.push_back({0, 0, nPrims, 0});
+  while(!todo.empty()) {
+    TopEntry entry = todo.back();
+    todo.pop_back();
+    uint32_t n = entry.end - entry.start;
+
+    if(n <= subtreeSize) {
+      top[entry.node].subtree = subtrees.size();
+      subtrees.push_back({entry.start, entry.end, entry.depth, {}, 0});
+      continue;
+    }
+
+    // One chunk per MinChunkPrims, so nodes near the subtree size use only some of the threads
+    uint32_t nChunks = std::min(nThreads, std::max(1u, n / MinChunkPrims));
+    parallelChunks(buildPool, entry.start, entry.end, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+      BBox bb((*build_prims)[s]->getBBox());
+      BBox bc;
+      bc.setP((*build_prims)[s]->getCentroid());
+      for(uint32_t p = s+1; p < e; ++p) {
+        bb.expandToInclude((*build_prims)[p]->getBBox());
+        bc.expandToInclude((*build_prims)[p]->getCentroid());
+      }
+      chunkBounds[c] = bb;
+      chunkCentroids[c] = bc;
+    });
+    BBox bb = chunkBounds[0], bc = chunkCentroids[0];
+    for(uint32_t c = 1; c < nChunks; ++c) {
+      bb.expandToInclude(chunkBounds[c]);
+      bc.expandToInclude(chunkCentroids[c]);
+    }
+
+    uint32_t mid;
+    if(!chooseSplit(entry.start, entry.end, entry.depth, bb, bc, nChunks, mid)) {
+      // Let buildRange() turn it into a leaf
+      top[entry.node].subtree = subtrees.size();
+      subtrees.push_back({entry.start, entry.end, entry.depth, {}, 0});
+      continue;
+    }
+
+    int32_t left = top.size(), right = top.size() + 1;
+    BVHTopNode& node = top[entry.node];
+    node.bbox = bb;
+    node.start = entry.start;
+    node.nPrims = n;
+    node.subtree = -1;
+    node.left = left;
+    node.right = right;
+    top.push_back(BVHTopNode());
+    top.push_back(BVHTopNode());
+    todo.push_back({right, mid, entry.end, entry.depth+1});
+    todo.push_back({left, entry.start, mid, entry.depth+1});
   }
 
-  // Copy the temp node data to a flat array
-  flatTree = new BVHFlatNode[nNodes];
-  for(uint32_t n=0; n<nNodes; ++n) 
-    flatTree[n] = buildnodes[n];
+  // Build the subtrees, largest first
+  std::vector<uint32_t> order(subtrees.size());
+  for(uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return subtrees[a].end - subtrees[a].start > subtrees[b].end - subtrees[b].start;
+  });
+  pool.run(order.size(), [&](uint32_t i) {
+    BVHSubtree& subtree = subtrees[order[i]];
+    subtree.nodes.reserve((subtree.end - subtree.start)*2);
+    subtree.nLeafs = buildRange(subtree.start, subtree.end, subtree.depth, subtree.nodes);
+  });
+  buildPool = NULL;
+  std::vector<uint8_t>().swap(partitionLeft);
+  std::vector<Object*>().swap(partitionScratch);
+
+  // Stitch everything together in preorder
+  size_t total = top.size();
+  uint32_t leafCount = 0;
+  for(const BVHSubtree& subtree : subtrees) {
+    total += subtree.nodes.size();
+    leafCount += subtree.nLeafs;
+  }
+  buildnodes.reserve(total);
+
+  std::vector<int32_t> emit;
+  std::vector<uint32_t> pendingParent; // flat index of the node whose rightOffset the next right child sets
+  emit.push_back(0);
+  while(!emit.empty()) {
+    int32_t t = emit.back();
+    emit.pop_back();
+    if(t < 0) {
+      // Marker: the left subtree of pendingParent is done, its right child comes next
+      uint32_t parent = pendingParent.back();
+      pendingParent.pop_back();
+      buildnodes[parent].rightOffset = buildnodes.size() - parent;
+      continue;
+    }
+    const BVHTopNode& node = top[t];
+    if(node.subtree >= 0) {
+      const std::vector<BVHFlatNode>& nodes = subtrees[node.subtree].nodes;
+      buildnodes.insert(buildnodes.end(), nodes.begin(), nodes.end());
+      continue;
+    }
+    BVHFlatNode flat;
+    flat.bbox = node.bbox;
+    flat.start = node.start;
+    flat.nPrims = node.nPrims;
+    flat.rightOffset = 0;
+    pendingParent.push_back(buildnodes.size());
+    buildnodes.push_back(flat);
+    emit.push_back(node.right);
+    emit.push_back(-1);
+    emit.push_back(node.left);
+  }
+
+  return leafCount;
 }
 
+//! Bin used during the SAH sweep
+struct SAHBin {
+  BBox bounds;
+  uint32_t count;
+};
+
+/*! Binned SAH split (Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies")
+ *  - Centroids are dropped into settings.sahBins equal-width bins along each axis, and
+ *    every boundary between two bins is evaluated as a candidate split plane.
+ *  - The cost of a split is traversalCost + (A_left*N_left + A_right*N_right) / A_node,
+ *    while a leaf costs N. A leaf is made whenever it is no more expensive than the best
+ *    split, unless the node holds more than maxLeafSize primitives.
+ *  - With nThreads > 1 every thread bins its own chunk and the bins are merged.
+ *  - On success build_prims[start, end) is partitioned around the returned mid.
+ */
+bool BVH::findSAHSplit(uint32_t start, uint32_t end, const BBox& bounds, const BBox& centroidBounds,
+                       uint32_t nThreads, uint32_t& mid)
+{
+  const uint32_t nPrims = end - start;
+  const uint32_t nBins = std::max(2u, settings.sahBins);
+  if(nPrims <= 1)
+    return false;
+
+  Eigen::Vector3f cmin = centroidBounds.min;
+  Eigen::Vector3f extent = centroidBounds.max - centroidBounds.min;
+  Eigen::Vector3f scale;
+  for(int dim = 0; dim < 3; ++dim)
+    scale[dim] = extent[dim] > 0.f ? nBins / extent[dim] : 0.f;
+  auto binOf = [&](float c, int dim) {
+    return std::min(nBins - 1, (uint32_t)((c - cmin[dim]) * scale[dim]));
+  };
+
+  // Bin all three axes in one pass over the primitives
+  std::vector<SAHBin> chunkBins(nThreads * 3 * nBins);
+  auto binChunk = [&](uint32_t c, uint32_t s, uint32_t e) {
+    SAHBin* bins = &chunkBins[c * 3 * nBins];
+    for(uint32_t b = 0; b < 3 * nBins; ++b)
+      bins[b].count = 0;
+    for(uint32_t i = s; i < e; ++i) {
+      const Object* obj = (*build_prims)[i];
+      BBox box = obj->getBBox();
+      Eigen::Vector3f centroid = obj->getCentroid();
+      for(int dim = 0; dim < 3; ++dim) {
+        SAHBin& bin = bins[dim * nBins + binOf(centroid[dim], dim)];
+        if(bin.count++ == 0)
+          bin.bounds = box;
+        else
+          bin.bounds.expandToInclude(box);
+      }
+    }
+  };
+  if(nThreads <= 1)
+    binChunk(0, start, end);
+  else
+    parallelChunks(buildPool, start, end, nThreads, binChunk);
+
+  SAHBin* bins = &chunkBins[0];
+  for(uint32_t c = 1; c < nThreads; ++c) {
+    for(uint32_t b = 0; b < 3 * nBins; ++b) {
+      const SAHBin& other = chunkBins[c * 3 * nBins + b];
+      if(other.count == 0)
+        continue;
+      if(bins[b].count == 0)
+        bins[b].bounds = other.bounds;
+      else
+        bins[b].bounds.expandToInclude(other.bounds);
+      bins[b].count += other.count;
+    }
+  }
+
+  std::vector<float> rightArea(nBins);
+  float bestCost = std::numeric_limits<float>::infinity();
+  int bestDim = -1;
+  uint32_t bestBin = 0;
+
+  for(int dim = 0; dim < 3; ++dim) {
+    if(extent[dim] <= 0.f)
+      continue;
+    const SAHBin* axis = &bins[dim * nBins];
+
+    // Sweep from the right to get the area of everything right of each plane...
+    BBox acc;
+    uint32_t count = 0;
+    for(uint32_t b = nBins - 1; b > 0; --b) {
+      if(axis[b].count > 0) {
+        if(count == 0) acc = axis[b].bounds;
+        else acc.expandToInclude(axis[b].bounds);
+        count += axis[b].count;
+      }
+      rightArea[b] = count > 0 ? acc.surfaceArea() * count : 0.f;
+    }
+
+    // ... then from the left, evaluating the plane between bin b-1 and b.
+    count = 0;
+    for(uint32_t b = 1; b < nBins; ++b) {
+      if(axis[b-1].count > 0) {
+        if(count == 0) acc = axis[b-1].bounds;
+        else acc.expandToInclude(axis[b-1].bounds);
+        count += axis[b-1].count;
+      }
+      if(count == 0 || count == nPrims)
+        continue;
+      float cost = acc.surfaceArea() * count + rightArea[b];
+      if(cost < bestCost) {
+        bestCost = cost;
+        bestDim = dim;
+        bestBin = b;
+      }
+    }
+  }
+
+  float area = bounds.surfaceArea();
+  float leafCost = (float)nPrims;
+  if(bestDim >= 0 && area > 0.f)
+    bestCost = settings.traversalCost + bestCost / area;
+
+  if(bestDim < 0) {
+    // All centroids coincide; nothing to gain from the heuristic
+    if(nPrims <= settings.maxLeafSize)
+      return false;
+    mid = start + nPrims/2;
+    return true;
+  }
+
+  if(bestCost >= leafCost && nPrims <= settings.maxLeafSize)
+    return false;
+
+  // Partition the list of objects on the chosen plane
+  mid = partition(start, end, nThreads, [&](const Object* obj) {
+    return binOf(obj->getCentroid()[bestDim], bestDim) < bestBin;
+  });
+  return true;
+}
+
+//! Expected cost of a random ray through the tree: every node is weighted by the
+//! probability of a ray hitting it given that it hits the root (surface area ratio).
+float BVH::computeSAHCost() const
+{
+  if(nNodes == 0)
+    return 0.f;
+  float rootArea = flatTree[0].bbox.surfaceArea();
+  if(rootArea <= 0.f)
+    return (float)flatTree[0].nPrims;
+
+  float cost = 0.f;
+  for(uint32_t n = 0; n < nNodes; ++n) {
+    const BVHFlatNode &node = flatTree[n];
+    float p = node.bbox.surfaceArea() / rootArea;
+    if(node.rightOffset == 0)
+      cost += p * node.nPrims;
+    else
+      cost += p * settings.traversalCost;
+  }
+  return cost;
+}
@@ -3,10 +3,12 @@
 
 #include "BBox.h"
 #include <vector>
+#include <utility>
 #include <stdint.h>
 #include "Object.h"
 #include "IntersectionInfo.h"
 #include "Ray.h"
+#include "WideBVH.h"
 
 //! Node descriptor for the flattened tree
 struct BVHFlatNode {
@@ -15,23 +17,246 @@ struct BVHFlatNode {
   uint32_t start, nPrims, rightOffset;
 };
 
+//! How BVH::build chooses where to split a node
+enum class BVHSplitMethod {
+  Midpoint, //!< Centroid midpoint of the longest axis, falling back to a median split
+  SAH       //!< Binned surface area heuristic, which also decides when to stop splitting
+};
+
+//! Build parameters for a BVH
+struct BVHBuildSettings {
+  BVHSplitMethod splitMethod = BVHSplitMethod::Midpoint; //!< SAH builds better trees, more slowly
+  uint32_t leafSize = 4;       //!< Midpoint: nodes with at most this many primitives become leaves
+  uint32_t maxLeafSize = 16;   //!< SAH: nodes with more primitives than this are always split
+  uint32_t sahBins = 16;       //!< SAH: number of centroid bins per axis
+  float traversalCost = 1.f;   //!< SAH: cost of visiting an inner node, relative to one primitive test
+  uint32_t numThreads = 0;     //!< Build threads for large inputs; 0 uses every hardware thread
+  bool flattenScene = true;    //!< Scene: one BVH over every triangle instead of a BVH of per-mesh BVHs
+  uint32_t width = 4;          //!< Branching factor traversed: 2 (binary flat tree), 4 or 8 (collapsed WideBVH)
+};
+
+struct BVHBuildPool;
+
 //! \author Brandon Pelfrey
 //! A Bounding Volume Hierarchy system for fast Ray-Object intersection tests
 class BVH {
-  uint32_t nNodes, nLeafs, leafSize;
+  uint32_t nNodes, nLeafs, buildThreads;
+  BVHBuildSettings settings;
   std::vector<Object*>* build_prims;
 
   //! Build the BVH tree out of build_prims
   void build();
 
+  //! Single-threaded build of the subtree over build_prims[start, end), appended to nodes
+  uint32_t buildRange(uint32_t start, uint32_t end, uint32_t depth, std::vector<BVHFlatNode>& nodes);
+
+  //! Multi-threaded build of the whole tree into nodes
+  uint32_t buildParallel(uint32_t nThreads, std::vector<BVHFlatNode>& nodes);
+
+  //! Pick a split for build_prims[start, end) and partition around it. Returns false for a leaf.
+  bool chooseSplit(uint32_t start, uint32_t end, uint32_t depth, const BBox& bounds, const BBox& centroidBounds,
+                   uint32_t nThreads, uint32_t& mid);
+
+  //! Find the best binned SAH split of build_prims[start, end). Returns false if a leaf is cheaper.
+  bool findSAHSplit(uint32_t start, uint32_t end, const BBox& bounds, const BBox& centroidBounds,
+                    uint32_t nThreads, uint32_t& mid);
+
+  //! Move the objects satisfying goesLeft to the front of build_prims[start, end)
+  template <typename Pred>
+  uint32_t partition(uint32_t start, uint32_t end, uint32_t nThreads, const Pred& goesLeft);
+
+  //! The threads of a parallel build, and the scratch space its parallel partitions share.
+  //! Only used while buildParallel runs.
+  BVHBuildPool* buildPool;
+  std::vector<uint8_t> partitionLeft;
+  std::vector<Object*> partitionScratch;
+
+  //! SAH cost of the finished tree, normalized by the root surface area
+  float computeSAHCost() const;
+
+  //! Collapse flatTree into the wide tree settings.width asks for, if any
+  void collapse();
+
   // Fast Traversal System
-  BVHFlatNode *flatTree;
+  const BVHFlatNode *flatTree;
+  bool ownsTree; // false if flatTree was handed in already built
+
+  // Collapsed copies of flatTree, used instead of it when settings.width is 4 or 8
+  WideBVH<4> *wide4;
+  WideBVH<8> *wide8;
 
   public:
-  BVH(std::vector<Object*>* objects, uint32_t leafSize=4);
+  BVH(std::vector<Object*>* objects, const BVHBuildSettings& settings = BVHBuildSettings());
+
+  //! Takes over a tree built before (read back from a scene cache) instead of building one.
+  //! The nodes must index objects in their current order, and are used in place, so they have
+  //! to outlive the BVH.
+  BVH(std::vector<Object*>* objects, const BVHFlatNode* nodes, uint32_t nNodes,
+      const BVHBuildSettings& settings = BVHBuildSettings());
+
+  //! The tree, wide trees and build buffers are owned through plain pointers
+  BVH(const BVH&) = delete;
+  BVH& operator=(const BVH&) = delete;
+
+  //! Whether nodes are a tree the constructor above can take: a binary tree in preorder
+  //! whose rightOffsets stay inside it, no deeper than traversal can follow, and whose
+  //! leaves only refer to the first nPrims primitives.
+  static bool validTree(const BVHFlatNode* nodes, uint32_t nNodes, uint32_t nPrims);
   bool getIntersection(const Ray& ray, IntersectionInfo *intersection, bool occlusion) const ;
 
+  //! Same traversal, but leaves are tested with leafTest(object, ray, &current) instead of the
+  //! virtual Object::getIntersection, so callers that know the primitive type avoid the dispatch.
+  template <typename LeafTest>
+  bool getIntersection(const Ray& ray, IntersectionInfo *intersection, bool occlusion, const LeafTest& leafTest) const;
+
+  //! Any-hit query: whether any object is hit closer than tmax. Stops at the first such hit
+  //! and goes through Object::occluded, so nested BVHs stop early as well.
+  bool occluded(const Ray& ray, float tmax) const;
+
+  //! The traversal itself. Every leaf reached is handed to leafTest(start, count, intersection),
+  //! which tests build_prims[start, start+count) as a whole, updates *intersection if it finds a
+  //! closer hit and returns whether it hit anything. With occlusion, the first hit ends the traversal.
+  //! Only hits closer than tmax are looked for; intersection->t starts out as tmax.
+  template <typename LeafRangeTest>
+  bool traverse(const Ray& ray, IntersectionInfo *intersection, bool occlusion, const LeafRangeTest& leafTest,
+                float tmax = 999999999.f) const;
+
+  //! Calls fn(start, count) for the primitive range of every leaf
+  template <typename F>
+  void forEachLeaf(const F& fn) const {
+    for(uint32_t n = 0; n < nNodes; ++n)
+      if(flatTree[n].rightOffset == 0)
+        fn(flatTree[n].start, flatTree[n].nPrims);
+  }
+
+  //! The primitives in the order the leaf ranges refer to
+  const std::vector<Object*>& getPrimitives() const { return *build_prims; }
+
+  //! The binary tree, in preorder
+  const BVHFlatNode* getNodes() const { return flatTree; }
+  uint32_t getNodeCount() const { return nNodes; }
+
   ~BVH();
 };
 
+//! Node for storing state information during traversal.
+struct BVHTraversal {
+  uint32_t i; // Node
+  float mint; // Minimum hit time for this node.
+  BVHTraversal() { }
+  BVHTraversal(int _i, float _mint) : i(_i), mint(_mint) { }
+};
+
+template <typename LeafTest>
+bool BVH::getIntersection(const Ray& ray, IntersectionInfo* intersection, bool occlusion, const LeafTest& leafTest) const {
+  return traverse(ray, intersection, occlusion, [&](uint32_t start, uint32_t count, IntersectionInfo* closest) {
+    bool hit = false;
+    for(uint32_t o=0;o<count;++o) {
+      IntersectionInfo current;
+
+      const Object* obj = (*build_prims)[start+o];
+      if (leafTest(obj, ray, &current)) {
+        hit = true;
+        // If we're only looking for occlusion, then any hit is good enough
+        if(occlusion) {
+          *closest = current;
+          return true;
+        }
+
+        // Otherwise, keep the closest intersection only
+        if (current.t < closest->t) {
+          *closest = current;
+        }
+      }
+    }
+    return hit;
+  });
+}
+
+template <typename LeafRangeTest>
+bool BVH::traverse(const Ray& ray, IntersectionInfo* intersection, bool occlusion, const LeafRangeTest& leafTest,
+                   float tmax) const {
+  if(wide4)
+    return wide4->traverse(ray, intersection, occlusion, leafTest, tmax);
+  if(wide8)
+    return wide8->traverse(ray, intersection, occlusion, leafTest, tmax);
+
+  intersection->t = tmax;
+  intersection->object = NULL;
+  float bbhits[4];
+  int32_t closer, other;
+
+  // Working set (sized for the deepest tree build() can produce)
+  BVHTraversal todo[128];
+  int32_t stackptr = 0;
+
+  // "Push" on the root node to the working set
+  todo[stackptr].i = 0;
+  todo[stackptr].mint = -9999999.f;
+
+  while(stackptr>=0) {
+    // Pop off the next node to work on.
+    int ni = todo[stackptr].i;
+    float near = todo[stackptr].mint;
+    stackptr--;
+    const BVHFlatNode &node(flatTree[ ni ]);
+
+    // If this node is further than the closest found intersection, continue
+    if(near > intersection->t)
+      continue;
+
+    // Is leaf -> Intersect
+    if( node.rightOffset == 0 ) {
+      // If we're only looking for occlusion, then any hit is good enough
+      if(leafTest(node.start, node.nPrims, intersection) && occlusion) {
+        return true;
+      }
+
+    } else { // Not a leaf
+
+      bool hitc0 = flatTree[ni+1].bbox.intersect(ray, bbhits, bbhits+1);
+      bool hitc1 = flatTree[ni+node.rightOffset].bbox.intersect(ray, bbhits+2, bbhits+3);
+
+      // Did we hit both nodes?
+      if(hitc0 && hitc1) {
+
+        // We assume that the left child is a closer hit...
+        closer = ni+1;
+        other = ni+node.rightOffset;
+
+        // ... If the right child was actually closer, swap the relavent values.
+        if(bbhits[2] < bbhits[0]) {
+          std::swap(bbhits[0], bbhits[2]);
+          std::swap(bbhits[1], bbhits[3]);
+          std::swap(closer,other);
+        }
+
+        // It's possible that the nearest object is still in the other side, but we'll
+        // check the further-awar node later...
+
+        // Push the farther first
+        todo[++stackptr] = BVHTraversal(other, bbhits[2]);
+
+        // And now the closer (with overlap test)
+        todo[++stackptr] = BVHTraversal(closer, bbhits[0]);
+      }
+
+      else if (hitc0) {
+        todo[++stackptr] = BVHTraversal(ni+1, bbhits[0]);
+      }
+
+      else if(hitc1) {
+        todo[++stackptr] = BVHTraversal(ni + node.rightOffset, bbhits[2]);
+      }
+
+    }
+  }
+
+  // If we hit something,
+  if(intersection->object != NULL)
+    intersection->hit = ray.o + ray.d * intersection->t;
+
+  return intersection->object != NULL;
+}
+
 #endif
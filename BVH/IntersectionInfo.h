@@ -9,6 +9,7 @@ struct IntersectionInfo {
   float t; // Intersection distance along the ray
   const Object* object; // Object that was hit
   Eigen::Vector3f hit; // Location of the intersection
+  float u, v; // Barycentric coordinates of the hit, for primitives that have them
   const void *data = nullptr;
 };
 
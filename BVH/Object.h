@@ -9,10 +9,10 @@
 
 #include "util/SceneData.h"
 
+//! Only the interface the BVH needs. Objects that are placed in the scene with
+//! a transform derive from TransformedObject; triangles don't, so the millions
+//! of them in a large mesh carry no per-object transform or material.
 struct Object {
-    Object() {
-        transform = inverseTransform = normalTransform = inverseNormalTransform = Eigen::Affine3f::Identity();
-    }
     virtual ~Object(){}
   //! All "Objects" must be able to test for intersections with rays.
   virtual bool getIntersection(
@@ -20,6 +20,13 @@ struct Object {
       IntersectionInfo* intersection)
     const = 0;
 
+  //! Whether the ray hits the object closer than tmax. Objects with an
+  //! acceleration structure of their own override this to stop at any hit.
+  virtual bool occluded(const Ray& ray, float tmax) const {
+    IntersectionInfo I;
+    return getIntersection(ray, &I) && I.t < tmax;
+  }
+
   //! Return an object normal based on an intersection
   virtual Eigen::Vector3f getNormal(const IntersectionInfo& I) const = 0;
 
@@ -28,6 +35,13 @@ struct Object {
 
   //! Return the centroid for this object. (Used in BVH Sorting)
   virtual Eigen::Vector3f getCentroid() const = 0;
+};
+
+//! An Object with its own transform and scene file material
+struct TransformedObject : public Object {
+    TransformedObject() {
+        transform = inverseTransform = normalTransform = inverseNormalTransform = Eigen::Affine3f::Identity();
+    }
 
     SceneMaterial material;
 
@@ -0,0 +1,92 @@
+#include "WideBVH.h"
+#include "BVH.h"
+#include <limits>
+
+template <int N>
+WideBVH<N>::WideBVH(const BVHFlatNode* tree, uint32_t nNodes) {
+  nodes.reserve(nNodes / (N/2) + 1);
+  if(nNodes == 0 || tree[0].nPrims == 0) {
+    // Nothing to hit: a root without children
+    nodes.emplace_back();
+    nodes[0].numChildren = 0;
+    return;
+  }
+  collapse(tree, 0);
+}
+
+/*! Build the wide node covering the binary node, returning its index
+ *  - Start from the binary node's two children and keep replacing the inner
+ *    child with the largest surface area by its own two children, until there
+ *    are N children or only leaves are left.
+ *  - A binary tree that is a single leaf gets a root with one leaf child.
+ */
+template <int N>
+uint32_t WideBVH<N>::collapse(const BVHFlatNode* tree, uint32_t binaryNode) {
+  uint32_t index = nodes.size();
+  nodes.emplace_back();
+
+  uint32_t children[N];
+  uint32_t nChildren = 0;
+  if(tree[binaryNode].rightOffset == 0) {
+    children[nChildren++] = binaryNode;
+  } else {
+    children[nChildren++] = binaryNode + 1;
+    children[nChildren++] = binaryNode + tree[binaryNode].rightOffset;
+  }
+
+  while(nChildren < N) {
+    int best = -1;
+    float bestArea = -1.f;
+    for(uint32_t c = 0; c < nChildren; ++c) {
+      const BVHFlatNode& child = tree[children[c]];
+      if(child.rightOffset != 0 && child.bbox.surfaceArea() > bestArea) {
+        bestArea = child.bbox.surfaceArea();
+        best = c;
+      }
+    }
+    if(best < 0)
+      break;
+    uint32_t opened = children[best];
+    children[best] = opened + 1;
+    children[nChildren++] = opened + tree[opened].rightOffset;
+  }
+
+  // Fill in the slots; empty ones get an inverted box so they can never be hit
+  // (they are masked off by numChildren as well).
+  const float inf = std::numeric_limits<float>::infinity();
+  for(int c = 0; c < N; ++c) {
+    for(int a = 0; a < 3; ++a) {
+      nodes[index].bmin[a][c] = inf;
+      nodes[index].bmax[a][c] = -inf;
+    }
+    nodes[index].child[c] = -1;
+    nodes[index].count[c] = 0;
+  }
+  nodes[index].numChildren = nChildren;
+
+  for(uint32_t c = 0; c < nChildren; ++c) {
+    const BVHFlatNode& child = tree[children[c]];
+    int32_t childIndex;
+    uint32_t count;
+    if(child.rightOffset == 0) {
+      childIndex = child.start;
+      count = child.nPrims;
+    } else {
+      // Recursing may reallocate nodes, so only take references afterwards
+      childIndex = collapse(tree, children[c]);
+      count = 0;
+    }
+    WideBVHNode<N>& node = nodes[index];
+    for(int a = 0; a < 3; ++a) {
+      node.bmin[a][c] = child.bbox.min[a];
+      node.bmax[a][c] = child.bbox.max[a];
+    }
+    node.child[c] = childIndex;
+    node.count[c] = count;
+  }
+
+  return index;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
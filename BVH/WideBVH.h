@@ -0,0 +1,198 @@
+#ifndef WideBVH_h
+#define WideBVH_h
+
+#include <vector>
+#include <stdint.h>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include "Object.h"
+#include "IntersectionInfo.h"
+#include "Ray.h"
+#include "vector3.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+struct BVHFlatNode;
+
+//! Node of an N-wide BVH. The children's bounds are stored per axis (SoA), so
+//! all N boxes are tested against a ray in one SIMD slab test.
+template <int N>
+struct alignas(32) WideBVHNode {
+  float bmin[3][N];
+  float bmax[3][N];
+  int32_t child[N];    // Inner child: node index. Leaf child: first primitive.
+  uint32_t count[N];   // Leaf child: number of primitives. Inner child: 0.
+  uint32_t numChildren;
+};
+
+//! \brief An N-ary (4 or 8) BVH collapsed from the binary flat tree
+//! - Every node pulls up grandchildren of the binary tree (largest surface area
+//!   first) until it has N children, so a ray fetches far fewer nodes.
+//! - Leaves keep referring to the primitive ranges of the binary tree.
+//! - Children that are hit are visited nearest first.
+template <int N>
+class WideBVH {
+  std::vector<WideBVHNode<N>> nodes;
+
+  uint32_t collapse(const BVHFlatNode* tree, uint32_t binaryNode);
+
+  public:
+  WideBVH(const BVHFlatNode* tree, uint32_t nNodes);
+
+  uint32_t getNodeCount() const { return nodes.size(); }
+  size_t getMemoryBytes() const { return nodes.size() * sizeof(WideBVHNode<N>); }
+
+  //! Same contract as BVH::traverse; leaf ranges index the primitive list of the binary tree
+  template <typename LeafRangeTest>
+  bool traverse(const Ray& ray, IntersectionInfo* intersection, bool occlusion, const LeafRangeTest& leafTest,
+                float tmax) const;
+};
+
+//! Slab test of one ray against every child of a node. Returns a bitmask of the
+//! children hit within [0, tmax] and writes their entry distances to tnear.
+template <int N>
+inline uint32_t intersectChildren(const WideBVHNode<N>& node, const float org[3], const float invDir[3],
+                                  float tmax, float tnear[N])
+{
+  uint32_t mask = 0;
+  for(int c = 0; c < N; ++c) {
+    float tn = 0.f, tf = tmax;
+    for(int a = 0; a < 3; ++a) {
+      float t0 = (node.bmin[a][c] - org[a]) * invDir[a];
+      float t1 = (node.bmax[a][c] - org[a]) * invDir[a];
+      tn = std::max(tn, std::min(t0, t1));
+      tf = std::min(tf, std::max(t0, t1));
+    }
+    tnear[c] = tn;
+    mask |= (uint32_t)(tn <= tf) << c;
+  }
+  return mask & ((1u << node.numChildren) - 1);
+}
+
+#if defined(__INTEL_SSE) || defined(__ARM_NEON)
+template <>
+inline uint32_t intersectChildren<4>(const WideBVHNode<4>& node, const float org[3], const float invDir[3],
+                                     float tmax, float tnear[4])
+{
+#if defined(__ARM_NEON)
+  float32x4_t tn = vdupq_n_f32(0.f), tf = vdupq_n_f32(tmax);
+  for(int a = 0; a < 3; ++a) {
+    float32x4_t o = vdupq_n_f32(org[a]), inv = vdupq_n_f32(invDir[a]);
+    float32x4_t t0 = vmulq_f32(vsubq_f32(vld1q_f32(node.bmin[a]), o), inv);
+    float32x4_t t1 = vmulq_f32(vsubq_f32(vld1q_f32(node.bmax[a]), o), inv);
+    tn = vmaxq_f32(tn, vminq_f32(t0, t1));
+    tf = vminq_f32(tf, vmaxq_f32(t0, t1));
+  }
+  vst1q_f32(tnear, tn);
+  uint32x4_t hit = vcleq_f32(tn, tf);
+  static const uint32x4_t bits = {1, 2, 4, 8};
+  uint32_t mask = vaddvq_u32(vandq_u32(hit, bits));
+#else
+  __m128 tn = _mm_setzero_ps(), tf = _mm_set1_ps(tmax);
+  for(int a = 0; a < 3; ++a) {
+    __m128 o = _mm_set1_ps(org[a]), inv = _mm_set1_ps(invDir[a]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[a]), o), inv);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[a]), o), inv);
+    tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+    tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+  }
+  _mm_storeu_ps(tnear, tn);
+  uint32_t mask = _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#endif
+  return mask & ((1u << node.numChildren) - 1);
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline uint32_t intersectChildren<8>(const WideBVHNode<8>& node, const float org[3], const float invDir[3],
+                                     float tmax, float tnear[8])
+{
+  __m256 tn = _mm256_setzero_ps(), tf = _mm256_set1_ps(tmax);
+  for(int a = 0; a < 3; ++a) {
+    __m256 o = _mm256_set1_ps(org[a]), inv = _mm256_set1_ps(invDir[a]);
+    __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bmin[a]), o), inv);
+    __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bmax[a]), o), inv);
+    tn = _mm256_max_ps(tn, _mm256_min_ps(t0, t1));
+    tf = _mm256_min_ps(tf, _mm256_max_ps(t0, t1));
+  }
+  _mm256_storeu_ps(tnear, tn);
+  uint32_t mask = _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+  return mask & ((1u << node.numChildren) - 1);
+}
+#endif
+
+//! Entry of the traversal stack: an inner node (count == 0) or a leaf's primitive range
+struct WideBVHTraversal {
+  int32_t index;
+  uint32_t count;
+  float mint;
+};
+
+template <int N>
+template <typename LeafRangeTest>
+bool WideBVH<N>::traverse(const Ray& ray, IntersectionInfo* intersection, bool occlusion, const LeafRangeTest& leafTest,
+                          float tmax) const {
+  intersection->t = tmax;
+  intersection->object = NULL;
+
+  // Ray::inv_d is normalized, which is fine for a hit test but not for distances.
+  // Zero components get a huge finite inverse instead of inf so 0 * inv stays 0, not NaN.
+  const float org[3] = { ray.o.x(), ray.o.y(), ray.o.z() };
+  float invDir[3];
+  for(int a = 0; a < 3; ++a)
+    invDir[a] = std::fabs(ray.d[a]) > 1e-30f ? 1.f / ray.d[a] : std::copysign(1e30f, ray.d[a]);
+
+  // Every level of the tree leaves at most N-1 siblings behind on the stack
+  WideBVHTraversal todo[128 * (N - 1) + 1];
+  int32_t stackptr = 0;
+  todo[0] = { 0, 0, 0.f };
+
+  alignas(32) float tnear[N];
+  while(stackptr >= 0) {
+    WideBVHTraversal entry = todo[stackptr--];
+
+    // If this node is further than the closest found intersection, continue
+    if(entry.mint > intersection->t)
+      continue;
+
+    if(entry.count > 0) {
+      if(leafTest(entry.index, entry.count, intersection) && occlusion) {
+        return true;
+      }
+      continue;
+    }
+
+    const WideBVHNode<N>& node = nodes[entry.index];
+    uint32_t mask = intersectChildren<N>(node, org, invDir, intersection->t, tnear);
+
+    // Sort the children that were hit far to near, then push them in that
+    // order so the nearest one is popped first.
+    WideBVHTraversal hits[N];
+    int nHits = 0;
+    while(mask) {
+      int c = std::countr_zero(mask);
+      mask &= mask - 1;
+      WideBVHTraversal hit = { node.child[c], node.count[c], tnear[c] };
+      int h = nHits++;
+      while(h > 0 && hits[h-1].mint < hit.mint) {
+        hits[h] = hits[h-1];
+        --h;
+      }
+      hits[h] = hit;
+    }
+    for(int h = 0; h < nHits; ++h)
+      todo[++stackptr] = hits[h];
+  }
+
+  // If we hit something,
+  if(intersection->object != NULL)
+    intersection->hit = ray.o + ray.d * intersection->t;
+
+  return intersection->object != NULL;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include "checkpoint.h"
+
+#include "BVH/Log.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+// File layout, in host byte order:
+//   char magic[4] = "PTCK", uint32 version
+//   int32 width, height, pass; double elapsedSeconds; uint64 settingsHash
+//   int32 split, workerIndex, workerCount
+//   per pixel: float sum[3]; double luminanceMean, luminanceM2; uint32 samples
+const char Magic[4] = {'P', 'T', 'C', 'K'};
+const uint32_t Version = 2;
+
+template<typename T>
+void put(std::ofstream &file, const T &value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template<typename T>
+bool get(std::ifstream &file, T &value)
+{
+    return (bool)file.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+// FNV-1a
+void hashBytes(uint64_t &hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for(size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+}
+
+template<typename T>
+void hashValue(uint64_t &hash, const T &value)
+{
+    hashBytes(hash, &value, sizeof(T));
+}
+
+}
+
+bool RenderCheckpoint::write(const std::string &path) const
+{
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if(!file) {
+            LOG_ERROR("Could not open checkpoint %s for writing", tempPath.c_str());
+            return false;
+        }
+        file.write(Magic, sizeof(Magic));
+        put(file, Version);
+        put(file, (int32_t)width);
+        put(file, (int32_t)height);
+        put(file, (int32_t)pass);
+        put(file, elapsedSeconds);
+        put(file, settingsHash);
+        put(file, (int32_t)split);
+        put(file, (int32_t)workerIndex);
+        put(file, (int32_t)workerCount);
+        for(const PixelStats &pixel : pixels) {
+            put(file, pixel.sum.x());
+            put(file, pixel.sum.y());
+            put(file, pixel.sum.z());
+            put(file, pixel.luminanceMean);
+            put(file, pixel.luminanceM2);
+            put(file, pixel.samples);
+        }
+        if(!file.flush()) {
+            LOG_ERROR("Could not write checkpoint %s", tempPath.c_str());
+            return false;
+        }
+    }
+    if(std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        LOG_ERROR("Could not move checkpoint to %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool RenderCheckpoint::read(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file) {
+        LOG_ERROR("Could not open checkpoint %s", path.c_str());
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version;
+    int32_t w, h, p, s, worker, workers;
+    if(!file.read(magic, sizeof(magic)) || memcmp(magic, Magic, sizeof(Magic)) != 0
+       || !get(file, version) || version != Version) {
+        LOG_ERROR("%s is not a checkpoint of this renderer version", path.c_str());
+        return false;
+    }
+    if(!get(file, w) || !get(file, h) || !get(file, p) || !get(file, elapsedSeconds) || !get(file, settingsHash)
+       || !get(file, s) || !get(file, worker) || !get(file, workers)
+       || w <= 0 || h <= 0 || workers <= 0 || worker < 0 || worker >= workers) {
+        LOG_ERROR("Checkpoint %s has a broken header", path.c_str());
+        return false;
+    }
+    width = w;
+    height = h;
+    pass = p;
+    split = s == (int32_t)RenderSplit::Image ? RenderSplit::Image : RenderSplit::Samples;
+    workerIndex = worker;
+    workerCount = workers;
+
+    pixels.assign((size_t)width * height, PixelStats());
+    for(PixelStats &pixel : pixels) {
+        float x, y, z;
+        if(!get(file, x) || !get(file, y) || !get(file, z)
+           || !get(file, pixel.luminanceMean) || !get(file, pixel.luminanceM2) || !get(file, pixel.samples)) {
+            LOG_ERROR("Checkpoint %s is truncated", path.c_str());
+            return false;
+        }
+        pixel.sum = Eigen::Vector3f(x, y, z);
+    }
+    return true;
+}
+
+void RenderCheckpoint::merge(const RenderCheckpoint &other)
+{
+    for(size_t i = 0; i < pixels.size() && i < other.pixels.size(); ++i) {
+        pixels[i].merge(other.pixels[i]);
+    }
+    pass = std::max(pass, other.pass);
+    elapsedSeconds = std::max(elapsedSeconds, other.elapsedSeconds);
+}
+
+uint64_t RenderCheckpoint::hashSettings(const Settings &settings, int width, int height)
+{
+    // Only the scene and what changes the samples a pixel gets or their values. Time budget, noise threshold,
+    // thread count and tile size can differ between the runs of one render. The worker's share
+    // is kept next to the hash, so the partials of the workers of one render hash the same.
+    uint64_t hash = 14695981039346656037ull;
+    hashValue(hash, settings.sceneKey);
+    hashValue(hash, width);
+    hashValue(hash, height);
+    hashValue(hash, settings.samplesPerPixel);
+    hashValue(hash, settings.directLightingOnly);
+    hashValue(hash, settings.numDirectLightingSamples);
+    hashValue(hash, settings.pathContinuationProb);
+    hashValue(hash, settings.maxDepth);
+    hashValue(hash, settings.lightSelection);
+    hashValue(hash, settings.mis);
+    hashValue(hash, settings.sampler);
+    hashValue(hash, settings.adaptiveThreshold);
+    hashValue(hash, settings.maxSamplesPerPixel);
+    return hash;
+}
@@ -0,0 +1,37 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "pathtracer.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Everything needed to carry on with a render: the accumulated samples of every pixel and
+// how far the passes got. The samplers are pure functions of the pixel and sample index, so
+// the per-pixel sample counts are all the sampler state there is. The workers of a
+// distributed render write their final one as their partial of the frame.
+struct RenderCheckpoint {
+    int width, height;
+    int pass; // passes finished
+    double elapsedSeconds; // render time so far, counted against the time budget
+    uint64_t settingsHash; // of the settings that decide what the samples are, see hashSettings
+    RenderSplit split; // the share of a distributed render this is
+    int workerIndex, workerCount;
+    std::vector<PixelStats> pixels;
+
+    RenderCheckpoint() : width(0), height(0), pass(0), elapsedSeconds(0.0), settingsHash(0),
+        split(RenderSplit::Samples), workerIndex(0), workerCount(1) {}
+
+    // Writes to a temporary file next to path and renames it over path, so a render killed
+    // while writing leaves the previous checkpoint intact
+    bool write(const std::string &path) const;
+    bool read(const std::string &path);
+
+    // Adds the samples of the partial of another worker of the same render
+    void merge(const RenderCheckpoint &other);
+
+    static uint64_t hashSettings(const Settings &settings, int width, int height);
+};
+
+#endif // CHECKPOINT_H
@@ -1,9 +1,12 @@
 #include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QImage>
+#include <QProcess>
+#include <QThread>
 #include <QtCore>
 
 #include <iostream>
+#include <memory>
 
 #include "pathtracer.h"
 #include "scene/scene.h"
@@ -12,6 +15,35 @@
 
 #include "util/Common.h"
 
+// Renders the frame with one worker process of this program per partial path, all on this
+// machine, and waits for them. Returns false if any of them failed.
+static bool runLocalWorkers(const QString &configPath, const QStringList &partialPaths, int threadsPerWorker, bool resume)
+{
+    int count = partialPaths.size();
+    std::vector<std::unique_ptr<QProcess>> workers;
+    for(int i = 0; i < count; ++i) {
+        QStringList arguments;
+        arguments << configPath << "--worker" << QString::number(i) << "--workers" << QString::number(count)
+                  << "--partial" << partialPaths[i] << "--threads" << QString::number(threadsPerWorker);
+        if(resume) {
+            arguments << "--resume";
+        }
+        workers.emplace_back(new QProcess());
+        workers.back()->setProcessChannelMode(QProcess::ForwardedChannels);
+        workers.back()->start(QCoreApplication::applicationFilePath(), arguments);
+    }
+
+    bool success = true;
+    for(int i = 0; i < count; ++i) {
+        QProcess &worker = *workers[i];
+        if(!worker.waitForFinished(-1) || worker.exitStatus() != QProcess::NormalExit || worker.exitCode() != 0) {
+            std::cerr << "Error: worker " << i << " failed" << std::endl;
+            success = false;
+        }
+    }
+    return success;
+}
+
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
@@ -19,10 +51,25 @@ int main(int argc, char *argv[])
     QCommandLineParser parser;
     parser.addHelpOption();
     parser.addPositionalArgument("config", "Path of the config file.");
+    parser.addPositionalArgument("partials", "With --merge, the partial renders to combine.", "[partials...]");
+    QCommandLineOption resumeOption("resume", "Carry on from the checkpoint named by IO/checkpoint, or a worker's partial.");
+    parser.addOption(resumeOption);
+    QCommandLineOption workerOption("worker", "Render only share <index> of the frame and write it as a partial render.", "index");
+    parser.addOption(workerOption);
+    QCommandLineOption workersOption("workers", "Number of workers the frame is split between.", "count", "1");
+    parser.addOption(workersOption);
+    QCommandLineOption partialOption("partial", "Where a worker writes its partial render (default: the output path with .part<index>).", "path");
+    parser.addOption(partialOption);
+    QCommandLineOption mergeOption("merge", "Combine the partial renders of all workers into the output image.");
+    parser.addOption(mergeOption);
+    QCommandLineOption processesOption("processes", "Render with this many worker processes on this machine and merge their partials.", "count");
+    parser.addOption(processesOption);
+    QCommandLineOption threadsOption("threads", "Render threads per process, overriding Settings/numThreads.", "count");
+    parser.addOption(threadsOption);
     parser.process(a);
 
     auto positionalArgs = parser.positionalArguments();
-    if (positionalArgs.size() != 1) {
+    if (positionalArgs.size() < 1 || (positionalArgs.size() > 1 && !parser.isSet(mergeOption))) {
         std::cerr << "Not enough arguments. Please provide a path to a config file (.ini) as a command-line argument." << std::endl;
         a.exit(1);
         return 1;
@@ -35,12 +82,25 @@ int main(int argc, char *argv[])
 
     QImage image(imageWidth, imageHeight, QImage::Format_RGB32);
 
-    Scene *scene;
-    if(!Scene::load(inputScenePath, &scene, imageWidth, imageHeight)) {
-        std::cerr << "Error parsing scene file " << inputScenePath.toStdString() << std::endl;
-        a.exit(1);
-        return 1;
-    }
+    BVHBuildSettings bvhSettings;
+    // "sah" for the binned surface area heuristic; the default is the original midpoint split
+    QString splitMethod = settings.value("Settings/bvhSplitMethod", "midpoint").toString();
+    bvhSettings.splitMethod = splitMethod == "sah" ? BVHSplitMethod::SAH : BVHSplitMethod::Midpoint;
+    bvhSettings.sahBins = settings.value("Settings/bvhBins", bvhSettings.sahBins).toInt();
+    bvhSettings.maxLeafSize = settings.value("Settings/bvhMaxLeafSize", bvhSettings.maxLeafSize).toInt();
+    int numThreads = parser.isSet(threadsOption) ? parser.value(threadsOption).toInt()
+                                                 : settings.value("Settings/numThreads", 0).toInt();
+    bvhSettings.numThreads = numThreads;
+    bvhSettings.flattenScene = settings.value("Settings/bvhFlatten", true).toBool();
+    bvhSettings.width = settings.value("Settings/bvhWidth", bvhSettings.width).toInt();
+
+    QString samplerName = settings.value("Settings/sampler", "sobol").toString();
+    SamplerType samplerType = samplerName == "independent" ? SamplerType::Independent
+                            : samplerName == "halton" ? SamplerType::Halton : SamplerType::Sobol;
+
+    // "tinyobj" reads .obj files with the old single threaded loader, to compare against
+    ObjLoaderType objLoader = settings.value("Settings/objLoader", "parallel").toString() == "tinyobj"
+            ? ObjLoaderType::TinyObj : ObjLoaderType::Parallel;
 
     PathTracer tracer(imageWidth, imageHeight);
     tracer.settings = {
@@ -48,12 +108,121 @@ int main(int argc, char *argv[])
         .directLightingOnly = settings.value("Settings/directLightingOnly").toBool(),
         .numDirectLightingSamples = settings.value("Settings/numDirectLightingSamples").toInt(),
         .pathContinuationProb = settings.value("Settings/pathContinuationProb").toFloat(),
+        .tileSize = settings.value("Settings/tileSize", 16).toInt(),
+        .numThreads = numThreads,
+        .maxDepth = settings.value("Settings/maxDepth", PathTracer::MaxPathDepth).toInt(),
+        .lightSelection = settings.value("Settings/lightSelection", "tree").toString() == "power"
+                ? LightSelection::Power : LightSelection::Tree,
+        .mis = settings.value("Settings/mis", true).toBool(),
+        .sampler = samplerType,
+        .adaptiveThreshold = settings.value("Settings/adaptiveThreshold", 0).toFloat(),
+        .maxSamplesPerPixel = settings.value("Settings/maxSamplesPerPixel", 1024).toInt(),
+        .timeBudget = settings.value("Settings/timeBudget", 0).toFloat(),
+        .noiseThreshold = settings.value("Settings/noiseThreshold", 0).toFloat(),
+        .progressInterval = settings.value("Settings/progressInterval", 10).toFloat(),
+        .checkpointPath = settings.value("IO/checkpoint").toString().toStdString(),
+        .checkpointInterval = settings.value("Settings/checkpointInterval", 60).toFloat(),
+        .split = settings.value("Settings/split", "samples").toString() == "image" ? RenderSplit::Image : RenderSplit::Samples,
+        .workerIndex = parser.value(workerOption).toInt(),
+        .workerCount = std::max(parser.value(workersOption).toInt(), 1),
+        .sceneKey = 0,
     };
 
     QRgb *data = reinterpret_cast<QRgb *>(image.bits());
 
-    tracer.traceScene(data, *scene);
-    delete scene;
+    QString outputPFMPath = settings.value("IO/outputPFM").toString();
+    bool worker = parser.isSet(workerOption);
+    bool workerIndexIsNumber;
+    parser.value(workerOption).toInt(&workerIndexIsNumber);
+    if(worker && (!workerIndexIsNumber || tracer.settings.workerIndex < 0 || tracer.settings.workerIndex >= tracer.settings.workerCount)) {
+        std::cerr << "Error: --worker " << parser.value(workerOption).toStdString() << " is not in [0, "
+                  << tracer.settings.workerCount << "), the range --workers gives" << std::endl;
+        a.exit(1);
+        return 1;
+    }
+    int processes = parser.value(processesOption).toInt();
+    // Checkpoints and partials carry the scene's key; it takes reading every file of the scene
+    if(processes > 1 || parser.isSet(mergeOption) || worker || !tracer.settings.checkpointPath.empty()) {
+        if(!Scene::sourceKey(inputScenePath, &tracer.settings.sceneKey)) {
+            std::cerr << "Error parsing scene file " << inputScenePath.toStdString() << std::endl;
+            a.exit(1);
+            return 1;
+        }
+    }
+    if(processes > 1 || parser.isSet(mergeOption)) {
+        // A distributed render: local worker processes or partials from elsewhere, merged into the image
+        QStringList partialPaths;
+        if(processes > 1) {
+            for(int i = 0; i < processes; ++i) {
+                partialPaths << outputImagePath + ".part" + QString::number(i);
+            }
+            int threadsPerWorker = numThreads > 0 ? numThreads : std::max(QThread::idealThreadCount() / processes, 1);
+            if(!runLocalWorkers(positionalArgs[0], partialPaths, threadsPerWorker, parser.isSet(resumeOption))) {
+                a.exit(1);
+                return 1;
+            }
+        } else {
+            for(int i = 1; i < positionalArgs.size(); ++i) {
+                partialPaths << positionalArgs[i];
+            }
+        }
+
+        std::vector<std::string> paths;
+        for(const QString &path : partialPaths) {
+            paths.push_back(path.toStdString());
+        }
+        if(!tracer.mergePartials(paths, data)) {
+            std::cerr << "Error: cannot merge the partial renders" << std::endl;
+            a.exit(1);
+            return 1;
+        }
+    } else {
+        // A worker keeps its partial render where it would keep its checkpoint
+        if(worker) {
+            QString partialPath = parser.isSet(partialOption) ? parser.value(partialOption)
+                                                              : outputImagePath + ".part" + QString::number(tracer.settings.workerIndex);
+            tracer.settings.checkpointPath = partialPath.toStdString();
+        } else {
+            // Progressive renders keep overwriting the outputs with the image so far
+            tracer.progressHook = [&](std::vector<Eigen::Vector3f> &intensityValues) {
+                if(!image.save(outputImagePath, "PNG")) {
+                    std::cerr << "Error: failed to write image to " << outputImagePath.toStdString() << std::endl;
+                }
+                if(!outputPFMPath.isEmpty()) {
+                    outputPFM(outputPFMPath.toStdString(), imageWidth, imageHeight, intensityValues);
+                }
+            };
+        }
+
+        if(parser.isSet(resumeOption)) {
+            if(tracer.settings.checkpointPath.empty() || !tracer.resumeFrom(tracer.settings.checkpointPath)) {
+                std::cerr << "Error: cannot resume, IO/checkpoint must name a checkpoint of this render" << std::endl;
+                a.exit(1);
+                return 1;
+            }
+        }
+
+        Scene *scene;
+        if(!Scene::load(inputScenePath, &scene, imageWidth, imageHeight, bvhSettings, settings.value("IO/sceneCache").toString(), objLoader)) {
+            std::cerr << "Error parsing scene file " << inputScenePath.toStdString() << std::endl;
+            a.exit(1);
+            return 1;
+        }
+        tracer.traceScene(data, *scene);
+        delete scene;
+
+        if(worker) {
+            std::cout << "Wrote partial render to " << tracer.settings.checkpointPath << std::endl;
+            a.exit();
+            return 0;
+        }
+    }
+
+    if(!outputPFMPath.isEmpty()) {
+        std::vector<Eigen::Vector3f> intensityValues = tracer.getIntensityValues();
+        outputPFM(outputPFMPath.toStdString(), imageWidth, imageHeight, intensityValues);
+        std::cout << "Wrote radiance to " << outputPFMPath.toStdString() << std::endl;
+    }
 
     bool success = image.save(outputImagePath);
     if(!success) {
@@ -64,5 +233,16 @@ int main(int argc, char *argv[])
     } else {
         std::cerr << "Error: failed to write image to " << outputImagePath.toStdString() << std::endl;
     }
+
+    QString sampleMapPath = settings.value("IO/sampleCountMap").toString();
+    if(!sampleMapPath.isEmpty()) {
+        QImage sampleMap(imageWidth, imageHeight, QImage::Format_RGB32);
+        tracer.sampleCountMap(reinterpret_cast<QRgb *>(sampleMap.bits()));
+        if(sampleMap.save(sampleMapPath, "PNG")) {
+            std::cout << "Wrote sample count map to " << sampleMapPath.toStdString() << std::endl;
+        } else {
+            std::cerr << "Error: failed to write sample count map to " << sampleMapPath.toStdString() << std::endl;
+        }
+    }
     a.exit();
 }
@@ -1,5 +1,4 @@
 QT += gui
-QT += xml
 
 CONFIG += c++11 console
 CONFIG -= app_bundle
@@ -21,20 +20,33 @@ QMAKE_CXXFLAGS += -msse2
 
 SOURCES += main.cpp \
     pathtracer.cpp \
+    tilescheduler.cpp \
+    checkpoint.cpp \
     scene/scene.cpp \
     BVH/BBox.cpp \
     BVH/BVH.cpp \
+    BVH/WideBVH.cpp \
     scene/camera.cpp \
+    scene/lightsampler.cpp \
+    scene/lightbvh.cpp \
+    scene/scenecache.cpp \
+    scene/objloader.cpp \
     scene/basiccamera.cpp \
     util/CS123XmlSceneParser.cpp \
+    util/Sampler.cpp \
     scene/shape/mesh.cpp \
-    scene/shape/triangle.cpp
+    scene/shape/meshinstance.cpp \
+    scene/shape/triangle.cpp \
+    scene/shape/triangleblocks.cpp
 
 HEADERS += \
     pathtracer.h \
+    tilescheduler.h \
+    checkpoint.h \
     scene/scene.h \
     BVH/BBox.h \
     BVH/BVH.h \
+    BVH/WideBVH.h \
     BVH/IntersectionInfo.h \
     BVH/Log.h \
     BVH/Object.h \
@@ -44,11 +56,22 @@ HEADERS += \
     scene/basiccamera.h \
     util/CS123Common.h \
     util/CS123ISceneParser.h \
+    util/RandomStream.h \
+    util/AliasTable.h \
+    util/BlockPool.h \
+    util/Sampler.h \
     util/CS123SceneData.h \
     util/CS123XmlSceneParser.h \
+    scene/lightbvh.h \
+    scene/scenecache.h \
+    scene/objloader.h \
+    scene/lightsampler.h \
+    scene/material.h \
     scene/shape/Sphere.h \
     scene/shape/mesh.h \
+    scene/shape/meshinstance.h \
     scene/shape/triangle.h \
+    scene/shape/triangleblocks.h \
     util/tiny_obj_loader.h \
     BVH/vector3.h \
 
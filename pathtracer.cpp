@@ -1,54 +1,318 @@
 #include "pathtracer.h"
+#include "checkpoint.h"
+#include "tilescheduler.h"
 
+#include "BVH/Stopwatch.h"
+
+#include <atomic>
 #include <iostream>
 
 #include <Eigen/Dense>
 
 #include <util/Common.h>
 
-#include <random>
-
 using namespace Eigen;
 
-namespace {
-    thread_local std::mt19937 generator;
-    thread_local std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-}
-
 PathTracer::PathTracer(int width, int height)
-    : m_width(width), m_height(height)
+    : m_width(width), m_height(height), m_resumed(false), m_resumedPasses(0), m_resumedSeconds(0.0),
+      m_rowBegin(0), m_rowEnd(height)
 {
 }
 
 void PathTracer::traceScene(QRgb *imageData, const Scene& scene)
 {
-    std::vector<Vector3f> intensityValues(m_width * m_height);
     Matrix4f invViewMat = (scene.getCamera().getScaleMatrix() * scene.getCamera().getViewMatrix()).inverse();
-    int gridSize = (int)ceil(sqrt(settings.samplesPerPixel)); // for stratified sampling, based on pixels to be sampled
-    for(int y = 0; y < m_height; ++y) {
-        //#pragma omp parallel for
+    if(!m_resumed) {
+        m_pixels.assign(m_width * m_height, PixelStats());
+        m_resumedPasses = 0;
+        m_resumedSeconds = 0.0;
+    }
+    m_resumed = false;
+
+    // Every pixel gets samplesPerPixel samples in the first pass. In adaptive mode, each later
+    // pass gives another batch of that size to the pixels still above the error threshold.
+    // In progressive mode every pixel gets another batch each pass (or only the adaptive ones)
+    // until the time budget runs out or the image is below the noise threshold.
+    bool adaptive = settings.adaptiveThreshold > 0.f;
+    bool progressive = settings.timeBudget > 0.f || settings.noiseThreshold > 0.f;
+    int batchSize = std::max(settings.samplesPerPixel, 1);
+    uint32_t maxSamples = adaptive || progressive ? std::max(settings.maxSamplesPerPixel, batchSize) : batchSize;
+
+    // A worker of a distributed render takes either a band of rows or the sample indices
+    // [firstSample, firstSample + maxSamples) of every pixel. Merged, the sample split gives
+    // the first workerCount * maxSamples samples of the sequence, as one render of that many would.
+    int workers = std::max(settings.workerCount, 1);
+    int worker = settings.workerIndex;
+    uint32_t firstSample = 0;
+    m_rowBegin = 0;
+    m_rowEnd = m_height;
+    if(workers > 1 && settings.split == RenderSplit::Image) {
+        m_rowBegin = (int)((long long)m_height * worker / workers);
+        m_rowEnd = (int)((long long)m_height * (worker + 1) / workers);
+    } else if(workers > 1) {
+        firstSample = worker * maxSamples;
+    }
+
+    std::atomic<uint64_t> totalPaths(0), totalBounces(0);
+    std::vector<uint8_t> active(m_pixels.size(), 0);
+    std::fill(active.begin() + m_rowBegin * m_width, active.begin() + m_rowEnd * m_width, 1);
+
+    TileScheduler scheduler(m_width, m_height, settings.tileSize, settings.numThreads, m_rowBegin, m_rowEnd);
+    Stopwatch clock;
+    // Time spent before a resume counts against the budget too
+    auto elapsed = [&]() { return m_resumedSeconds + clock.read(); };
+    double lastWrite = elapsed(), lastCheckpoint = elapsed();
+    int pass = m_resumedPasses;
+    while(true) {
+        // Decide from the samples so far whether to go on. A resumed render does the same
+        // with the samples from its checkpoint, so it takes the same passes it would have.
+        if(pass > 0) {
+            int activePixels = updateActivePixels(active, maxSamples);
+            if(adaptive) {
+                LOG_STAT("Adaptive pass %d: %d pixels above the error threshold", pass, activePixels);
+            }
+            if(activePixels == 0) {
+                break;
+            }
+            if(progressive) {
+                float noise = meanRelativeError();
+                LOG_STAT("Progressive pass %d: %.1f s, noise %.4f", pass, elapsed(), noise);
+                if(outOfTime(elapsed()) || (settings.noiseThreshold > 0.f && noise <= settings.noiseThreshold)) {
+                    break;
+                }
+                if(progressHook && elapsed() - lastWrite >= settings.progressInterval) {
+                    std::vector<Vector3f> intensityValues = getIntensityValues();
+                    toneMap(imageData, intensityValues);
+                    progressHook(intensityValues);
+                    lastWrite = elapsed();
+                }
+            }
+        }
+
+        scheduler.run([&](const Tile &tile) {
+            // Once the budget is spent, leave the rest of the pass; a pixel's mean is fine with any sample count
+            if(pass > 0 && outOfTime(elapsed())) {
+                return;
+            }
+            uint64_t tilePaths = 0, tileBounces = 0;
+            std::unique_ptr<Sampler> rng = Sampler::create(settings.sampler);
+            for(int y = tile.y0; y < tile.y1; ++y) {
+                for(int x = tile.x0; x < tile.x1; ++x) {
+                    int offset = x + (y * m_width);
+                    PixelStats &pixel = m_pixels[offset];
+                    if(!active[offset]) {
+                        continue;
+                    }
+
+                    // the sampler spreads the pixel's samples over the pixel area and every other dimension
+                    uint32_t end = std::min(pixel.samples + batchSize, maxSamples);
+                    for(uint32_t s = pixel.samples; s < end; ++s) {
+                        rng->startSample(offset, firstSample + s);
+
+                        // jitter, previously in tracePixel
+                        float jitterX, jitterY;
+                        rng->next2D(&jitterX, &jitterY);
+                        jitterX -= 0.5f;
+                        jitterY -= 0.5f;
+
+                        int bounces;
+                        pixel.add(tracePixel(x, y, scene, invViewMat, jitterX, jitterY, *rng, bounces));
+                        ++tilePaths;
+                        tileBounces += bounces;
+                    }
+                }
+            }
+            totalPaths += tilePaths;
+            totalBounces += tileBounces;
+        });
+        ++pass;
+
+        if(!settings.checkpointPath.empty() && settings.checkpointInterval > 0.f
+           && elapsed() - lastCheckpoint >= settings.checkpointInterval) {
+            writeCheckpoint(pass, elapsed());
+            lastCheckpoint = elapsed();
+        }
+    }
+    // The final state too, so the render can be carried on with a bigger budget
+    if(!settings.checkpointPath.empty()) {
+        writeCheckpoint(pass, elapsed());
+    }
+
+    scheduler.reportUtilization();
+    LOG_STAT("Traced %llu paths, %.2f bounces per path", (unsigned long long)totalPaths.load(),
+             (double)totalBounces.load() / std::max<uint64_t>(totalPaths.load(), 1));
+    if(adaptive) {
+        LOG_STAT("Adaptive sampling: %.1f samples per pixel on average, at most %u",
+                 (double)totalPaths.load() / std::max((m_rowEnd - m_rowBegin) * m_width, 1), maxSamples);
+    }
+
+    std::vector<Vector3f> intensityValues = getIntensityValues();
+    toneMap(imageData, intensityValues);
+}
+
+bool PathTracer::resumeFrom(const std::string &checkpointPath)
+{
+    RenderCheckpoint checkpoint;
+    if(!checkpoint.read(checkpointPath)) {
+        return false;
+    }
+    if(checkpoint.width != m_width || checkpoint.height != m_height
+       || checkpoint.settingsHash != RenderCheckpoint::hashSettings(settings, m_width, m_height)
+       || checkpoint.split != settings.split || checkpoint.workerIndex != settings.workerIndex
+       || checkpoint.workerCount != std::max(settings.workerCount, 1)) {
+        LOG_ERROR("Checkpoint %s was made with a different scene, image size or sample settings", checkpointPath.c_str());
+        return false;
+    }
+    m_pixels = std::move(checkpoint.pixels);
+    m_resumedPasses = checkpoint.pass;
+    m_resumedSeconds = checkpoint.elapsedSeconds;
+    m_resumed = true;
+    LOG_INFO("Resuming after pass %d, %.1f s in", m_resumedPasses, m_resumedSeconds);
+    return true;
+}
+
+void PathTracer::writeCheckpoint(int pass, double elapsedSeconds) const
+{
+    RenderCheckpoint checkpoint;
+    checkpoint.width = m_width;
+    checkpoint.height = m_height;
+    checkpoint.pass = pass;
+    checkpoint.elapsedSeconds = elapsedSeconds;
+    checkpoint.settingsHash = RenderCheckpoint::hashSettings(settings, m_width, m_height);
+    checkpoint.split = settings.split;
+    checkpoint.workerIndex = settings.workerIndex;
+    checkpoint.workerCount = std::max(settings.workerCount, 1);
+    checkpoint.pixels = m_pixels;
+    if(checkpoint.write(settings.checkpointPath)) {
+        LOG_INFO("Wrote checkpoint after pass %d to %s", pass, settings.checkpointPath.c_str());
+    }
+}
+
+bool PathTracer::mergePartials(const std::vector<std::string> &partialPaths, QRgb *imageData)
+{
+    if(partialPaths.empty()) {
+        LOG_ERROR("No partials to merge");
+        return false;
+    }
+    RenderCheckpoint merged;
+    std::vector<uint8_t> seen;
+    for(const std::string &path : partialPaths) {
+        RenderCheckpoint partial;
+        if(!partial.read(path)) {
+            return false;
+        }
+        if(partial.width != m_width || partial.height != m_height
+           || partial.settingsHash != RenderCheckpoint::hashSettings(settings, m_width, m_height)) {
+            LOG_ERROR("Partial %s was made with a different scene, image size or sample settings", path.c_str());
+            return false;
+        }
+        if(seen.empty()) {
+            seen.assign(partial.workerCount, 0);
+            merged.split = partial.split;
+            merged.workerCount = partial.workerCount;
+        } else if(partial.split != merged.split || partial.workerCount != merged.workerCount) {
+            LOG_ERROR("Partial %s belongs to a render split differently", path.c_str());
+            return false;
+        }
+        if(seen[partial.workerIndex]) {
+            LOG_ERROR("Partial %s repeats worker %d", path.c_str(), partial.workerIndex);
+            return false;
+        }
+        seen[partial.workerIndex] = 1;
+
+        if(merged.pixels.empty()) {
+            merged = std::move(partial);
+        } else {
+            merged.merge(partial);
+        }
+    }
+    int missing = std::count(seen.begin(), seen.end(), 0);
+    if(missing > 0) {
+        LOG_ERROR("Missing the partials of %d of %d workers", missing, (int)seen.size());
+        return false;
+    }
+
+    m_pixels = std::move(merged.pixels);
+    LOG_INFO("Merged the partials of %d workers, %.1f s for the slowest", (int)seen.size(), merged.elapsedSeconds);
+    std::vector<Vector3f> intensityValues = getIntensityValues();
+    toneMap(imageData, intensityValues);
+    return true;
+}
+
+std::vector<Vector3f> PathTracer::getIntensityValues() const
+{
+    std::vector<Vector3f> intensityValues(m_pixels.size());
+    for(size_t i = 0; i < m_pixels.size(); ++i) {
+        intensityValues[i] = m_pixels[i].mean();
+    }
+    return intensityValues;
+}
+
+bool PathTracer::outOfTime(double elapsedSeconds) const
+{
+    return settings.timeBudget > 0.f && elapsedSeconds >= settings.timeBudget;
+}
+
+float PathTracer::meanRelativeError() const
+{
+    double sum = 0.0;
+    size_t begin = (size_t)m_rowBegin * m_width, end = (size_t)m_rowEnd * m_width;
+    for(size_t i = begin; i < end; ++i) {
+        sum += m_pixels[i].relativeError();
+    }
+    return end > begin ? sum / (end - begin) : 0.f;
+}
+
+int PathTracer::updateActivePixels(std::vector<uint8_t> &active, uint32_t maxSamples) const
+{
+    int count = 0;
+    if(settings.adaptiveThreshold <= 0.f) {
+        for(size_t i = (size_t)m_rowBegin * m_width; i < (size_t)m_rowEnd * m_width; ++i) {
+            active[i] = m_pixels[i].samples < maxSamples;
+            count += active[i];
+        }
+        return count;
+    }
+
+    // A pixel's error is averaged over its 3x3 neighbourhood. Judged on its own samples only,
+    // a pixel whose first samples happen to miss a rare bright path looks converged and stops
+    // early, which darkens the image on average.
+    std::vector<float> errors(m_pixels.size());
+    for(size_t i = 0; i < m_pixels.size(); ++i) {
+        errors[i] = m_pixels[i].relativeError();
+    }
+    // only over the rows this worker renders; the pixels of other bands have no samples
+    for(int y = m_rowBegin; y < m_rowEnd; ++y) {
         for(int x = 0; x < m_width; ++x) {
             int offset = x + (y * m_width);
-            Vector3f color = Vector3f(0,0,0);
-            // stratified sampling here
-            // dividing image into grid defined by sample #
-            // for each
-            for(int sy = 0; sy < gridSize; ++sy) {
-                for(int sx = 0; sx < gridSize; ++sx) {
-                    // jitter, previously in tracePixel
-                    float jitterX = (sx + distribution(generator)) / gridSize - 0.5f;
-                    float jitterY = (sy + distribution(generator)) / gridSize - 0.5f;
-
-                    color += tracePixel(x, y, scene, invViewMat, jitterX, jitterY);
+            float error = 0.f;
+            int n = 0;
+            for(int ny = std::max(y - 1, m_rowBegin); ny <= std::min(y + 1, m_rowEnd - 1); ++ny) {
+                for(int nx = std::max(x - 1, 0); nx <= std::min(x + 1, m_width - 1); ++nx) {
+                    error += errors[nx + ny * m_width];
+                    ++n;
                 }
             }
-            intensityValues[offset] = color / (gridSize * gridSize);
+            active[offset] = m_pixels[offset].samples < maxSamples && error / n > settings.adaptiveThreshold;
+            count += active[offset];
         }
     }
-    toneMap(imageData, intensityValues);
+    return count;
+}
+
+void PathTracer::sampleCountMap(QRgb *imageData) const
+{
+    uint32_t maxSamples = 1;
+    for(const PixelStats &pixel : m_pixels) {
+        maxSamples = std::max(maxSamples, pixel.samples);
+    }
+    for(size_t i = 0; i < m_pixels.size(); ++i) {
+        int grey = (int)(255.f * m_pixels[i].samples / maxSamples);
+        imageData[i] = qRgb(grey, grey, grey);
+    }
 }
 
-Vector3f PathTracer::tracePixel(int x, int y, const Scene& scene, const Matrix4f &invViewMatrix, float jitterX, float jitterY)
+Vector3f PathTracer::tracePixel(int x, int y, const Scene& scene, const Matrix4f &invViewMatrix, float jitterX, float jitterY, Sampler &rng, int &bounces)
 {
     Vector3f p(0, 0, 0);
 
@@ -72,8 +336,10 @@ Vector3f PathTracer::tracePixel(int x, int y, const Scene& scene, const Matrix4f
         Vector3f focalPoint = r.o + r.d * focalDistance;
 
         // sample "disk" to scatter starting location
-        float randtheta = 2.f * M_PI * distribution(generator);
-        float randradius = lensRadius * sqrt(distribution(generator));
+        float lens1, lens2;
+        rng.next2D(&lens1, &lens2);
+        float randtheta = 2.f * M_PI * lens1;
+        float randradius = lensRadius * sqrt(lens2);
 
         // offset based on sampled radius and angle, converted from camera space
         Vector3f lensOffset(randradius * cos(randtheta), randradius * sin(randtheta), 0.f);
@@ -82,9 +348,9 @@ Vector3f PathTracer::tracePixel(int x, int y, const Scene& scene, const Matrix4f
         Vector3f newD = (focalPoint - newO).normalized();
 
         // set to go!
-        return radiance(newO, newD, true, scene, 1.f);
+        return radiance(Ray(newO, newD), scene, rng, bounces);
     }
-    return radiance(r.o, r.d, true, scene, 1.f);
+    return radiance(r, scene, rng, bounces);
 }
 
 Vector3f PathTracer::traceRay(const Ray& r, const Scene& scene)
@@ -94,12 +360,10 @@ Vector3f PathTracer::traceRay(const Ray& r, const Scene& scene)
     if(scene.getIntersection(ray, &i)) {
           //** Example code for accessing materials provided by a .mtl file **
         const Triangle *t = static_cast<const Triangle *>(i.data);//Get the triangle in the mesh that was intersected
-        const tinyobj::material_t& mat = t->getMaterial();//Get the material of the triangle from the mesh
-        const tinyobj::real_t *d = mat.diffuse;//Diffuse color as array of floats
-        const std::string diffuseTex = mat.diffuse_texname;//Diffuse texture name
+        const Material& mat = scene.getMaterial(t);//Get the material of the triangle from the scene's table
 
-        if (mat.emission[0] > 0 || mat.emission[1] > 0 || mat.emission[2] > 0) {
-            return Vector3f(mat.emission[0], mat.emission[1], mat.emission[2]);
+        if (mat.isEmissive()) {
+            return mat.emission;
         }
 
         Vector3f icoords = ray.o + ray.d * i.t;
@@ -136,208 +400,303 @@ void PathTracer::toneMap(QRgb *imageData, std::vector<Vector3f> &intensityValues
 
 }
 
-Vector3f PathTracer::radiance(Vector3f& x, Vector3f& w, bool countEmitted, const Scene& scene, float previor) {
-    IntersectionInfo i;
-    Vector3f L = Vector3f(0,0,0);
-    Ray r = Ray(x, w);
-    if(scene.getIntersection(r, &i)) {
+namespace {
+
+// Radiance gathered since the last clamped bounce. Refractive bounces clamp the radiance
+// that comes back along the new ray, so each of them opens a frame whose radiance is clamped
+// and weighted into its parent's when the path is done.
+struct PathFrame {
+    Vector3f L; // radiance gathered in this frame, relative to its start
+    Vector3f throughput; // weight of the current vertex relative to the start of the frame
+    Vector3f weight; // weight of the clamped frame radiance in the parent frame
+    Vector3f pathWeight; // weight of the start of the frame relative to the camera, ignoring clamping
+};
+
+// Power heuristic weight of a strategy taking nf samples with density fPdf against one taking ng with gPdf
+inline float powerHeuristic(int nf, float fPdf, int ng, float gPdf)
+{
+    float f = nf * fPdf, g = ng * gPdf;
+    if (f <= 0.f) {
+        return 0.f;
+    }
+    return (f * f) / (f * f + g * g);
+}
+
+}
+
+Vector3f PathTracer::radiance(const Ray& cameraRay, const Scene& scene, Sampler &rng, int &bounces) {
+    PathFrame frames[MaxPathDepth + 1];
+    int numFrames = 1;
+    frames[0].L = Vector3f(0,0,0);
+    frames[0].throughput = Vector3f(1,1,1);
+    frames[0].weight = Vector3f(1,1,1);
+    frames[0].pathWeight = Vector3f(1,1,1);
+
+    MediumStack media;
+    Ray r = cameraRay;
+    bool countEmitted = true;
+    // Where the last diffuse or glossy bounce left from, to weight the emitter it may hit against light sampling
+    bool misBounce = false;
+    Vector3f misPoint, misNormal;
+    float misBsdfPdf = 0.f;
+    // Beer-Lambert absorption applies to a segment inside a medium only if the bounce that started
+    // it set segmentIor to the medium's ior (refracting into it), not after internal reflections
+    float segmentIor = 1.f;
+    int maxDepth = std::min(settings.maxDepth, (int)MaxPathDepth);
+
+    bounces = 0;
+    for (int depth = 1; depth <= maxDepth; ++depth) {
+        rng.setBounce(depth);
+
+        IntersectionInfo i;
+        if (!scene.getIntersection(r, &i)) {
+            break;
+        }
+        ++bounces;
+
+        PathFrame &frame = frames[numFrames - 1];
+        const Vector3f &w = r.d;
+
         const Triangle *t = static_cast<const Triangle *>(i.data);//Get the triangle in the mesh that was intersected
-        const tinyobj::material_t& mat = t->getMaterial();//Get the material of the triangle from the mesh
-        const tinyobj::real_t *d = mat.diffuse;//Diffuse color as array of floats
-        const std::string diffuseTex = mat.diffuse_texname;//Diffuse texture name
+        const Material& mat = scene.getMaterial(t);//Get the material of the triangle from the scene's table
 
-        Vector3f diffuse = Vector3f(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
-        Vector3f spec = Vector3f(mat.specular[0], mat.specular[1], mat.specular[2]);
-        Vector3f emission = Vector3f(mat.emission[0], mat.emission[1], mat.emission[2]);
-        float ior = mat.ior; // material quality i think
+        if (bounceHook) {
+            bounceHook(PathVertex{depth, &r, &i, &mat, frame.pathWeight.cwiseProduct(frame.throughput)});
+        }
 
-        bool refracts = false;
-        bool isIdealSpecular = false;
+        const Vector3f& diffuse = mat.diffuse;
+        const Vector3f& spec = mat.specular;
+        float ior = mat.ior; // material quality i think
 
-        float illum = mat.illum;
+        bool refracts = mat.type == MaterialType::Refractive;
+        bool isIdealSpecular = mat.type == MaterialType::Mirror;
 
-        if (illum >= 6) {
-            refracts = true;
+        if (countEmitted) {
+            frame.L += frame.throughput.cwiseProduct(mat.emission);
         }
-        else if (illum < 6 && illum >= 3) {
-            isIdealSpecular = true;
+        else if (misBounce && mat.isEmissive()) {
+            // The BSDF sample found an emitter that light sampling could have picked too
+            const LightSampler& lights = scene.getLightSampler();
+            int lightIndex = lights.getLightIndex(t);
+            float cosLight = lightIndex < 0 ? 1.f : -w.dot(lights.getLights()[lightIndex].normal);
+            if (cosLight > 0.f) {
+                float lightPdf = 0.f;
+                if (lightIndex >= 0) {
+                    const EmissiveTriangle &light = lights.getLights()[lightIndex];
+                    lightPdf = lights.pmf(settings.lightSelection, misPoint, misNormal, lightIndex) / light.area
+                             * i.t * i.t / cosLight;
+                }
+                float misWeight = powerHeuristic(1, misBsdfPdf, settings.numDirectLightingSamples, lightPdf);
+                frame.L += frame.throughput.cwiseProduct(mat.emission) * misWeight;
+            }
         }
-
+        misBounce = false;
 
         Vector3f negw = -w;
 
+        // Without a BSDF sample to share the emitters with, light sampling takes all of them
+        bool mis = settings.mis && !settings.directLightingOnly && depth < maxDepth;
+
         if (!isIdealSpecular && !refracts) {
-            L = directLighting(i, negw, scene);
+            frame.L += frame.throughput.cwiseProduct(directLighting(i, negw, scene, rng, mis));
         }
 
         // added russian roulette
 
         float pdf_rr = settings.pathContinuationProb;
 
-        if (distribution(generator) < pdf_rr && !settings.directLightingOnly) {
-            Vector3f brdf;
-            float pdf;
-
-            Vector3f hitPoint = x + w * i.t;
-            Vector3f normal = t->getNormal(i).normalized();
-            Vector3f wi;
-            Vector3f Li;
-
-            float cos;
-
-            // refraction check
-            if (refracts) {
-                Vector3f refracnorm, newDir;
-                float ni, nt;
-                float nextior;
+        if (!(rng.next() < pdf_rr) || settings.directLightingOnly) {
+            break;
+        }
 
-                if (w.dot(normal) < 0) {
-                    refracnorm = normal;
-                    ni = 1.f;
-                    nt = ior;
-                    nextior = ior;
-                }
-                else {
-                    refracnorm = -normal;
-                    ni = ior;
-                    nt = 1.f;
-                    nextior = 1.f;
-                }
-                float nint = ni/nt;
+        Vector3f brdf;
+        float pdf;
+
+        Vector3f hitPoint = r.o + w * i.t;
+        // Asked of the object hit rather than the triangle, which is in mesh space for an instance
+        Vector3f normal = i.object->getNormal(i).normalized();
+        Vector3f wi;
+
+        float cos;
+
+        // The next ray, and how radiance coming back along it is weighted
+        Vector3f nextDir;
+        Vector3f weight;
+        float nextSegmentIor = ior;
+        bool clamped = false; // clamp the radiance coming back along the next ray
+        Vector3f attenuation(1,1,1); // scales the radiance coming back, before it is clamped
+
+        // refraction check
+        if (refracts) {
+            Vector3f refracnorm;
+            float ni, nt;
+            bool entering = w.dot(normal) < 0;
+
+            if (entering) {
+                refracnorm = normal;
+                ni = media.top();
+                nt = ior;
+            }
+            else {
+                refracnorm = -normal;
+                ni = ior;
+                nt = media.outside();
+            }
+            float nint = ni/nt;
 
-                // Fresnel through Schlick's approximation
-                float costhetai = -w.dot(refracnorm);
-                float sin2thetat = nint * nint * (1.0f - costhetai * costhetai);
+            // Fresnel through Schlick's approximation
+            float costhetai = -w.dot(refracnorm);
+            float sin2thetat = nint * nint * (1.0f - costhetai * costhetai);
 
-                float fresnel;
+            float fresnel;
 
-                float R0 = ((ni - nt) / (ni + nt));
-                R0 = R0 * R0;
+            float R0 = ((ni - nt) / (ni + nt));
+            R0 = R0 * R0;
 
-                // percent incoming light reflected vs refracted
+            // percent incoming light reflected vs refracted
 
-                fresnel = R0 + (1.f - R0) * pow(1.f - costhetai, 5.f);
+            fresnel = R0 + (1.f - R0) * pow(1.f - costhetai, 5.f);
 
+            clamped = true;
+            countEmitted = true;
+            nextSegmentIor = 1.f;
+            if (rng.next() < fresnel) {
+                nextDir = w - 2.0f * w.dot(refracnorm) * refracnorm;
+                nextDir.normalize();
+                pdf = fresnel;
+                weight = spec / (pdf * pdf_rr);
+            }
+            else {
+                Vector3f refracted;
+                float costhetat = sqrt(1.0f - sin2thetat);
+
+                if (refract(w, refracnorm, nint, refracted)) {
+                    nextDir = refracted;
+
+                    // attenuate refracted paths using Beer-Lambert
+                    // check that we're exiting from inside this medium, not entering
+                    if (!entering && segmentIor == ior) {
+                        // absorption as opposite of diffuse color; the darker the object, the more it absorbs
+                        Vector3f absorptionCoeff = Vector3f(1.f, 1.f, 1.f) - diffuse;
+                        absorptionCoeff *= 2.0f;
+
+                        // A = absorption * distance (t) * absorptiveness
+                        // final intensity = initial * e ^ (-absorption * t)
+                        attenuation = Vector3f(
+                            exp(-absorptionCoeff.x() * i.t),
+                            exp(-absorptionCoeff.y() * i.t),
+                            exp(-absorptionCoeff.z() * i.t)
+                            );
+                    }
+                    weight = Vector3f(1,1,1) / ((1.0f - fresnel) * pdf_rr);
 
-                if (distribution(generator) < fresnel) {
-                    newDir = w - 2.0f * w.dot(refracnorm) * refracnorm;
-                    newDir.normalize();
-                    pdf = fresnel;
-                    Vector3f Li = radiance(hitPoint, newDir, true, scene, 1.f);
-                    Li = Li.cwiseMin(10.f);
-                    L += Li.cwiseProduct(spec) / (pdf * pdf_rr);
-                }
-                else {
-                    Vector3f refracted;
-                    float costhetat = sqrt(1.0f - sin2thetat);
-
-                    if (refract(w, refracnorm, nint, refracted)) {
-
-                        Vector3f wi = nint * w + (nint * costhetai - costhetat) * refracnorm;
-                        wi.normalize();
-                        Vector3f Li = radiance(hitPoint, refracted, true, scene, nextior);
-
-                        // attenuate refracted paths using Beer-Lambert
-                        // check that we're exiting, not entering
-                        if (ni == ior && previor == ior) {
-                            // absorption as opposite of diffuse color; the darker the object, the more it absorbs
-                            Vector3f absorptionCoeff = Vector3f(1.f, 1.f, 1.f) - diffuse;
-                            absorptionCoeff *= 2.0f;
-
-                            // A = absorption * distance (t) * absorptiveness
-                            // final intensity = initial * e ^ (-absorption * t)
-                            Vector3f attenuation(
-                                exp(-absorptionCoeff.x() * i.t),
-                                exp(-absorptionCoeff.y() * i.t),
-                                exp(-absorptionCoeff.z() * i.t)
-                                );
-
-                            Li = Li.cwiseProduct(attenuation);
-                        }
-                        Li = Li.cwiseMin(10.f);
-                        L += Li.cwiseProduct(Vector3f(1,1,1)) / ((1.0f - fresnel) * pdf_rr);
+                    if (entering) {
+                        media.push(ior);
+                        nextSegmentIor = ior;
                     } else {
-                        Vector3f wi = nint * w + (nint * costhetai - costhetat) * refracnorm;
-                        wi.normalize();
-                        Vector3f Li = radiance(hitPoint, wi, true, scene, 1.f);
-                        Li = Li.cwiseMin(10.f);
-                        L += Li.cwiseProduct(Vector3f(1,1,1)) / pdf_rr;
+                        media.pop();
                     }
-
+                } else {
+                    nextDir = nint * w + (nint * costhetai - costhetat) * refracnorm;
+                    nextDir.normalize();
+                    weight = Vector3f(1,1,1) / pdf_rr;
                 }
-
-            }
-
-            // reflective material
-            else if (isIdealSpecular) {
-                wi = w - 2.f * w.dot(normal) * normal;
-                brdf = spec;
-                Li = radiance(hitPoint, wi, true, scene, ior);
-                L += Li.cwiseProduct(brdf) / (pdf_rr);
             }
-            else if (spec.norm() > 0.1f) {
+        }
 
-                // other specular glossy notes. split with diffuse from same material by specProb
-                float specProb = spec.norm() / (diffuse.norm() + spec.norm());
-                // for specular only like in image, uncomment:
-                specProb = 1.f;
+        // reflective material
+        else if (isIdealSpecular) {
+            nextDir = w - 2.f * w.dot(normal) * normal;
+            brdf = spec;
+            weight = brdf / pdf_rr;
+            countEmitted = true;
+        }
+        else if (mat.type == MaterialType::Glossy) {
 
-                if (distribution(generator) < specProb) {
-                    float shininess = mat.shininess;
+            // other specular glossy notes. split with diffuse from same material by specProb
+            float specProb = spec.norm() / (diffuse.norm() + spec.norm());
+            // for specular only like in image, uncomment:
+            specProb = 1.f;
 
-                    Vector3f reflected = w - 2.f * w.dot(normal) * normal;
-                    reflected.normalize();
+            if (rng.next() < specProb) {
+                float shininess = mat.shininess;
 
-                    wi = sampleNextDir(reflected, shininess);
-                    float cosspec = std::max(0.f, wi.dot(reflected));
+                Vector3f reflected = w - 2.f * w.dot(normal) * normal;
+                reflected.normalize();
 
-                    // phong brdf
-                    brdf = spec * (shininess + 2.f) / (2.f * M_PI) * pow(cosspec, shininess);
+                wi = sampleNextDir(reflected, shininess, rng);
+                float cosspec = std::max(0.f, wi.dot(reflected));
 
-                    // pdf for specular with importance sampling
-                    pdf = (shininess + 1.f) / (2.f * M_PI) * pow(cosspec, shininess);
-                    pdf *= specProb;
+                // phong brdf
+                brdf = spec * (shininess + 2.f) / (2.f * M_PI) * pow(cosspec, shininess);
 
-                    cos = std::max(0.f, wi.dot(normal));
+                // pdf for specular with importance sampling
+                pdf = (shininess + 1.f) / (2.f * M_PI) * pow(cosspec, shininess);
+                pdf *= specProb;
 
-                } else {
-                    // diffuse portion of samples
-                    wi = sampleNextDir(normal, 0);
-                    brdf = diffuse / M_PI;
-                    pdf = std::max(wi.dot(normal), 0.0f) / M_PI; // cos(theta) / pi
-                    pdf *= (1.0f - specProb);
-                    cos = wi.dot(normal);
-                }
-
-                if (pdf > 0.001f) {
-                    Vector3f Li = radiance(hitPoint, wi, false, scene, ior);
-                    L += Li.cwiseProduct(brdf) * cos / (pdf * pdf_rr);
-                }
-            }
-            // normal material
-            else {
-                wi = sampleNextDir(normal, 0);
+                cos = std::max(0.f, wi.dot(normal));
 
+            } else {
+                // diffuse portion of samples
+                wi = sampleNextDir(normal, 0, rng);
                 brdf = diffuse / M_PI;
                 pdf = std::max(wi.dot(normal), 0.0f) / M_PI; // cos(theta) / pi
+                pdf *= (1.0f - specProb);
+                cos = wi.dot(normal);
+            }
 
-                Li = radiance(hitPoint, wi, false, scene, ior);
-                cos = std::max(wi.dot(normal), 0.0f);
-                L += Li.cwiseProduct(brdf) * cos / (pdf * pdf_rr);
-
+            if (!(pdf > 0.001f)) {
+                break;
             }
+            nextDir = wi;
+            weight = brdf * cos / (pdf * pdf_rr);
+            countEmitted = false;
+            misBounce = mis;
+            misBsdfPdf = pdf;
+        }
+        // normal material
+        else {
+            wi = sampleNextDir(normal, 0, rng);
+
+            brdf = diffuse / M_PI;
+            pdf = std::max(wi.dot(normal), 0.0f) / M_PI; // cos(theta) / pi
+
+            cos = std::max(wi.dot(normal), 0.0f);
+            nextDir = wi;
+            weight = brdf * cos / (pdf * pdf_rr);
+            countEmitted = false;
+            misBounce = mis;
+            misBsdfPdf = pdf;
         }
 
-        if (countEmitted) {
-            L += Vector3f(mat.emission[0], mat.emission[1], mat.emission[2]);
+        if (misBounce) {
+            misPoint = i.hit;
+            misNormal = normal;
+        }
+
+        if (clamped) {
+            PathFrame &child = frames[numFrames++];
+            child.L = Vector3f(0,0,0);
+            child.throughput = attenuation;
+            child.weight = frame.throughput.cwiseProduct(weight);
+            child.pathWeight = frame.pathWeight.cwiseProduct(child.weight);
+        } else {
+            frame.throughput = frame.throughput.cwiseProduct(weight);
         }
+        r = Ray(hitPoint, nextDir);
+        segmentIor = nextSegmentIor;
+    }
+
+    // Fold the clamped frames back into their parents, innermost first
+    for (int f = numFrames - 1; f > 0; --f) {
+        frames[f - 1].L += frames[f].weight.cwiseProduct(frames[f].L.cwiseMin(10.f));
     }
-    return L;
+    return frames[0].L;
 }
 
-Vector3f PathTracer::sampleNextDir(const Vector3f& normal, float shininess) {
-    float sample1 = distribution(generator);
-    float sample2 = distribution(generator);
+Vector3f PathTracer::sampleNextDir(const Vector3f& normal, float shininess, Sampler &rng) {
+    float sample1, sample2;
+    rng.next2D(&sample1, &sample2);
 
     float phi = 2.0f * M_PI * sample1;
     float cosTheta;
@@ -367,108 +726,99 @@ Vector3f PathTracer::sampleNextDir(const Vector3f& normal, float shininess) {
 }
 
 
-Vector3f PathTracer::directLighting(IntersectionInfo i, Vector3f& w, const Scene& scene) {
+Vector3f PathTracer::directLighting(IntersectionInfo i, Vector3f& w, const Scene& scene, Sampler &rng, bool mis) {
     Vector3f L = Vector3f(0,0,0);
 
     // i at surface point
 
     const Triangle *objTri = static_cast<const Triangle *>(i.data);
-    const tinyobj::material_t& surfaceMat = objTri->getMaterial();
-    Vector3f diffuse = Vector3f(surfaceMat.diffuse[0], surfaceMat.diffuse[1], surfaceMat.diffuse[2]);
-    Vector3f spec = Vector3f(surfaceMat.specular[0], surfaceMat.specular[1], surfaceMat.specular[2]);
+    const Material& surfaceMat = scene.getMaterial(objTri);
 
-    Vector3f normal = objTri->getNormal(i).normalized();
+    Vector3f normal = i.object->getNormal(i).normalized();
 
-    Vector3f brdf = diffuse / M_PI;
 
+    const LightSampler& lights = scene.getLightSampler();
+    if (lights.empty()) {
+        return L;
+    }
 
-    for (Triangle* light: scene.getEmissives()) {
-        Vector3f lightVal = Vector3f(0,0,0);
-
-
-        // triangle vertices
-        Vector3f v0 = light->getVertices()[0];
-        Vector3f v1 = light->getVertices()[1];
-        Vector3f v2 = light->getVertices()[2];
-
-        Vector3f t = ((v1 - v0).cross(v2 - v0));
-        Vector3f lightNormal = t.normalized();
-        const tinyobj::material_t& lightMat = light->getMaterial();
-        Vector3f emission = Vector3f(lightMat.emission[0], lightMat.emission[1], lightMat.emission[2]);
+    // each sample picks one emissive triangle, as chosen by settings.lightSelection, and a point on it
+    for (int j = 0; j < settings.numDirectLightingSamples; j++) {
+        float uLight = rng.next(), u1, u2;
+        rng.next2D(&u1, &u2);
+        LightSample light;
+        if (!lights.sample(settings.lightSelection, i.hit, normal, uLight, u1, u2, &light)) {
+            continue;
+        }
 
+        // calculate light direction
+        Vector3f lightDir = light.point - i.hit;
+        float distanceToLight = lightDir.norm();
+        lightDir.normalize();
 
+        float cosTheta = normal.dot(lightDir);
+        float cosPhiLight = -lightDir.dot(light.normal);
 
-        // sampling random points on the light triangle
-        for (int j = 0; j < settings.numDirectLightingSamples; j++) {
-            float r1 = distribution(generator);
-            float r2 = distribution(generator);
+        if (cosTheta <= 0.f || cosPhiLight <= 0.f) {
+            continue;
+        }
 
-            // work on sampling
-            float sqrt_r1 = sqrt(r1);
-            float u = 1.0f - sqrt_r1;
-            float v = r2 * sqrt_r1;
-            float w2 = 1.0f - u - v;
+        Vector3f brdf = evalBSDF(surfaceMat, w, lightDir, normal);
+        if (brdf.isZero()) {
+            continue;
+        }
 
-            // calculate random point + light direction
-            Vector3f lightPoint = u * v0 + v * v1 + w2 * v2;
-            Vector3f lightDir = lightPoint - i.hit;
-            float distanceToLight = lightDir.norm();
-            lightDir.normalize();
+        // shadow check
+        Ray shadowRay(i.hit + normal * 0.0001f, lightDir);
+        bool shadowed = scene.occluded(shadowRay, distanceToLight - 0.001f);
 
-            float cosTheta = normal.dot(lightDir);
-            float cosPhiLight = -lightDir.dot(lightNormal);
+        if (!shadowed) {
+            // convert the area density to solid angle
+            float pdf = (distanceToLight * distanceToLight) * light.pdfArea / cosPhiLight;
 
-            if (cosTheta <= 0.f || cosPhiLight <= 0.f) {
-                continue;
+            float misWeight = 1.f;
+            if (mis) {
+                misWeight = powerHeuristic(settings.numDirectLightingSamples, pdf, 1, pdfBSDF(surfaceMat, w, lightDir, normal));
             }
+            L += light.emission.cwiseProduct(brdf) * cosTheta * misWeight / pdf;
+        }
+    }
 
-            // shadow check
-            Ray shadowRay(i.hit + normal * 0.0001f, lightDir);
-            IntersectionInfo shadowi;
-
-            bool shadowed = false;
-            if (scene.getIntersection(shadowRay, &shadowi)) {
-                if (shadowi.t < distanceToLight - 0.001f) {
-                    shadowed = true;
-                }
-            }
-
-            if (!shadowed) {
-
-                const tinyobj::material_t& lightMat = light->getMaterial();
-                Vector3f emission = Vector3f(lightMat.emission[0], lightMat.emission[1], lightMat.emission[2]);
-
-                // light area calculations
-                float lightArea = 0.5f * t.norm();
-
-                float pdf = (distanceToLight * distanceToLight) / (lightArea * cosPhiLight);
-
-                Vector3f totalContribution = Vector3f(0,0,0);
-
-
-                if (spec.norm() > 0.1f) {
-                    float shininess = surfaceMat.shininess;
-                    Vector3f reflected = lightDir - 2.0f * lightDir.dot(normal) * normal;
-                    reflected.normalize();
-                    float speccos = std::max(0.0f, -w.dot(reflected));
-
-                    if (speccos > 0.f) {
-                        Vector3f specbrdf = spec * (shininess + 2.0f) / (2.0f * M_PI) * pow(speccos, shininess);
-                        totalContribution += emission.cwiseProduct(specbrdf) * cosTheta / pdf;
-                    }
-                }
-                else if (diffuse.norm() > 0.1f) {
-                    totalContribution += emission.cwiseProduct(brdf) * cosTheta / pdf;
-                }
-                lightVal += totalContribution;
-
+    return L / settings.numDirectLightingSamples;
+}
 
-            }
+// w points away from the surface in both, towards the viewer for wo and the light for wi
+Vector3f PathTracer::evalBSDF(const Material& mat, const Vector3f& wo, const Vector3f& wi, const Vector3f& normal) {
+    if (mat.type == MaterialType::Glossy) {
+        // phong lobe around the mirror direction of wi
+        Vector3f reflected = wi - 2.0f * wi.dot(normal) * normal;
+        reflected.normalize();
+        float speccos = std::max(0.0f, -wo.dot(reflected));
+        if (speccos <= 0.f) {
+            return Vector3f(0,0,0);
         }
+        return mat.specular * (mat.shininess + 2.0f) / (2.0f * M_PI) * pow(speccos, mat.shininess);
+    }
+    if (mat.type == MaterialType::Diffuse) {
+        return mat.diffuse / M_PI;
+    }
+    return Vector3f(0,0,0);
+}
 
-        L += lightVal / settings.numDirectLightingSamples;
+// Density of radiance() bouncing towards wi, per unit solid angle
+float PathTracer::pdfBSDF(const Material& mat, const Vector3f& wo, const Vector3f& wi, const Vector3f& normal) {
+    if (mat.type == MaterialType::Glossy) {
+        // glossy bounces only sample the specular lobe, and give up on directions it hardly reaches
+        Vector3f reflected = -wo - 2.f * -wo.dot(normal) * normal;
+        reflected.normalize();
+        float cosspec = std::max(0.f, wi.dot(reflected));
+        float pdf = (mat.shininess + 1.f) / (2.f * M_PI) * pow(cosspec, mat.shininess);
+        return pdf > 0.001f ? pdf : 0.f;
+    }
+    if (mat.type == MaterialType::Diffuse) {
+        return std::max(wi.dot(normal), 0.0f) / M_PI;
     }
-    return L;
+    return 0.f;
 }
 
 bool PathTracer::refract(const Vector3f& wi, const Vector3f& normal, float nint, Vector3f& refracted) {
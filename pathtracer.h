@@ -4,12 +4,119 @@
 #include <QImage>
 
 #include "scene/scene.h"
+#include "util/Sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+
+// How the processes of a distributed render share the frame
+enum class RenderSplit {
+    Samples, // every worker renders the whole image, with its own range of sample indices
+    Image // every worker renders all samples of a band of rows
+};
 
 struct Settings {
     int samplesPerPixel;
     bool directLightingOnly; // if true, ignore indirect lighting
     int numDirectLightingSamples; // number of shadow rays to trace from each intersection point
     float pathContinuationProb; // probability of spawning a new secondary ray == (1-pathTerminationProb)
+    int tileSize; // width and height in pixels of the tiles handed out to render threads
+    int numThreads; // number of render threads; 0 uses every hardware thread
+    int maxDepth; // longest path in bounces, at most PathTracer::MaxPathDepth
+    LightSelection lightSelection; // how direct lighting picks the emitter to sample
+    bool mis; // weight light and BSDF samples of emitters with the power heuristic
+    SamplerType sampler; // how the samples of a pixel are spread over the sample dimensions
+    float adaptiveThreshold; // keep sampling pixels whose relative error is above this; 0 disables adaptive sampling
+    int maxSamplesPerPixel; // cap on the samples of a pixel in adaptive and progressive mode
+    float timeBudget; // seconds; if set, render progressively until it runs out
+    float noiseThreshold; // if set, render progressively until the mean relative error of the pixels is below it
+    float progressInterval; // seconds between intermediate images in progressive mode
+    std::string checkpointPath; // where to keep a checkpoint of the render to resume from; empty for none
+    float checkpointInterval; // seconds between checkpoints, which are only written between passes
+    RenderSplit split; // how the workers of a distributed render share the frame
+    int workerIndex; // the share of the frame this process renders, in [0, workerCount)
+    int workerCount; // processes rendering the frame; 1 renders all of it
+    uint64_t sceneKey; // Scene::sourceKey of the scene, so checkpoints of an edited scene are refused
+};
+
+// Running statistics of the samples of one pixel
+struct PixelStats {
+    Eigen::Vector3f sum; // of the sample radiance
+    double luminanceMean; // mean and sum of squared deviations of the sample luminance (Welford)
+    double luminanceM2;
+    uint32_t samples;
+
+    PixelStats() : sum(0.f, 0.f, 0.f), luminanceMean(0.0), luminanceM2(0.0), samples(0) {}
+
+    void add(const Eigen::Vector3f &L)
+    {
+        sum += L;
+        double luminance = 0.2126f * L.x() + 0.7152f * L.y() + 0.0722f * L.z();
+        ++samples;
+        double delta = luminance - luminanceMean;
+        luminanceMean += delta / samples;
+        luminanceM2 += delta * (luminance - luminanceMean);
+    }
+
+    Eigen::Vector3f mean() const { return samples > 0 ? Eigen::Vector3f(sum / samples) : Eigen::Vector3f(0.f, 0.f, 0.f); }
+
+    // Standard error of the mean luminance relative to the mean. Near black pixels are
+    // measured against MinLuminance instead, or they would take samples for noise nobody sees.
+    float relativeError() const
+    {
+        if(samples < 2) {
+            return INFINITY;
+        }
+        double variance = luminanceM2 / (samples - 1);
+        return std::sqrt(variance / samples) / std::max(luminanceMean, MinLuminance);
+    }
+
+    // Adds the samples of other, as if they had been taken here (Chan et al.)
+    void merge(const PixelStats &other)
+    {
+        if(other.samples == 0) {
+            return;
+        }
+        uint32_t total = samples + other.samples;
+        double delta = other.luminanceMean - luminanceMean;
+        luminanceMean += delta * other.samples / total;
+        luminanceM2 += other.luminanceM2 + delta * delta * ((double)samples * other.samples / total);
+        sum += other.sum;
+        samples = total;
+    }
+
+    static constexpr double MinLuminance = 0.01;
+};
+
+// One vertex of a camera path, as handed to PathTracer::bounceHook
+struct PathVertex {
+    int depth; // 1 for the hit of the camera ray
+    const Ray *ray; // the ray that found this vertex
+    const IntersectionInfo *hit;
+    const Material *material;
+    Eigen::Vector3f throughput; // weight of the radiance leaving this vertex along -ray->d (ignoring clamping)
+};
+
+// Indices of refraction of the media a path is inside of, innermost last. Outside of
+// everything (an empty stack) is air, with an ior of 1.
+class MediumStack
+{
+public:
+    MediumStack() : m_size(0) {}
+
+    float top() const { return m_size > 0 ? m_ior[m_size - 1] : 1.f; }
+    // The medium the path gets into when it leaves the innermost one
+    float outside() const { return m_size > 1 ? m_ior[m_size - 2] : 1.f; }
+
+    void push(float ior) { if(m_size < MaxNesting) m_ior[m_size++] = ior; }
+    void pop() { if(m_size > 0) --m_size; }
+
+private:
+    static const int MaxNesting = 8;
+    float m_ior[MaxNesting];
+    int m_size;
 };
 
 class PathTracer
@@ -20,16 +127,50 @@ public:
     void traceScene(QRgb *imageData, const Scene &scene);
     Settings settings;
 
+    // The samples every pixel got in the last traceScene, as grey levels relative to the most sampled pixel
+    void sampleCountMap(QRgb *imageData) const;
+
+    // Called in progressive mode whenever imageData holds a new intermediate image, with its radiance
+    std::function<void(std::vector<Eigen::Vector3f> &intensityValues)> progressHook;
+
+    // The current radiance estimate of every pixel
+    std::vector<Eigen::Vector3f> getIntensityValues() const;
+
+    // Makes the next traceScene carry on from the checkpoint instead of starting over.
+    // Fails if the checkpoint was made with a different scene, image size or sample settings.
+    bool resumeFrom(const std::string &checkpointPath);
+
+    // Combines the partial renders of the workers of a distributed render into the image.
+    // Fails unless the partials are all the workers of one render with these settings.
+    bool mergePartials(const std::vector<std::string> &partialPaths, QRgb *imageData);
+
+    // Called at every path vertex before it is shaded, if set. Must be thread safe.
+    std::function<void(const PathVertex &)> bounceHook;
+
+    static const int MaxPathDepth = 64;
+
 private:
     int m_width, m_height;
+    std::vector<PixelStats> m_pixels;
+    bool m_resumed;
+    int m_resumedPasses;
+    double m_resumedSeconds;
+    int m_rowBegin, m_rowEnd; // the rows this worker renders
 
     void toneMap(QRgb *imageData, std::vector<Eigen::Vector3f> &intensityValues);
+    // Marks the pixels that need another adaptive batch and returns how many there are
+    int updateActivePixels(std::vector<uint8_t> &active, uint32_t maxSamples) const;
+    float meanRelativeError() const;
+    bool outOfTime(double elapsedSeconds) const;
+    void writeCheckpoint(int pass, double elapsedSeconds) const;
 
-    Eigen::Vector3f tracePixel(int x, int y, const Scene &scene, const Eigen::Matrix4f &invViewMatrix, float jitterX, float jitterY);
+    Eigen::Vector3f tracePixel(int x, int y, const Scene &scene, const Eigen::Matrix4f &invViewMatrix, float jitterX, float jitterY, Sampler &rng, int &bounces);
     Eigen::Vector3f traceRay(const Ray& r, const Scene &scene);
-    Eigen::Vector3f radiance(Eigen::Vector3f& x, Eigen::Vector3f& w, bool countEmitted, const Scene& scene, float previor);
-    Eigen::Vector3f sampleNextDir(const Eigen::Vector3f& normal, float shininess);
-    Eigen::Vector3f directLighting(IntersectionInfo i, Eigen::Vector3f& w, const Scene& scene);
+    Eigen::Vector3f radiance(const Ray& cameraRay, const Scene& scene, Sampler &rng, int &bounces);
+    Eigen::Vector3f sampleNextDir(const Eigen::Vector3f& normal, float shininess, Sampler &rng);
+    Eigen::Vector3f directLighting(IntersectionInfo i, Eigen::Vector3f& w, const Scene& scene, Sampler &rng, bool mis);
+    Eigen::Vector3f evalBSDF(const Material& mat, const Eigen::Vector3f& wo, const Eigen::Vector3f& wi, const Eigen::Vector3f& normal);
+    float pdfBSDF(const Material& mat, const Eigen::Vector3f& wo, const Eigen::Vector3f& wi, const Eigen::Vector3f& normal);
     bool refract(const Eigen::Vector3f& wi, const Eigen::Vector3f& normal, float eta, Eigen::Vector3f& refracted);
 };
 
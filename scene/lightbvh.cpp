@@ -0,0 +1,217 @@
+#include "lightbvh.h"
+
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+namespace {
+
+// The smallest cone holding both cones
+NormalCone unionCones(const NormalCone &a, const NormalCone &b)
+{
+    float thetaD = std::acos(std::clamp(a.axis.dot(b.axis), -1.f, 1.f));
+    if (std::min(thetaD + b.theta, (float)M_PI) <= a.theta) {
+        return a;
+    }
+    if (std::min(thetaD + a.theta, (float)M_PI) <= b.theta) {
+        return b;
+    }
+
+    float thetaO = (a.theta + thetaD + b.theta) / 2.f;
+    if (thetaO >= M_PI) {
+        return NormalCone{a.axis, (float)M_PI};
+    }
+
+    // Rotate a's axis towards b's until the cone reaches around both
+    Vector3f rotationAxis = a.axis.cross(b.axis);
+    if (rotationAxis.squaredNorm() < 1e-12f) {
+        return NormalCone{a.axis, (float)M_PI};
+    }
+    Vector3f axis = AngleAxisf(thetaO - a.theta, rotationAxis.normalized()) * a.axis;
+    return NormalCone{axis.normalized(), thetaO};
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1.f : cosA * cosB + sinA * sinB;
+}
+
+inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0.f : sinA * cosB - cosA * sinB;
+}
+
+inline float safeSqrt(float x)
+{
+    return std::sqrt(std::max(0.f, x));
+}
+
+}
+
+LightBVH::LightBVH(const std::vector<BBox> &bounds, const std::vector<Vector3f> &normals, const std::vector<float> &power)
+{
+    if (bounds.empty()) {
+        return;
+    }
+    std::vector<uint32_t> lights(bounds.size());
+    for (uint32_t i = 0; i < lights.size(); ++i) {
+        lights[i] = i;
+    }
+    m_nodes.reserve(2 * bounds.size() - 1);
+    m_lightPaths.resize(bounds.size());
+    build(lights, 0, lights.size(), 0, 0, bounds, normals, power);
+}
+
+uint32_t LightBVH::build(std::vector<uint32_t> &lights, uint32_t start, uint32_t end, uint64_t path, int depth,
+                         const std::vector<BBox> &bounds, const std::vector<Vector3f> &normals,
+                         const std::vector<float> &power)
+{
+    uint32_t index = m_nodes.size();
+    m_nodes.emplace_back();
+
+    if (end - start == 1) {
+        uint32_t light = lights[start];
+        LightBVHNode &leaf = m_nodes[index];
+        leaf.bounds = bounds[light];
+        leaf.cone = NormalCone{normals[light], 0.f};
+        leaf.power = power[light];
+        leaf.rightChild = 0;
+        leaf.light = light;
+        leaf.isLeaf = true;
+        m_lightPaths[light] = path;
+        return index;
+    }
+
+    // Split at the median centroid along the widest axis, which keeps the tree
+    // balanced so the path to every leaf fits in 64 bits.
+    BBox centroids;
+    centroids.setP((bounds[lights[start]].min + bounds[lights[start]].max) / 2.f);
+    for (uint32_t i = start + 1; i < end; ++i) {
+        centroids.expandToInclude((bounds[lights[i]].min + bounds[lights[i]].max) / 2.f);
+    }
+    int axis;
+    centroids.extent.maxCoeff(&axis);
+    uint32_t mid = (start + end) / 2;
+    std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end, [&](uint32_t a, uint32_t b) {
+        return bounds[a].min[axis] + bounds[a].max[axis] < bounds[b].min[axis] + bounds[b].max[axis];
+    });
+
+    uint32_t left = build(lights, start, mid, path, depth + 1, bounds, normals, power);
+    uint32_t right = build(lights, mid, end, path | (uint64_t(1) << depth), depth + 1, bounds, normals, power);
+
+    LightBVHNode &node = m_nodes[index];
+    node.bounds = m_nodes[left].bounds;
+    node.bounds.expandToInclude(m_nodes[right].bounds);
+    node.cone = unionCones(m_nodes[left].cone, m_nodes[right].cone);
+    node.power = m_nodes[left].power + m_nodes[right].power;
+    node.rightChild = right;
+    node.light = 0;
+    node.isLeaf = false;
+    return index;
+}
+
+float LightBVH::importance(const LightBVHNode &node, const Vector3f &p, const Vector3f &n) const
+{
+    if (node.power <= 0.f) {
+        return 0.f;
+    }
+
+    // Bound the node by a sphere, and the directions to it from p by a cone of half angle thetaB
+    Vector3f center = (node.bounds.min + node.bounds.max) / 2.f;
+    float radius2 = node.bounds.extent.squaredNorm() / 4.f;
+    Vector3f toCenter = center - p;
+    float dist2 = toCenter.squaredNorm();
+    Vector3f wi = toCenter / std::sqrt(std::max(dist2, 1e-12f));
+
+    float cosThetaB = -1.f, sinThetaB = 0.f;
+    if (dist2 > radius2) {
+        float sin2ThetaB = radius2 / dist2;
+        cosThetaB = safeSqrt(1.f - sin2ThetaB);
+        sinThetaB = std::sqrt(sin2ThetaB);
+    }
+
+    // Smallest angle between the emitters' normals and the direction to p
+    float cosThetaW = node.cone.axis.dot(-wi);
+    float sinThetaW = safeSqrt(1.f - cosThetaW * cosThetaW);
+    float cosThetaO = std::cos(node.cone.theta), sinThetaO = std::sin(node.cone.theta);
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= 0.f) {
+        return 0.f;
+    }
+
+    // Smallest angle between the shading normal and the directions to the node
+    float cosThetaI = n.dot(wi);
+    float sinThetaI = safeSqrt(1.f - cosThetaI * cosThetaI);
+    float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    if (cosThetaIP <= 0.f) {
+        return 0.f;
+    }
+
+    // Don't let the distance go below the node's size, or nearby nodes get all the samples
+    dist2 = std::max(dist2, radius2);
+    return node.power * cosThetaP * cosThetaIP / dist2;
+}
+
+bool LightBVH::sample(const Vector3f &p, const Vector3f &n, float u, uint32_t *light, float *pmf) const
+{
+    if (m_nodes.empty()) {
+        return false;
+    }
+
+    uint32_t index = 0;
+    float prob = 1.f;
+    while (!m_nodes[index].isLeaf) {
+        uint32_t left = index + 1, right = m_nodes[index].rightChild;
+        float wl = importance(m_nodes[left], p, n);
+        float wr = importance(m_nodes[right], p, n);
+        if (wl + wr <= 0.f) {
+            return false;
+        }
+        float pl = wl / (wl + wr);
+        if (u < pl) {
+            index = left;
+            u = std::min(u / pl, 0.99999994f);
+            prob *= pl;
+        } else {
+            index = right;
+            u = std::min((u - pl) / (1.f - pl), 0.99999994f);
+            prob *= 1.f - pl;
+        }
+    }
+    *light = m_nodes[index].light;
+    *pmf = prob;
+    return true;
+}
+
+float LightBVH::pmf(const Vector3f &p, const Vector3f &n, uint32_t light) const
+{
+    if (m_nodes.empty()) {
+        return 0.f;
+    }
+
+    uint64_t path = m_lightPaths[light];
+    uint32_t index = 0;
+    float prob = 1.f;
+    for (int depth = 0; !m_nodes[index].isLeaf; ++depth) {
+        uint32_t left = index + 1, right = m_nodes[index].rightChild;
+        float wl = importance(m_nodes[left], p, n);
+        float wr = importance(m_nodes[right], p, n);
+        if (wl + wr <= 0.f) {
+            return 0.f;
+        }
+        if (path & (uint64_t(1) << depth)) {
+            index = right;
+            prob *= wr / (wl + wr);
+        } else {
+            index = left;
+            prob *= wl / (wl + wr);
+        }
+    }
+    return prob;
+}
@@ -0,0 +1,64 @@
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include <BVH/BBox.h>
+
+#include <Eigen/Dense>
+
+#include <stdint.h>
+#include <vector>
+
+// The directions an emitter (or a group of them) emits into: every normal lies within
+// theta of axis. Emitters are one-sided, so they emit up to 90 degrees off their normal.
+struct NormalCone {
+    Eigen::Vector3f axis;
+    float theta;
+};
+
+// Node of a LightBVH in depth-first order: the left child follows its parent
+struct LightBVHNode {
+    BBox bounds;
+    NormalCone cone;
+    float power;
+    uint32_t rightChild; // inner nodes only
+    uint32_t light; // leaves only: index of the emitter
+    bool isLeaf;
+};
+
+/**
+ * A BVH over the emitters in which every node bounds the positions, normals and total
+ * power of its emitters (Conty Estevez & Kulla, "Importance Sampling of Many Lights with
+ * Adaptive Tree Splitting"). An emitter is picked by descending from the root and choosing
+ * each child in proportion to an estimate of how much it can light the shading point,
+ * so far away or back-facing groups of emitters are rarely picked.
+ */
+class LightBVH
+{
+public:
+    LightBVH() {}
+    // One bounding box, normal and power per emitter
+    LightBVH(const std::vector<BBox> &bounds, const std::vector<Eigen::Vector3f> &normals, const std::vector<float> &power);
+
+    bool empty() const { return m_nodes.empty(); }
+
+    // Picks an emitter for the point p with normal n. Returns false if none can light p.
+    bool sample(const Eigen::Vector3f &p, const Eigen::Vector3f &n, float u, uint32_t *light, float *pmf) const;
+
+    // Probability that sample() picks the emitter for p and n
+    float pmf(const Eigen::Vector3f &p, const Eigen::Vector3f &n, uint32_t light) const;
+
+    size_t getNodeCount() const { return m_nodes.size(); }
+
+private:
+    std::vector<LightBVHNode> m_nodes;
+    // The turns from the root to each emitter's leaf, one bit per level (1 is right)
+    std::vector<uint64_t> m_lightPaths;
+
+    uint32_t build(std::vector<uint32_t> &lights, uint32_t start, uint32_t end, uint64_t path, int depth,
+                   const std::vector<BBox> &bounds, const std::vector<Eigen::Vector3f> &normals,
+                   const std::vector<float> &power);
+
+    float importance(const LightBVHNode &node, const Eigen::Vector3f &p, const Eigen::Vector3f &n) const;
+};
+
+#endif // LIGHTBVH_H
@@ -0,0 +1,104 @@
+#include "lightsampler.h"
+
+#include <algorithm>
+
+using namespace Eigen;
+
+LightSampler::LightSampler(const std::vector<Triangle *> &emissives, const std::vector<Material> &materials)
+{
+    std::vector<float> weights;
+    m_lights.reserve(emissives.size());
+    weights.reserve(emissives.size());
+    for (const Triangle *tri : emissives) {
+        Eigen::Vector3<Vector3f> v = tri->getVertices();
+        EmissiveTriangle light;
+        light.v0 = v[0];
+        light.e1 = v[1] - v[0];
+        light.e2 = v[2] - v[0];
+        Vector3f n = light.e1.cross(light.e2);
+        light.normal = n.normalized();
+        light.area = 0.5f * n.norm();
+        light.emission = materials[tri->getMaterialIndex()].emission;
+        light.triangle = tri;
+        if (light.area <= 0.f) {
+            continue;
+        }
+        m_lights.push_back(light);
+        // Emitted power is proportional to area times radiance
+        weights.push_back(light.area * light.emission.sum() / 3.f);
+    }
+    m_table = AliasTable(weights);
+    if (m_table.empty()) {
+        m_lights.clear();
+        return;
+    }
+    for (uint32_t i = 0; i < m_lights.size(); ++i) {
+        m_indices[m_lights[i].triangle] = i;
+    }
+
+    std::vector<BBox> bounds;
+    std::vector<Vector3f> normals;
+    bounds.reserve(m_lights.size());
+    normals.reserve(m_lights.size());
+    for (const EmissiveTriangle &light : m_lights) {
+        BBox box;
+        box.setP(light.v0);
+        box.expandToInclude(light.v0 + light.e1);
+        box.expandToInclude(light.v0 + light.e2);
+        bounds.push_back(box);
+        normals.push_back(light.normal);
+    }
+    m_bvh = LightBVH(bounds, normals, weights);
+}
+
+LightSample LightSampler::sample(float uLight, float u1, float u2) const
+{
+    // One number is enough to pick the alias table bin and decide within it
+    float scaled = uLight * m_lights.size();
+    uint32_t bin = std::min<uint32_t>((uint32_t)scaled, m_lights.size() - 1);
+    uint32_t index = m_table.sample(uLight, scaled - bin);
+    return samplePoint(index, m_table.pmf(index), u1, u2);
+}
+
+bool LightSampler::sample(LightSelection selection, const Vector3f &p, const Vector3f &n,
+                          float uLight, float u1, float u2, LightSample *sample) const
+{
+    if (selection == LightSelection::Power) {
+        *sample = this->sample(uLight, u1, u2);
+        return true;
+    }
+
+    uint32_t index;
+    float pmf;
+    if (!m_bvh.sample(p, n, uLight, &index, &pmf)) {
+        return false;
+    }
+    *sample = samplePoint(index, pmf, u1, u2);
+    return true;
+}
+
+float LightSampler::pmf(LightSelection selection, const Vector3f &p, const Vector3f &n, uint32_t light) const
+{
+    if (selection == LightSelection::Power) {
+        return m_table.pmf(light);
+    }
+    return m_bvh.pmf(p, n, light);
+}
+
+LightSample LightSampler::samplePoint(uint32_t index, float pmf, float u1, float u2) const
+{
+    const EmissiveTriangle &light = m_lights[index];
+
+    // Uniform point on the triangle
+    float sqrt_u1 = std::sqrt(u1);
+    float b1 = u2 * sqrt_u1;
+    float b2 = 1.0f - (1.0f - sqrt_u1) - b1;
+
+    LightSample sample;
+    sample.point = light.v0 + b1 * light.e1 + b2 * light.e2;
+    sample.normal = light.normal;
+    sample.emission = light.emission;
+    sample.pdfArea = pmf / light.area;
+    sample.light = index;
+    return sample;
+}
@@ -0,0 +1,76 @@
+#ifndef LIGHTSAMPLER_H
+#define LIGHTSAMPLER_H
+
+#include "lightbvh.h"
+#include "material.h"
+#include "shape/triangle.h"
+
+#include "util/AliasTable.h"
+
+#include <unordered_map>
+#include <vector>
+
+// An emissive triangle with what direct lighting needs from it, computed once at load
+struct EmissiveTriangle {
+    Eigen::Vector3f v0, e1, e2; // vertex 0 and the edges to vertices 1 and 2
+    Eigen::Vector3f normal;
+    Eigen::Vector3f emission;
+    float area;
+    const Triangle *triangle;
+};
+
+// How LightSampler picks the emitter to sample
+enum class LightSelection {
+    Power, // in proportion to emitted power, the same everywhere
+    Tree // through the light BVH, favouring emitters near and facing the shading point
+};
+
+// A point sampled on an emitter
+struct LightSample {
+    Eigen::Vector3f point;
+    Eigen::Vector3f normal;
+    Eigen::Vector3f emission;
+    float pdfArea; // density of picking this point, per unit area, including picking its triangle
+    uint32_t light; // index into LightSampler::getLights()
+};
+
+// Picks points on the scene's emissive triangles. A triangle is chosen either in proportion
+// to area times emitted power, in constant time through an alias table, or by walking a
+// light BVH that adapts the choice to the shading point.
+class LightSampler
+{
+public:
+    LightSampler() {}
+    LightSampler(const std::vector<Triangle *> &emissives, const std::vector<Material> &materials);
+
+    bool empty() const { return m_lights.empty(); }
+    const std::vector<EmissiveTriangle> &getLights() const { return m_lights; }
+
+    // uLight picks the triangle, u1 and u2 the point on it; all uniform in [0, 1)
+    LightSample sample(float uLight, float u1, float u2) const;
+    // Samples for the shading point p with normal n. Returns false if no emitter can light it.
+    bool sample(LightSelection selection, const Eigen::Vector3f &p, const Eigen::Vector3f &n,
+                float uLight, float u1, float u2, LightSample *sample) const;
+
+    // Probability of picking the emitter when sampling for p and n
+    float pmf(LightSelection selection, const Eigen::Vector3f &p, const Eigen::Vector3f &n, uint32_t light) const;
+
+    // Index of the triangle in getLights(), or -1 if it is never sampled
+    int getLightIndex(const Triangle *triangle) const
+    {
+        auto it = m_indices.find(triangle);
+        return it == m_indices.end() ? -1 : (int)it->second;
+    }
+
+    const LightBVH &getBVH() const { return m_bvh; }
+
+private:
+    std::vector<EmissiveTriangle> m_lights;
+    AliasTable m_table;
+    LightBVH m_bvh;
+    std::unordered_map<const Triangle *, uint32_t> m_indices;
+
+    LightSample samplePoint(uint32_t light, float pmf, float u1, float u2) const;
+};
+
+#endif // LIGHTSAMPLER_H
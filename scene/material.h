@@ -0,0 +1,74 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <Eigen/Dense>
+
+#include <util/tiny_obj_loader.h>
+
+#include <stdint.h>
+
+#include <functional>
+
+// How the path tracer shades a surface, decided once from the .mtl illum model and colors
+enum class MaterialType : uint8_t {
+    Diffuse,    // Lambertian
+    Glossy,     // Phong lobe, when the specular color is significant
+    Mirror,     // ideal specular reflection, illum 3-5
+    Refractive  // Fresnel-weighted reflection and refraction, illum 6 and up
+};
+
+// The shading parameters of a tinyobj::material_t, without its names, texture paths and
+// unknown parameters. Scene keeps one table of these and every Triangle stores an index into it.
+struct Material
+{
+    // Same defaults as a material tinyobj parses without any parameters
+    Material()
+        : diffuse(0.f, 0.f, 0.f), specular(0.f, 0.f, 0.f), emission(0.f, 0.f, 0.f),
+          ior(1.f), shininess(1.f), type(MaterialType::Diffuse) {}
+
+    explicit Material(const tinyobj::material_t &mat)
+        : diffuse(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]),
+          specular(mat.specular[0], mat.specular[1], mat.specular[2]),
+          emission(mat.emission[0], mat.emission[1], mat.emission[2]),
+          ior(mat.ior), shininess(mat.shininess)
+    {
+        if(mat.illum >= 6) {
+            type = MaterialType::Refractive;
+        } else if(mat.illum >= 3) {
+            type = MaterialType::Mirror;
+        } else if(specular.norm() > 0.1f) {
+            type = MaterialType::Glossy;
+        } else {
+            type = MaterialType::Diffuse;
+        }
+    }
+
+    bool isEmissive() const { return emission[0] > 0.f || emission[1] > 0.f || emission[2] > 0.f; }
+
+    bool operator==(const Material &other) const {
+        return diffuse == other.diffuse && specular == other.specular && emission == other.emission
+               && ior == other.ior && shininess == other.shininess && type == other.type;
+    }
+
+    Eigen::Vector3f diffuse;
+    Eigen::Vector3f specular;
+    Eigen::Vector3f emission;
+    float ior;
+    float shininess;
+    MaterialType type;
+};
+
+struct MaterialHash {
+    size_t operator()(const Material &material) const {
+        std::hash<float> hash;
+        size_t h = static_cast<size_t>(material.type);
+        for(int i = 0; i < 3; ++i) {
+            h = h * 31 + hash(material.diffuse[i]);
+            h = h * 31 + hash(material.specular[i]);
+            h = h * 31 + hash(material.emission[i]);
+        }
+        return (h * 31 + hash(material.ior)) * 31 + hash(material.shininess);
+    }
+};
+
+#endif // MATERIAL_H
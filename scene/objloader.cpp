@@ -0,0 +1,730 @@
+#include "objloader.h"
+
+#include "BVH/Log.h"
+#include "BVH/Stopwatch.h"
+
+#include <util/RandomStream.h>
+
+#include <QFile>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdint.h>
+#include <thread>
+#include <unordered_map>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "util/tiny_obj_loader.h"
+
+using namespace Eigen;
+
+namespace {
+
+// Chunks are at least this big, so small files are not split for nothing
+const size_t MinChunkBytes = 1 << 20;
+// and there are this many per thread, so a chunk full of faces doesn't hold up the others
+const int ChunksPerThread = 4;
+
+// The position, texcoord and normal indices of a face corner; a missing texcoord or normal is -1
+struct ObjCorner {
+    int vertex, texcoord, normal;
+};
+
+// A usemtl or mtllib line, applied before the face it precedes
+struct ObjStatement {
+    size_t face; // the number of faces of the chunk before it
+    bool mtllib;
+    std::string argument; // the rest of the line
+};
+
+// What one chunk of lines of the file holds. Corner indices are zero based and count from the
+// start of the file, except the relative (negative) ones of the .obj, which can only be resolved
+// from the start of the chunk until the counts of the chunks before it are known. The slots of
+// those, as indices into the corners viewed as ints, are in relativeSlots.
+struct ObjChunk {
+    std::vector<float> positions; // 3 per vertex
+    std::vector<float> colors; // 3 per vertex
+    std::vector<float> normals; // 3 per normal
+    std::vector<float> texcoords; // 2 per texcoord
+    std::vector<ObjCorner> corners;
+    std::vector<int> faceSizes; // corners of each face
+    std::vector<size_t> relativeSlots;
+    std::vector<ObjStatement> statements;
+    std::string error;
+};
+
+inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// The decimal number in [s, e), ignoring anything after it. Up to 19 significant digits go into
+// an integer that is scaled by one exactly representable power of ten, which rounds correctly
+// while the integer fits a double; longer numbers and large exponents take a slower, long double
+// path. Fails like tinyobj does when there are no digits or the exponent is empty.
+bool parseFloat(const char *s, const char *e, float *out)
+{
+    static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *p = s;
+    bool negative = false;
+    if(p < e && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false, truncated = false;
+    for(; p < e && isDigit(*p); ++p) {
+        any = true;
+        if(digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            ++exponent;
+            truncated |= *p != '0';
+        }
+    }
+    if(p < e && *p == '.') {
+        for(++p; p < e && isDigit(*p); ++p) {
+            any = true;
+            if(digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            } else {
+                truncated |= *p != '0';
+            }
+        }
+    }
+    if(!any) {
+        return false;
+    }
+    if(p < e && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negativeExponent = false;
+        if(p < e && (*p == '+' || *p == '-')) {
+            negativeExponent = *p == '-';
+            ++p;
+        }
+        if(p == e || !isDigit(*p)) {
+            return false;
+        }
+        int written = 0;
+        for(; p < e && isDigit(*p); ++p) {
+            written = std::min(written * 10 + (*p - '0'), 100000);
+        }
+        exponent += negativeExponent ? -written : written;
+    }
+
+    double value;
+    if(mantissa == 0) {
+        value = 0.0;
+    } else if(!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        value = exponent < 0 ? double(mantissa) / powersOfTen[-exponent] : double(mantissa) * powersOfTen[exponent];
+    } else {
+        value = double((long double)mantissa * std::pow(10.0L, exponent));
+    }
+    *out = float(negative ? -value : value);
+    return true;
+}
+
+// Reads the next whitespace separated field of the line as a number, like tinyobj's parseReal:
+// a field that isn't one gives defaultValue.
+float parseReal(const char *&p, const char *end, float defaultValue)
+{
+    while(p < end && isSpace(*p)) {
+        ++p;
+    }
+    const char *fieldEnd = p;
+    while(fieldEnd < end && !isSpace(*fieldEnd) && *fieldEnd != '\r') {
+        ++fieldEnd;
+    }
+    float value = defaultValue;
+    parseFloat(p, fieldEnd, &value);
+    p = fieldEnd;
+    return value;
+}
+
+// atoi, without running past the end of the line
+int parseInt(const char *p, const char *end)
+{
+    bool negative = false;
+    if(p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        ++p;
+    }
+    int value = 0;
+    for(; p < end && isDigit(*p); ++p) {
+        value = value * 10 + (*p - '0');
+    }
+    return negative ? -value : value;
+}
+
+const char *skipIndex(const char *p, const char *end)
+{
+    while(p < end && *p != '/' && !isSpace(*p) && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+
+// Stores an .obj index in a corner slot: positive ones count from 1 at the start of the file,
+// negative ones back from the last element of their kind so far, 0 is an error
+bool storeIndex(int index, int countInChunk, ObjChunk *chunk, int *slot)
+{
+    if(index > 0) {
+        *slot = index - 1;
+    } else if(index < 0) {
+        *slot = countInChunk + index;
+        chunk->relativeSlots.push_back(slot - reinterpret_cast<int *>(chunk->corners.data()));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One "f" line: corners of the forms v, v/vt, v//vn and v/vt/vn
+bool parseFace(const char *p, const char *end, ObjChunk *chunk)
+{
+    int positionCount = chunk->positions.size() / 3;
+    int normalCount = chunk->normals.size() / 3;
+    int texcoordCount = chunk->texcoords.size() / 2;
+    size_t firstCorner = chunk->corners.size();
+
+    while(p < end && isSpace(*p)) {
+        ++p;
+    }
+    while(p < end && *p != '\r') {
+        chunk->corners.push_back(ObjCorner{-1, -1, -1});
+        ObjCorner &corner = chunk->corners.back();
+        if(!storeIndex(parseInt(p, end), positionCount, chunk, &corner.vertex)) {
+            return false;
+        }
+        p = skipIndex(p, end);
+        if(p < end && *p == '/') {
+            ++p;
+            if(p < end && *p == '/') {
+                ++p;
+                if(!storeIndex(parseInt(p, end), normalCount, chunk, &corner.normal)) {
+                    return false;
+                }
+                p = skipIndex(p, end);
+            } else {
+                if(!storeIndex(parseInt(p, end), texcoordCount, chunk, &corner.texcoord)) {
+                    return false;
+                }
+                p = skipIndex(p, end);
+                if(p < end && *p == '/') {
+                    ++p;
+                    if(!storeIndex(parseInt(p, end), normalCount, chunk, &corner.normal)) {
+                        return false;
+                    }
+                    p = skipIndex(p, end);
+                }
+            }
+        }
+        while(p < end && (isSpace(*p) || *p == '\r')) {
+            ++p;
+        }
+    }
+
+    // tinyobj makes no triangles out of faces with fewer than three corners
+    int size = chunk->corners.size() - firstCorner;
+    if(size < 3) {
+        while(!chunk->relativeSlots.empty()
+              && chunk->relativeSlots.back() >= firstCorner * 3) {
+            chunk->relativeSlots.pop_back();
+        }
+        chunk->corners.resize(firstCorner);
+    } else {
+        chunk->faceSizes.push_back(size);
+    }
+    return true;
+}
+
+bool startsWith(const char *p, const char *end, const char *keyword)
+{
+    size_t length = strlen(keyword);
+    return size_t(end - p) > length && memcmp(p, keyword, length) == 0 && isSpace(p[length]);
+}
+
+// Parses the lines in [p, end), which starts at the beginning of a line and ends after a newline
+// or at the end of the file. Lines are what tinyobj understands; the ones it ignores (groups,
+// objects, smoothing groups, tags) are skipped.
+void parseChunk(const char *p, const char *end, ObjChunk *chunk)
+{
+    while(p < end) {
+        const char *lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+        if(!lineEnd) {
+            lineEnd = end;
+        }
+        const char *next = lineEnd + 1;
+        if(lineEnd > p && lineEnd[-1] == '\r') {
+            --lineEnd;
+        }
+        while(p < lineEnd && isSpace(*p)) {
+            ++p;
+        }
+
+        if(lineEnd - p >= 2 && p[0] == 'v' && isSpace(p[1])) {
+            p += 2;
+            for(int i = 0; i < 3; ++i) {
+                chunk->positions.push_back(parseReal(p, lineEnd, 0.f));
+            }
+            for(int i = 0; i < 3; ++i) {
+                chunk->colors.push_back(parseReal(p, lineEnd, 1.f));
+            }
+        } else if(lineEnd - p >= 3 && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+            p += 3;
+            for(int i = 0; i < 3; ++i) {
+                chunk->normals.push_back(parseReal(p, lineEnd, 0.f));
+            }
+        } else if(lineEnd - p >= 3 && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+            p += 3;
+            for(int i = 0; i < 2; ++i) {
+                chunk->texcoords.push_back(parseReal(p, lineEnd, 0.f));
+            }
+        } else if(lineEnd - p >= 2 && p[0] == 'f' && isSpace(p[1])) {
+            if(!parseFace(p + 2, lineEnd, chunk)) {
+                chunk->error = "Failed to parse face '" + std::string(p, lineEnd) + "' (zero index)";
+                return;
+            }
+        } else if(startsWith(p, lineEnd, "usemtl") || startsWith(p, lineEnd, "mtllib")) {
+            chunk->statements.push_back(ObjStatement{chunk->faceSizes.size(), p[0] == 'm', std::string(p + 7, lineEnd)});
+        }
+        p = next;
+    }
+}
+
+// https://wrf.ecse.rpi.edu//Research/Short_Notes/pnpoly.html, as tinyobj uses it
+int pnpoly(int nvert, float *vertx, float *verty, float testx, float testy)
+{
+    int i, j, c = 0;
+    for(i = 0, j = nvert - 1; i < nvert; j = i++) {
+        if(((verty[i] > testy) != (verty[j] > testy))
+           && (testx < (vertx[j] - vertx[i]) * (testy - verty[i]) / (verty[j] - verty[i]) + vertx[i])) {
+            c = !c;
+        }
+    }
+    return c;
+}
+
+// tinyobj's ear clipping of a polygon in the plane it mostly lies in, step for step, so both
+// loaders cut polygons into the same triangles
+void triangulate(const ObjCorner *face, size_t n, const std::vector<float> &v, std::vector<ObjCorner> *triangles)
+{
+    size_t axes[2] = { 1, 2 };
+    for(size_t k = 0; k < n; ++k) {
+        size_t vi0 = face[(k + 0) % n].vertex;
+        size_t vi1 = face[(k + 1) % n].vertex;
+        size_t vi2 = face[(k + 2) % n].vertex;
+        float e0x = v[vi1*3+0] - v[vi0*3+0];
+        float e0y = v[vi1*3+1] - v[vi0*3+1];
+        float e0z = v[vi1*3+2] - v[vi0*3+2];
+        float e1x = v[vi2*3+0] - v[vi1*3+0];
+        float e1y = v[vi2*3+1] - v[vi1*3+1];
+        float e1z = v[vi2*3+2] - v[vi1*3+2];
+        float cx = fabs(e0y*e1z - e0z*e1y);
+        float cy = fabs(e0z*e1x - e0x*e1z);
+        float cz = fabs(e0x*e1y - e0y*e1x);
+        const float epsilon = 0.0001f;
+        if(cx > epsilon || cy > epsilon || cz > epsilon) {
+            if(!(cx > cy && cx > cz)) {
+                axes[0] = 0;
+                if(cz > cx && cz > cy) {
+                    axes[1] = 1;
+                }
+            }
+            break;
+        }
+    }
+
+    float area = 0;
+    for(size_t k = 0; k < n; ++k) {
+        size_t vi0 = face[(k + 0) % n].vertex;
+        size_t vi1 = face[(k + 1) % n].vertex;
+        area += (v[vi0*3+axes[0]] * v[vi1*3+axes[1]] - v[vi0*3+axes[1]] * v[vi1*3+axes[0]]) * 0.5f;
+    }
+
+    int maxRounds = 10; // as tinyobj, in case the polygon has no ears left
+    std::vector<ObjCorner> remaining(face, face + n);
+    size_t guess = 0;
+    ObjCorner ind[3];
+    float vx[3], vy[3];
+    while(remaining.size() > 3 && maxRounds > 0) {
+        n = remaining.size();
+        if(guess >= n) {
+            maxRounds -= 1;
+            guess -= n;
+        }
+        for(size_t k = 0; k < 3; ++k) {
+            ind[k] = remaining[(guess + k) % n];
+            vx[k] = v[ind[k].vertex*3+axes[0]];
+            vy[k] = v[ind[k].vertex*3+axes[1]];
+        }
+        float e0x = vx[1] - vx[0];
+        float e0y = vy[1] - vy[0];
+        float e1x = vx[2] - vx[1];
+        float e1y = vy[2] - vy[1];
+        float cross = e0x*e1y - e0y*e1x;
+        // an internal angle
+        if(cross * area < 0.0f) {
+            guess += 1;
+            continue;
+        }
+
+        // no other corner may lie inside the ear
+        bool overlap = false;
+        for(size_t other = 3; other < n; ++other) {
+            size_t vi = remaining[(guess + other) % n].vertex;
+            if(pnpoly(3, vx, vy, v[vi*3+axes[0]], v[vi*3+axes[1]])) {
+                overlap = true;
+                break;
+            }
+        }
+        if(overlap) {
+            guess += 1;
+            continue;
+        }
+
+        triangles->insert(triangles->end(), ind, ind + 3);
+        remaining.erase(remaining.begin() + (guess + 1) % n);
+    }
+    if(remaining.size() == 3) {
+        triangles->insert(triangles->end(), remaining.begin(), remaining.end());
+    }
+}
+
+// Joins the chunks into the mesh: resolves relative indices, reads the .mtl files and assigns
+// materials in file order, triangulates, and gives every distinct corner its vertex
+bool mergeChunks(std::vector<ObjChunk> &chunks, const std::string &mtlBaseDir, const Affine3f &transform,
+                 ObjMeshData *mesh, std::string *messages)
+{
+    std::vector<float> positions, colors, normals, texcoords;
+    size_t cornerCount = 0, faceCount = 0;
+    for(ObjChunk &chunk : chunks) {
+        int bases[3] = { int(positions.size() / 3), int(texcoords.size() / 2), int(normals.size() / 3) };
+        int *slots = reinterpret_cast<int *>(chunk.corners.data());
+        for(size_t slot : chunk.relativeSlots) {
+            slots[slot] += bases[slot % 3];
+        }
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        colors.insert(colors.end(), chunk.colors.begin(), chunk.colors.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+        std::vector<float>().swap(chunk.positions);
+        std::vector<float>().swap(chunk.colors);
+        std::vector<float>().swap(chunk.normals);
+        std::vector<float>().swap(chunk.texcoords);
+        cornerCount += chunk.corners.size();
+        faceCount += chunk.faceSizes.size();
+    }
+    int positionCount = positions.size() / 3;
+    int normalCount = normals.size() / 3;
+    int texcoordCount = texcoords.size() / 2;
+
+    mesh->faces.reserve(faceCount);
+    mesh->materialIds.reserve(faceCount);
+    mesh->vertices.reserve(std::min<size_t>(cornerCount, positionCount * 2));
+
+    // The vertices made from each position, chained through nextVertex
+    std::vector<int> firstVertex(positionCount, -1);
+    std::vector<int> nextVertex;
+    std::vector<ObjCorner> vertexCorners;
+    nextVertex.reserve(mesh->vertices.capacity());
+    vertexCorners.reserve(mesh->vertices.capacity());
+    auto vertexFor = [&](const ObjCorner &corner) {
+        for(int v = firstVertex[corner.vertex]; v >= 0; v = nextVertex[v]) {
+            if(vertexCorners[v].normal == corner.normal && vertexCorners[v].texcoord == corner.texcoord) {
+                return v;
+            }
+        }
+        int v = vertexCorners.size();
+        nextVertex.push_back(firstVertex[corner.vertex]);
+        firstVertex[corner.vertex] = v;
+        vertexCorners.push_back(corner);
+        return v;
+    };
+
+    std::vector<tinyobj::material_t> materials;
+    std::map<std::string, int> materialMap;
+    tinyobj::MaterialFileReader readMaterials(mtlBaseDir);
+    int material = -1;
+    auto apply = [&](const ObjStatement &statement) {
+        if(!statement.mtllib) {
+            auto found = materialMap.find(statement.argument);
+            material = found != materialMap.end() ? found->second : -1;
+            return;
+        }
+        std::stringstream names(statement.argument);
+        std::string name;
+        while(std::getline(names, name, ' ')) {
+            if(readMaterials(name, &materials, &materialMap, messages)) {
+                return;
+            }
+        }
+        *messages += "WARN: Failed to load material file(s). Use default material.\n";
+    };
+
+    std::vector<ObjCorner> triangles;
+    for(const ObjChunk &chunk : chunks) {
+        const ObjCorner *corners = chunk.corners.data();
+        size_t next = 0;
+        for(size_t f = 0; f < chunk.faceSizes.size(); ++f) {
+            for(; next < chunk.statements.size() && chunk.statements[next].face == f; ++next) {
+                apply(chunk.statements[next]);
+            }
+            int size = chunk.faceSizes[f];
+            for(int c = 0; c < size; ++c) {
+                const ObjCorner &corner = corners[c];
+                if(corner.vertex < 0 || corner.vertex >= positionCount || corner.normal < -1 || corner.normal >= normalCount
+                   || corner.texcoord < -1 || corner.texcoord >= texcoordCount) {
+                    *messages += "Face refers to a vertex, normal or texcoord that does not exist\n";
+                    return false;
+                }
+            }
+            const ObjCorner *triangle = corners;
+            size_t triangleCorners = 3;
+            if(size > 3) {
+                triangles.clear();
+                triangulate(corners, size, positions, &triangles);
+                triangle = triangles.data();
+                triangleCorners = triangles.size();
+            }
+            for(size_t t = 0; t < triangleCorners; t += 3) {
+                Vector3i face;
+                for(int c = 0; c < 3; ++c) {
+                    face[c] = vertexFor(triangle[t + c]);
+                }
+                mesh->faces.push_back(face);
+                mesh->materialIds.push_back(material);
+            }
+            corners += size;
+        }
+        for(; next < chunk.statements.size(); ++next) {
+            apply(chunk.statements[next]);
+        }
+    }
+
+    for(const tinyobj::material_t &mat : materials) {
+        mesh->materials.push_back(Material(mat));
+    }
+
+    size_t vertexCount = vertexCorners.size();
+    mesh->vertices.resize(vertexCount);
+    mesh->normals.resize(vertexCount);
+    mesh->uvs.resize(vertexCount);
+    mesh->colors.resize(vertexCount);
+    // Normals go through the inverse transpose, which keeps them perpendicular under non-uniform scales
+    Matrix3f normalTransform = transform.linear().inverse().transpose();
+    for(size_t v = 0; v < vertexCount; ++v) {
+        const ObjCorner &corner = vertexCorners[v];
+        const float *position = &positions[3 * corner.vertex];
+        const float *color = &colors[3 * corner.vertex];
+        Vector3f normal = corner.normal < 0 ? Vector3f::Zero() : Vector3f(Map<const Vector3f>(&normals[3 * corner.normal]));
+        mesh->vertices[v] = transform * Vector3f(position[0], position[1], position[2]);
+        mesh->normals[v] = (normalTransform * normal).normalized();
+        mesh->uvs[v] = corner.texcoord < 0 ? Vector2f::Zero() : Vector2f(texcoords[2 * corner.texcoord], texcoords[2 * corner.texcoord + 1]);
+        mesh->colors[v] = Vector3f(color[0], color[1], color[2]);
+    }
+    return true;
+}
+
+bool loadParallel(const std::string &path, const std::string &mtlBaseDir, const Affine3f &transform, int numThreads,
+                  ObjMeshData *mesh, std::string *messages)
+{
+    Stopwatch sw;
+    QFile file(QString::fromStdString(path));
+    if(!file.open(QIODevice::ReadOnly)) {
+        *messages += "Cannot open " + path + "\n";
+        return false;
+    }
+    size_t size = file.size();
+    const char *data = size > 0 ? reinterpret_cast<const char *>(file.map(0, size)) : nullptr;
+    if(!data) {
+        *messages += "Cannot map " + path + "\n";
+        return false;
+    }
+
+    // Chunk boundaries are moved forward to the start of the next line
+    int nThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    size_t nChunks = std::max<size_t>(1, std::min<size_t>(size / MinChunkBytes, nThreads * ChunksPerThread));
+    std::vector<size_t> bounds(nChunks + 1, size);
+    bounds[0] = 0;
+    for(size_t c = 1; c < nChunks; ++c) {
+        size_t start = std::max(bounds[c - 1], size * c / nChunks);
+        const char *newline = start < size ? static_cast<const char *>(memchr(data + start, '\n', size - start)) : nullptr;
+        bounds[c] = newline ? newline - data + 1 : size;
+    }
+
+    std::vector<ObjChunk> chunks(nChunks);
+    std::atomic<size_t> nextChunk(0);
+    auto parseChunks = [&]() {
+        for(size_t c; (c = nextChunk++) < nChunks;) {
+            parseChunk(data + bounds[c], data + bounds[c + 1], &chunks[c]);
+        }
+    };
+    nThreads = std::min<size_t>(nThreads, nChunks);
+    std::vector<std::thread> threads;
+    for(int t = 1; t < nThreads; ++t) {
+        threads.emplace_back(parseChunks);
+    }
+    parseChunks();
+    for(std::thread &t : threads) {
+        t.join();
+    }
+    double parseSeconds = sw.read();
+
+    for(const ObjChunk &chunk : chunks) {
+        if(!chunk.error.empty()) {
+            *messages += chunk.error + "\n";
+            return false;
+        }
+    }
+    if(!mergeChunks(chunks, mtlBaseDir, transform, mesh, messages)) {
+        return false;
+    }
+    double seconds = sw.read();
+    LOG_STAT("Read %s (%.1f MB) in %d ms, %.0f MB/s: %d ms parsing %d chunks on %d threads, %d ms merging",
+             path.c_str(), size / 1048576.0, (int)(1000 * seconds), size / 1048576.0 / std::max(seconds, 1e-6),
+             (int)(1000 * parseSeconds), (int)nChunks, nThreads, (int)(1000 * (seconds - parseSeconds)));
+    return true;
+}
+
+// The position, normal and texcoord indices of an .obj face corner
+struct ObjIndexKey {
+    int vertex, normal, texcoord;
+    bool operator==(const ObjIndexKey &other) const {
+        return vertex == other.vertex && normal == other.normal && texcoord == other.texcoord;
+    }
+};
+
+struct ObjIndexKeyHash {
+    size_t operator()(const ObjIndexKey &key) const {
+        return pcgHash(key.vertex ^ pcgHash(key.normal ^ pcgHash(key.texcoord)));
+    }
+};
+
+bool loadTinyObj(const std::string &path, const std::string &mtlBaseDir, const Affine3f &transform,
+                 ObjMeshData *mesh, std::string *messages)
+{
+    Stopwatch sw;
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+
+    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, messages, path.c_str(), mtlBaseDir.c_str(), true);
+    if(!ret) {
+        return false;
+    }
+
+    for(const tinyobj::material_t &mat : materials) {
+        mesh->materials.push_back(Material(mat));
+    }
+
+    size_t numFaces = 0, numIndices = 0;
+    for(size_t s = 0; s < shapes.size(); s++) {
+        numFaces += shapes[s].mesh.num_face_vertices.size();
+        numIndices += shapes[s].mesh.indices.size();
+    }
+    mesh->faces.reserve(numFaces);
+    mesh->materialIds.reserve(numFaces);
+    std::unordered_map<ObjIndexKey, int, ObjIndexKeyHash> vertexIds;
+    vertexIds.reserve(numIndices / 2);
+    Matrix3f normalTransform = transform.linear().inverse().transpose();
+
+    for(size_t s = 0; s < shapes.size(); s++) {
+        size_t index_offset = 0;
+        for(size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+            unsigned int fv = shapes[s].mesh.num_face_vertices[f];
+
+            Vector3i face;
+            for(size_t v = 0; v < fv; v++) {
+                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+                ObjIndexKey key = { idx.vertex_index, idx.normal_index, idx.texcoord_index };
+                auto found = vertexIds.find(key);
+                if(found != vertexIds.end()) {
+                    face[v] = found->second;
+                    continue;
+                }
+
+                tinyobj::real_t vx = attrib.vertices[3*idx.vertex_index+0];
+                tinyobj::real_t vy = attrib.vertices[3*idx.vertex_index+1];
+                tinyobj::real_t vz = attrib.vertices[3*idx.vertex_index+2];
+                tinyobj::real_t nx;
+                tinyobj::real_t ny;
+                tinyobj::real_t nz;
+                tinyobj::real_t tx;
+                tinyobj::real_t ty;
+
+                if(idx.normal_index != -1) {
+                    nx = attrib.normals[3*idx.normal_index+0];
+                    ny = attrib.normals[3*idx.normal_index+1];
+                    nz = attrib.normals[3*idx.normal_index+2];
+                } else {
+                    nx = 0;
+                    ny = 0;
+                    nz = 0;
+                }
+                if(idx.texcoord_index != -1) {
+                    tx = attrib.texcoords[2*idx.texcoord_index+0];
+                    ty = attrib.texcoords[2*idx.texcoord_index+1];
+                } else {
+                    tx = 0;
+                    ty = 0;
+                }
+
+                tinyobj::real_t red = attrib.colors[3*idx.vertex_index+0];
+                tinyobj::real_t green = attrib.colors[3*idx.vertex_index+1];
+                tinyobj::real_t blue = attrib.colors[3*idx.vertex_index+2];
+
+                face[v] = mesh->vertices.size();
+                vertexIds.emplace(key, face[v]);
+                mesh->vertices.push_back(transform * Vector3f(vx, vy, vz));
+                mesh->normals.push_back((normalTransform * Vector3f(nx, ny, nz)).normalized());
+                mesh->uvs.push_back(Vector2f(tx, ty));
+                mesh->colors.push_back(Vector3f(red, green, blue));
+            }
+            mesh->faces.push_back(face);
+            mesh->materialIds.push_back(shapes[s].mesh.material_ids[f]);
+
+            index_offset += fv;
+        }
+    }
+
+    double seconds = sw.read();
+    double megabytes = QFileInfo(QString::fromStdString(path)).size() / 1048576.0;
+    LOG_STAT("Read %s (%.1f MB) with tinyobj in %d ms, %.0f MB/s", path.c_str(), megabytes, (int)(1000 * seconds),
+             megabytes / std::max(seconds, 1e-6));
+    return true;
+}
+
+}
+
+namespace ObjLoader {
+
+bool load(const std::string &path, const Affine3f &transform, ObjLoaderType type, int numThreads,
+          ObjMeshData *mesh, std::string *messages)
+{
+    std::string mtlBaseDir = QFileInfo(QString::fromStdString(path)).absolutePath().toStdString() + "/";
+    if(type == ObjLoaderType::TinyObj) {
+        return loadTinyObj(path, mtlBaseDir, transform, mesh, messages);
+    }
+    return loadParallel(path, mtlBaseDir, transform, numThreads, mesh, messages);
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include "material.h"
+
+#include <Eigen/Dense>
+
+#include <string>
+#include <vector>
+
+enum class ObjLoaderType {
+    Parallel, // the file mapped and cut into line aligned chunks, parsed on several threads
+    TinyObj   // tinyobj::LoadObj reading a stream on one thread
+};
+
+// One .obj file the way Mesh::init takes it. There is a vertex for every distinct (position,
+// normal, uv) index tuple of the face corners, in the order the faces first use them, already
+// transformed; the faces are in file order with polygons triangulated like tinyobj does.
+struct ObjMeshData {
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<Eigen::Vector3f> normals;
+    std::vector<Eigen::Vector2f> uvs;
+    std::vector<Eigen::Vector3f> colors;
+    std::vector<Eigen::Vector3i> faces;
+    std::vector<int> materialIds; // into materials, -1 for faces without a material
+    std::vector<Material> materials; // from the file's mtllib lines
+};
+
+namespace ObjLoader {
+
+// Reads the .obj at path and the .mtl files it names. numThreads <= 0 uses every hardware
+// thread; the tinyobj loader always runs on the calling thread. Warnings and the reason for a
+// failure are appended to messages.
+bool load(const std::string &path, const Eigen::Affine3f &transform, ObjLoaderType type, int numThreads,
+          ObjMeshData *mesh, std::string *messages);
+
+}
+
+#endif // OBJLOADER_H
@@ -1,4 +1,5 @@
 #include "scene.h"
+#include "scenecache.h"
 
 #include "shape/Sphere.h"
 
@@ -6,32 +7,106 @@
 
 #include <util/Common.h>
 
+#include "BVH/Stopwatch.h"
+
+#include <QDir>
+#include <QFileInfo>
+
 #include <Eigen/Geometry>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 #include <Eigen/StdVector>
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "util/tiny_obj_loader.h"
-
 using namespace Eigen;
 
+namespace {
+
+SceneCacheBVH appendBVH(SceneCacheWriter &writer, const BVH &bvh, const std::vector<uint32_t> &order)
+{
+    SceneCacheBVH entry;
+    entry.nodeOffset = writer.append(bvh.getNodes(), bvh.getNodeCount());
+    entry.nodeCount = bvh.getNodeCount();
+    entry.orderOffset = writer.append(order.data(), order.size());
+    entry.primCount = order.size();
+    return entry;
+}
+
+// Whether all count indices are in [0, bound)
+template<typename T>
+bool indicesBelow(const T *indices, uint64_t count, uint64_t bound)
+{
+    for(uint64_t i = 0; i < count; ++i) {
+        // Negative ones wrap around to above any bound
+        if((uint64_t)(std::make_unsigned_t<T>)indices[i] >= bound) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hasEmitters(const ObjMeshData &data)
+{
+    for(int materialId : data.materialIds) {
+        if(materialId >= 0 && data.materials[materialId].isEmissive()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A copy of a mesh read in the space of its file, placed by the transform the way the loaders do
+ObjMeshData placed(const ObjMeshData &data, const Affine3f &transform)
+{
+    ObjMeshData copy = data;
+    for(Vector3f &vertex : copy.vertices) {
+        vertex = transform * vertex;
+    }
+    Matrix3f normalTransform = transform.linear().inverse().transpose();
+    for(Vector3f &normal : copy.normals) {
+        normal = (normalTransform * normal).normalized();
+    }
+    return copy;
+}
+
+}
+
 Scene::Scene()
+    : m_bvh(nullptr), _objects(nullptr), m_flatPrims(nullptr), m_triangleBlocks(nullptr), m_instances(nullptr),
+      m_instanceBvh(nullptr)
 {
 }
 
 Scene::~Scene()
 {
+    delete m_triangleBlocks;
+    delete m_flatPrims;
     for(unsigned int i = 0; i < _objects->size(); ++i) {
         Object * o = (*_objects)[i];
         delete o;
     }
     delete _objects;
     delete m_bvh;
+    delete m_instanceBvh;
+    if(m_instances) {
+        for(Object *instance : *m_instances) {
+            delete instance;
+        }
+        delete m_instances;
+    }
+    for(Mesh *mesh : m_instancedMeshes) {
+        delete mesh;
+    }
 }
 
-bool Scene::load(QString filename, Scene **scenePointer, float imageWidth, float imageHeight)
+bool Scene::load(QString filename, Scene **scenePointer, float imageWidth, float imageHeight,
+                 const BVHBuildSettings &bvhSettings, const QString &cacheDir, ObjLoaderType objLoader)
 {
     XmlSceneParser parser(filename.toStdString());
     if(!parser.parse()) {
@@ -58,26 +133,403 @@ bool Scene::load(QString filename, Scene **scenePointer, float imageWidth, float
     }
 
     QFileInfo info(filename);
-    QString dir = info.path();
+    std::string baseDir = info.path().toStdString() + "/";
     SceneNode *root = parser.getRootNode();
-    if(!parseTree(root, scene, dir.toStdString() + "/")) {
+
+    // The camera and lights are always read from the scene file; a cache holds the rest
+    std::string cachePath;
+    uint64_t cacheKey = 0;
+    if(!cacheDir.isEmpty()) {
+        Stopwatch sw;
+        std::set<std::string> meshFiles;
+        collectMeshFiles(root, baseDir, &meshFiles);
+        cacheKey = SceneCache::key(info.absoluteFilePath().toStdString(), meshFiles, bvhSettings);
+        cachePath = SceneCache::path(cacheDir.toStdString(), cacheKey);
+        const SceneCacheHeader *header;
+        std::unique_ptr<QFile> file = SceneCache::open(cachePath, cacheKey, &header);
+        if(file) {
+            qint64 bytes = file->size();
+            if(scene->loadCache(std::move(file), *header, bvhSettings)) {
+                LOG_STAT("Loaded scene cache %s (%d MB) in %d ms", cachePath.c_str(), (int)(bytes >> 20), (int)(1000 * sw.read()));
+                *scenePointer = scene;
+                return true;
+            }
+            LOG_ERROR("Scene cache %s is damaged, loading the scene files instead", cachePath.c_str());
+        }
+    }
+
+    if(!parseTree(root, scene, baseDir, bvhSettings, objLoader)) {
         return false;
     }
 
+    if(!cachePath.empty()) {
+        QDir().mkpath(cacheDir);
+        if(scene->writeCache(cachePath, cacheKey)) {
+            LOG_INFO("Wrote scene cache %s", cachePath.c_str());
+        }
+    }
+
     *scenePointer = scene;
     return true;
 }
 
-void Scene::setBVH(const BVH &bvh)
+void Scene::collectMeshFiles(SceneNode *node, const std::string &baseDir, std::set<std::string> *meshFiles)
+{
+    for(ScenePrimitive *prim : node->primitives) {
+        if(prim->type == PrimitiveType::PRIMITIVE_MESH) {
+            QFileInfo info(QString::fromStdString(baseDir + prim->meshfile));
+            meshFiles->insert(info.absoluteFilePath().toStdString());
+        }
+    }
+    for(SceneNode *child : node->children) {
+        collectMeshFiles(child, baseDir, meshFiles);
+    }
+}
+
+bool Scene::sourceKey(QString filename, uint64_t *key)
+{
+    XmlSceneParser parser(filename.toStdString());
+    if(!parser.parse()) {
+        return false;
+    }
+    QFileInfo info(filename);
+    std::set<std::string> meshFiles;
+    collectMeshFiles(parser.getRootNode(), info.path().toStdString() + "/", &meshFiles);
+    *key = SceneCache::sourceKey(info.absoluteFilePath().toStdString(), meshFiles);
+    return true;
+}
+
+bool Scene::loadCache(std::unique_ptr<QFile> file, const SceneCacheHeader &header, const BVHBuildSettings &bvhSettings)
+{
+    using SceneCache::array;
+    const uchar *data = reinterpret_cast<const uchar *>(&header);
+    uint64_t size = file->size();
+    bool flattened = header.flattened != 0;
+
+    // Check that every array is inside the file before touching the scene
+    const Material *materials = array<Material>(data, size, header.materialOffset, header.materialCount);
+    const SceneCacheMesh *meshes = array<SceneCacheMesh>(data, size, header.meshOffset, header.meshCount);
+    const uint32_t *emissives = array<uint32_t>(data, size, header.emissiveOffset, header.emissiveCount);
+    const BVHFlatNode *sceneNodes = array<BVHFlatNode>(data, size, header.sceneBVH.nodeOffset, header.sceneBVH.nodeCount);
+    const uint32_t *sceneOrder = array<uint32_t>(data, size, header.sceneBVH.orderOffset, header.sceneBVH.primCount);
+    const SceneCacheInstance *instances = array<SceneCacheInstance>(data, size, header.instanceOffset, header.instanceCount);
+    if(!materials || !meshes || !emissives || !sceneNodes || !sceneOrder || !instances || header.meshCount == 0
+       || header.instancedMeshCount > header.meshCount) {
+        return false;
+    }
+    // Only the meshes before the instanced ones are under the scene BVH
+    uint32_t bakedCount = header.meshCount - header.instancedMeshCount;
+    if(bakedCount > 0 ? header.sceneBVH.nodeCount == 0 || flattened != bvhSettings.flattenScene
+                      : header.sceneBVH.nodeCount != 0 || header.instanceCount == 0) {
+        return false;
+    }
+
+    std::vector<MeshArrays> meshArrays(header.meshCount);
+    std::vector<const BVHFlatNode *> meshNodes(header.meshCount, nullptr);
+    std::vector<const uint32_t *> meshOrders(header.meshCount, nullptr);
+    std::vector<uint32_t> firstTriangle(header.meshCount + 1, 0);
+    for(uint32_t m = 0; m < header.meshCount; ++m) {
+        const SceneCacheMesh &mesh = meshes[m];
+        MeshArrays &arrays = meshArrays[m];
+        if(mesh.vertexCount <= 0 || mesh.faceCount < 0) {
+            return false;
+        }
+        arrays.vertices = array<Vector3f>(data, size, mesh.vertexOffset, mesh.vertexCount);
+        arrays.normals = array<Vector3f>(data, size, mesh.normalOffset, mesh.vertexCount);
+        arrays.colors = array<Vector3f>(data, size, mesh.colorOffset, mesh.vertexCount);
+        arrays.uvs = array<Vector2f>(data, size, mesh.uvOffset, mesh.vertexCount);
+        arrays.faces = array<Vector3i>(data, size, mesh.faceOffset, mesh.faceCount);
+        arrays.materialIds = array<int>(data, size, mesh.materialOffset, mesh.faceCount);
+        arrays.vertexCount = mesh.vertexCount;
+        arrays.faceCount = mesh.faceCount;
+        if(!arrays.vertices || !arrays.normals || !arrays.colors || !arrays.uvs || !arrays.faces || !arrays.materialIds) {
+            return false;
+        }
+        // Nothing read from the file is used as an index before it is checked
+        if(!indicesBelow(arrays.faces->data(), 3 * (uint64_t)mesh.faceCount, mesh.vertexCount)
+           || !indicesBelow(arrays.materialIds, mesh.faceCount, header.materialCount)) {
+            return false;
+        }
+        if(!flattened || m >= bakedCount) {
+            meshNodes[m] = array<BVHFlatNode>(data, size, mesh.bvh.nodeOffset, mesh.bvh.nodeCount);
+            meshOrders[m] = array<uint32_t>(data, size, mesh.bvh.orderOffset, mesh.bvh.primCount);
+            if(!meshNodes[m] || !meshOrders[m] || mesh.bvh.primCount != (uint32_t)mesh.faceCount
+               || !BVH::validTree(meshNodes[m], mesh.bvh.nodeCount, mesh.bvh.primCount)
+               || !indicesBelow(meshOrders[m], mesh.bvh.primCount, mesh.bvh.primCount)) {
+                return false;
+            }
+        }
+        firstTriangle[m + 1] = firstTriangle[m] + mesh.faceCount;
+    }
+    uint32_t triangleCount = firstTriangle.back();
+    uint32_t bakedTriangleCount = firstTriangle[bakedCount];
+    if(header.sceneBVH.primCount != (bakedCount == 0 ? 0 : flattened ? bakedTriangleCount : bakedCount)
+       || (bakedCount > 0 && !BVH::validTree(sceneNodes, header.sceneBVH.nodeCount, header.sceneBVH.primCount))
+       || !indicesBelow(sceneOrder, header.sceneBVH.primCount, header.sceneBVH.primCount)) {
+        return false;
+    }
+    for(uint32_t i = 0; i < header.emissiveCount; ++i) {
+        if(emissives[i] >= bakedTriangleCount) {
+            return false;
+        }
+    }
+    for(uint32_t i = 0; i < header.instanceCount; ++i) {
+        if(instances[i].mesh < bakedCount || instances[i].mesh >= header.meshCount) {
+            return false;
+        }
+    }
+
+    // The meshes read their arrays and BVHs straight from the mapping
+    m_materials.assign(materials, materials + header.materialCount);
+    std::vector<Mesh *> loaded(header.meshCount);
+    std::vector<Triangle *> triangles(triangleCount);
+    BVHBuildSettings instancedSettings = bvhSettings;
+    instancedSettings.flattenScene = false;
+    for(uint32_t m = 0; m < header.meshCount; ++m) {
+        Mesh *mesh = new Mesh;
+        mesh->init(meshArrays[m], meshNodes[m], meshes[m].bvh.nodeCount, meshOrders[m],
+                   m < bakedCount ? bvhSettings : instancedSettings);
+        mesh->setTransform(Affine3f(Map<const Matrix4f>(meshes[m].transform)));
+        for(int i = 0; i < meshArrays[m].faceCount; ++i) {
+            triangles[firstTriangle[m] + i] = mesh->getTriangles() + i;
+        }
+        loaded[m] = mesh;
+    }
+    for(uint32_t i = 0; i < header.emissiveCount; ++i) {
+        m_emissives.push_back(triangles[emissives[i]]);
+    }
+
+    // The scene BVH's primitives in the order its leaves refer to them
+    std::vector<Object *> *objects = new std::vector<Object *>(loaded.begin(), loaded.begin() + bakedCount);
+    std::vector<Object *> *flatPrims = nullptr;
+    BVH *bvh = nullptr;
+    if(bakedCount > 0) {
+        std::vector<Object *> *prims;
+        if(flattened) {
+            flatPrims = new std::vector<Object *>(bakedTriangleCount);
+            for(uint32_t i = 0; i < bakedTriangleCount; ++i) {
+                (*flatPrims)[i] = triangles[sceneOrder[i]];
+            }
+            prims = flatPrims;
+        } else {
+            for(uint32_t i = 0; i < bakedCount; ++i) {
+                (*objects)[i] = loaded[sceneOrder[i]];
+            }
+            prims = objects;
+        }
+        bvh = new BVH(prims, sceneNodes, header.sceneBVH.nodeCount, bvhSettings);
+    }
+
+    std::vector<Mesh *> instancedMeshes(loaded.begin() + bakedCount, loaded.end());
+    std::vector<Object *> *placed = new std::vector<Object *>;
+    for(uint32_t i = 0; i < header.instanceCount; ++i) {
+        placed->push_back(new MeshInstance(loaded[instances[i].mesh], Affine3f(Map<const Matrix4f>(instances[i].transform))));
+    }
+    m_cacheFile = std::move(file);
+    finishLoading(objects, flatPrims, bvh, std::move(instancedMeshes), placed, bvhSettings);
+    return true;
+}
+
+bool Scene::writeCache(const std::string &path, uint64_t key) const
+{
+    SceneCacheWriter writer(path);
+    SceneCacheHeader header = {};
+    header.key = key;
+    header.flattened = m_flatPrims != nullptr;
+    header.materialCount = m_materials.size();
+    header.materialOffset = writer.append(m_materials.data(), m_materials.size());
+
+    // Triangles are numbered across the meshes, in mesh order
+    std::unordered_map<const Mesh *, uint32_t> meshIndices, firstTriangle;
+    std::vector<SceneCacheMesh> meshes;
+    uint32_t triangleCount = 0;
+    std::vector<const Mesh *> allMeshes;
+    for(Object *object : *_objects) {
+        allMeshes.push_back(static_cast<const Mesh *>(object));
+    }
+    allMeshes.insert(allMeshes.end(), m_instancedMeshes.begin(), m_instancedMeshes.end());
+    for(const Mesh *mesh : allMeshes) {
+        const MeshArrays &arrays = mesh->getArrays();
+        SceneCacheMesh entry = {};
+        memcpy(entry.transform, mesh->transform.matrix().data(), sizeof(entry.transform));
+        entry.vertexOffset = writer.append(arrays.vertices, arrays.vertexCount);
+        entry.normalOffset = writer.append(arrays.normals, arrays.vertexCount);
+        entry.colorOffset = writer.append(arrays.colors, arrays.vertexCount);
+        entry.uvOffset = writer.append(arrays.uvs, arrays.vertexCount);
+        entry.faceOffset = writer.append(arrays.faces, arrays.faceCount);
+        entry.materialOffset = writer.append(arrays.materialIds, arrays.faceCount);
+        entry.vertexCount = arrays.vertexCount;
+        entry.faceCount = arrays.faceCount;
+        if(const BVH *bvh = mesh->getBVH()) {
+            std::vector<uint32_t> order;
+            for(const Object *prim : bvh->getPrimitives()) {
+                order.push_back(static_cast<const Triangle *>(prim)->getIndex());
+            }
+            entry.bvh = appendBVH(writer, *bvh, order);
+        }
+        meshIndices[mesh] = meshes.size();
+        firstTriangle[mesh] = triangleCount;
+        triangleCount += arrays.faceCount;
+        meshes.push_back(entry);
+    }
+    header.meshCount = meshes.size();
+    header.meshOffset = writer.append(meshes.data(), meshes.size());
+    header.instancedMeshCount = m_instancedMeshes.size();
+
+    std::vector<SceneCacheInstance> instances;
+    if(m_instances) {
+        for(const Object *object : *m_instances) {
+            const MeshInstance *instance = static_cast<const MeshInstance *>(object);
+            SceneCacheInstance entry = {};
+            memcpy(entry.transform, instance->transform.matrix().data(), sizeof(entry.transform));
+            entry.mesh = meshIndices[instance->getMesh()];
+            instances.push_back(entry);
+        }
+    }
+    header.instanceCount = instances.size();
+    header.instanceOffset = writer.append(instances.data(), instances.size());
+
+    auto triangleIndex = [&](const Object *object) {
+        const Triangle *triangle = static_cast<const Triangle *>(object);
+        return firstTriangle[triangle->getMesh()] + triangle->getIndex();
+    };
+    std::vector<uint32_t> emissives;
+    for(const Triangle *triangle : m_emissives) {
+        emissives.push_back(triangleIndex(triangle));
+    }
+    header.emissiveCount = emissives.size();
+    header.emissiveOffset = writer.append(emissives.data(), emissives.size());
+
+    if(m_bvh) {
+        std::vector<uint32_t> order;
+        for(const Object *prim : getBVH().getPrimitives()) {
+            order.push_back(m_flatPrims ? triangleIndex(prim) : meshIndices[static_cast<const Mesh *>(prim)]);
+        }
+        header.sceneBVH = appendBVH(writer, getBVH(), order);
+    }
+    return writer.finish(header);
+}
+
+void Scene::finishLoading(std::vector<Object *> *objects, std::vector<Object *> *flatPrims, BVH *bvh,
+                          std::vector<Mesh *> &&instancedMeshes, std::vector<Object *> *instances, const BVHBuildSettings &bvhSettings)
 {
-    m_bvh = new BVH(bvh);
+    m_lightSampler = LightSampler(m_emissives, m_materials);
+    LOG_STAT("Light sampling: %d emissive triangles, light BVH of %d nodes", (int)m_lightSampler.getLights().size(),
+             (int)m_lightSampler.getBVH().getNodeCount());
+
+    size_t triangleCount = 0, geometryBytes = 0;
+    for (Object *object : *objects) {
+        Mesh *mesh = static_cast<Mesh*>(object);
+        triangleCount += mesh->getTriangleCount();
+        geometryBytes += mesh->getMemoryBytes();
+    }
+    if (flatPrims) {
+        geometryBytes += triangleCount * sizeof(Object *);
+    }
+    LOG_STAT("Geometry: %d triangles in %d KB, %.1f bytes per triangle (%d bytes per Triangle object)",
+             (int)triangleCount, (int)(geometryBytes / 1024), (float)geometryBytes / std::max<size_t>(triangleCount, 1),
+             (int)sizeof(Triangle));
+
+    _objects = objects;
+    m_flatPrims = flatPrims;
+    m_bvh = bvh;
+    if(m_flatPrims) {
+        m_triangleBlocks = new TriangleBlocks(getBVH());
+        LOG_STAT("Packed %d triangles into %d-wide blocks (%d KB)", (int)m_flatPrims->size(),
+                 TRIANGLE_BLOCK_WIDTH, (int)(m_triangleBlocks->getMemoryBytes() / 1024));
+    }
+
+    m_instancedMeshes = std::move(instancedMeshes);
+    if(instances->empty()) {
+        delete instances;
+        return;
+    }
+    m_instances = instances;
+    m_instanceBvh = new BVH(m_instances, bvhSettings);
+    size_t placedTriangles = 0, instancedTriangles = 0, instancedBytes = m_instances->size() * sizeof(MeshInstance);
+    for(const Object *instance : *m_instances) {
+        placedTriangles += static_cast<const MeshInstance *>(instance)->getMesh()->getTriangleCount();
+    }
+    for(const Mesh *mesh : m_instancedMeshes) {
+        instancedTriangles += mesh->getTriangleCount();
+        instancedBytes += mesh->getMemoryBytes();
+    }
+    LOG_STAT("Instancing: %d instances of %d meshes place %d triangles, stored once as %d triangles in %d KB",
+             (int)m_instances->size(), (int)m_instancedMeshes.size(), (int)placedTriangles, (int)instancedTriangles,
+             (int)(instancedBytes / 1024));
 }
 
-bool Scene::parseTree(SceneNode *root, Scene *scene, const std::string &baseDir)
+bool Scene::parseTree(SceneNode *root, Scene *scene, const std::string &baseDir, const BVHBuildSettings &bvhSettings, ObjLoaderType objLoader)
 {
+    std::vector<MeshFile> meshFiles;
+    parseNode(root, Affine3f::Identity(), &meshFiles, baseDir);
+
+    // A file placed more than once is read once, in its own space, and instanced
+    std::unordered_map<std::string, int> placements;
+    for(const MeshFile &file : meshFiles) {
+        ++placements[file.path];
+    }
+    std::vector<MeshFile> reads;
+    std::vector<size_t> readOf(meshFiles.size());
+    std::unordered_map<std::string, size_t> sharedReads;
+    for(size_t i = 0; i < meshFiles.size(); ++i) {
+        if(placements[meshFiles[i].path] == 1) {
+            readOf[i] = reads.size();
+            reads.push_back(meshFiles[i]);
+            continue;
+        }
+        auto shared = sharedReads.emplace(meshFiles[i].path, reads.size());
+        if(shared.second) {
+            reads.push_back(MeshFile{meshFiles[i].path, Affine3f::Identity()});
+        }
+        readOf[i] = shared.first->second;
+    }
+    std::vector<ObjMeshData> meshData(reads.size());
+    loadMeshFiles(reads, objLoader, bvhSettings.numThreads, &meshData);
+
+    size_t fileMaterials = 0;
+    for(const ObjMeshData &data : meshData) {
+        fileMaterials += data.materials.size();
+    }
+
+    // The meshes' materials go into the scene's table in scene file order, however the files were read.
+    // Light sampling needs emitters in world space, so a shared file with any is copied into every
+    // placement instead.
+    MaterialTable materials = {&scene->m_materials, {}};
+    BVHBuildSettings instancedSettings = bvhSettings;
+    instancedSettings.flattenScene = false;
     std::vector<Object *> *objects = new std::vector<Object *>;
-    parseNode(root, Affine3f::Identity(), objects, baseDir);
-    if(objects->size() == 0) {
+    std::vector<Mesh *> instancedMeshes;
+    std::vector<Object *> *instances = new std::vector<Object *>;
+    std::unordered_map<size_t, Mesh *> instanced;
+    for(size_t i = 0; i < meshFiles.size(); ++i) {
+        // The data of an instanced file has already gone to its mesh
+        auto found = instanced.find(readOf[i]);
+        if(found != instanced.end()) {
+            instances->push_back(new MeshInstance(found->second, meshFiles[i].transform));
+            continue;
+        }
+        ObjMeshData &data = meshData[readOf[i]];
+        if(data.faces.empty()) {
+            std::cerr << "Skipping mesh " << meshFiles[i].path << ", it has no faces" << std::endl;
+            continue;
+        }
+        if(placements[meshFiles[i].path] == 1) {
+            objects->push_back(createMesh(std::move(data), meshFiles[i].transform, &materials, bvhSettings));
+        } else if(hasEmitters(data)) {
+            objects->push_back(createMesh(placed(data, meshFiles[i].transform), meshFiles[i].transform, &materials, bvhSettings));
+        } else {
+            Mesh *master = createMesh(std::move(data), Affine3f::Identity(), &materials, instancedSettings);
+            instanced.emplace(readOf[i], master);
+            instancedMeshes.push_back(master);
+            instances->push_back(new MeshInstance(master, meshFiles[i].transform));
+            std::cout << "Instancing " << meshFiles[i].path << " " << placements[meshFiles[i].path] << " times" << std::endl;
+        }
+    }
+    LOG_STAT("Materials: %d in the scene table, from %d in the mesh files", (int)scene->m_materials.size(), (int)fileMaterials);
+    if(objects->empty() && instances->empty()) {
+        delete objects;
+        delete instances;
         return false;
     }
 
@@ -87,22 +539,35 @@ bool Scene::parseTree(SceneNode *root, Scene *scene, const std::string &baseDir)
         int tri_count = mesh->getTriangleCount();
         Triangle *triangles = mesh->getTriangles();
         for (int i = 0; i < tri_count; i++) {
-            const tinyobj::material_t &mat = triangles[i].getMaterial();
-            if (mat.emission[0] > 0. || mat.emission[1] > 0. || mat.emission[2] > 0.) {
+            if (scene->getMaterial(triangles + i).isEmissive()) {
                 scene->m_emissives.push_back(triangles + i);
             }
         }
     }
-
     std::cout << "Parsed tree, creating BVH" << std::endl;
-    BVH *bvh = new BVH(objects);
+    BVH *bvh = nullptr;
+    std::vector<Object *> *flatPrims = nullptr;
+    if(bvhSettings.flattenScene && !objects->empty()) {
+        // One BVH straight over the triangles of every mesh
+        std::vector<Object *> *triangles = new std::vector<Object *>;
+        for (Object *object : *objects) {
+            Mesh *mesh = static_cast<Mesh*>(object);
+            Triangle *meshTriangles = mesh->getTriangles();
+            for (int i = 0; i < mesh->getTriangleCount(); i++) {
+                triangles->push_back(meshTriangles + i);
+            }
+        }
+        bvh = new BVH(triangles, bvhSettings);
+        flatPrims = triangles;
+    } else if(!objects->empty()) {
+        bvh = new BVH(objects, bvhSettings);
+    }
 
-    scene->_objects = objects;
-    scene->setBVH(*bvh);
+    scene->finishLoading(objects, flatPrims, bvh, std::move(instancedMeshes), instances, bvhSettings);
     return true;
 }
 
-void Scene::parseNode(SceneNode *node, const Affine3f &parentTransform, std::vector<Object *> *objects, const std::string &baseDir)
+void Scene::parseNode(SceneNode *node, const Affine3f &parentTransform, std::vector<MeshFile> *meshFiles, const std::string &baseDir)
 {
     Affine3f transform = parentTransform;
     for(SceneTransformation *trans : node->transformations) {
@@ -122,116 +587,115 @@ void Scene::parseNode(SceneNode *node, const Affine3f &parentTransform, std::vec
         }
     }
     for(ScenePrimitive *prim : node->primitives) {
-        addPrimitive(prim, transform, objects, baseDir);
+        addPrimitive(prim, transform, meshFiles, baseDir);
     }
     for(SceneNode *child : node->children) {
-        parseNode(child, transform, objects, baseDir);
+        parseNode(child, transform, meshFiles, baseDir);
     }
 }
 
-void Scene::addPrimitive(ScenePrimitive *prim, const Affine3f &transform, std::vector<Object *> *objects, const std::string &baseDir)
+void Scene::addPrimitive(ScenePrimitive *prim, const Affine3f &transform, std::vector<MeshFile> *meshFiles, const std::string &baseDir)
 {
     switch(prim->type) {
-    case PrimitiveType::PRIMITIVE_MESH:
+    case PrimitiveType::PRIMITIVE_MESH: {
         std::cout << "Loading mesh " << prim->meshfile << std::endl;
-        objects->push_back(loadMesh(prim->meshfile, transform, baseDir));
-        std::cout << "Done loading mesh" << std::endl;
+        QFileInfo info(QString::fromStdString(baseDir + prim->meshfile));
+        meshFiles->push_back(MeshFile{info.absoluteFilePath().toStdString(), transform});
         break;
+    }
     default:
         std::cerr << "We don't handle any other formats yet" << std::endl;
         break;
     }
 }
 
-Mesh *Scene::loadMesh(std::string filePath, const Affine3f &transform, const std::string &baseDir)
+void Scene::loadMeshFiles(const std::vector<MeshFile> &meshFiles, ObjLoaderType objLoader, int numThreads, std::vector<ObjMeshData> *meshData)
 {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-
-    QFileInfo info(QString((baseDir + filePath).c_str()));
-    std::string err;
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-                                info.absoluteFilePath().toStdString().c_str(), (info.absolutePath().toStdString() + "/").c_str(), true);
-    if(!err.empty()) {
-        std::cerr << err << std::endl;
-    }
-
-    if(!ret) {
-        std::cerr << "Failed to load/parse .obj file" << std::endl;
-        return nullptr;
-    }
-
-    std::vector<Vector3f> vertices;
-    std::vector<Vector3f> normals;
-    std::vector<Vector3f> colors;
-    std::vector<Vector2f> uvs;
-    std::vector<int> materialIds;
-    std::vector<Vector3i> faces;
-
-    //TODO populate vectors and use tranform
-    for(size_t s = 0; s < shapes.size(); s++) {
-        size_t index_offset = 0;
-        for(size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            unsigned int fv = shapes[s].mesh.num_face_vertices[f];
-
-            Vector3i face;
-            for(size_t v = 0; v < fv; v++) {
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                tinyobj::real_t vx = attrib.vertices[3*idx.vertex_index+0];
-                tinyobj::real_t vy = attrib.vertices[3*idx.vertex_index+1];
-                tinyobj::real_t vz = attrib.vertices[3*idx.vertex_index+2];
-                tinyobj::real_t nx;
-                tinyobj::real_t ny;
-                tinyobj::real_t nz;
-                tinyobj::real_t tx;
-                tinyobj::real_t ty;
-
-                if(idx.normal_index != -1) {
-                    nx = attrib.normals[3*idx.normal_index+0];
-                    ny = attrib.normals[3*idx.normal_index+1];
-                    nz = attrib.normals[3*idx.normal_index+2];
-                } else {
-                    nx = 0;
-                    ny = 0;
-                    nz = 0;
-                }
-                if(idx.texcoord_index != -1) {
-                    tx = attrib.texcoords[2*idx.texcoord_index+0];
-                    ty = attrib.texcoords[2*idx.texcoord_index+1];
-                } else {
-                    tx = 0;
-                    ty = 0;
-                }
-
-                tinyobj::real_t red = attrib.colors[3*idx.vertex_index+0];
-                tinyobj::real_t green = attrib.colors[3*idx.vertex_index+1];
-                tinyobj::real_t blue = attrib.colors[3*idx.vertex_index+2];
-
-                face[v] = vertices.size();
-                vertices.push_back(transform * Vector3f(vx, vy, vz));
-                normals.push_back((transform.linear() * Vector3f(nx, ny, nz)).normalized());
-                //vertices.push_back(Vector3f(vx, vy, vz));
-                //normals.push_back(Vector3f(nx, ny, nz).normalized());
-                uvs.push_back(Vector2f(tx, ty));
-                colors.push_back(Vector3f(red, green, blue));
+    // Files are handed out biggest first, so a big one isn't left running alone at the end,
+    // and the threads are split evenly between the files read at once
+    std::vector<size_t> order(meshFiles.size());
+    std::vector<qint64> sizes(meshFiles.size());
+    for(size_t i = 0; i < meshFiles.size(); ++i) {
+        order[i] = i;
+        sizes[i] = QFileInfo(QString::fromStdString(meshFiles[i].path)).size();
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    int nThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    int nReaders = std::max<int>(1, std::min<size_t>(nThreads, meshFiles.size()));
+    int threadsPerFile = std::max(1, nThreads / nReaders);
+
+    Stopwatch sw;
+    std::vector<std::string> messages(meshFiles.size());
+    std::atomic<size_t> next(0);
+    auto readFiles = [&]() {
+        for(size_t i; (i = next++) < order.size();) {
+            size_t m = order[i];
+            if(!ObjLoader::load(meshFiles[m].path, meshFiles[m].transform, objLoader, threadsPerFile, &(*meshData)[m], &messages[m])) {
+                messages[m] += "Failed to load/parse .obj file " + meshFiles[m].path + "\n";
+                (*meshData)[m] = ObjMeshData();
             }
-            faces.push_back(face);
-            materialIds.push_back(shapes[s].mesh.material_ids[f]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(int t = 1; t < nReaders; ++t) {
+        threads.emplace_back(readFiles);
+    }
+    readFiles();
+    for(std::thread &t : threads) {
+        t.join();
+    }
 
-            index_offset += fv;
+    qint64 totalBytes = 0;
+    for(size_t i = 0; i < meshFiles.size(); ++i) {
+        if(!messages[i].empty()) {
+            std::cerr << messages[i];
         }
+        totalBytes += sizes[i];
+    }
+    if(meshFiles.size() > 1) {
+        LOG_STAT("Read %d .obj files (%.1f MB) in %d ms, %d at a time", (int)meshFiles.size(), totalBytes / 1048576.0,
+                 (int)(1000 * sw.read()), nReaders);
     }
-    std::cout << "Loaded " << faces.size() << " faces" << std::endl;
+}
+
+int Scene::MaterialTable::add(const Material &material)
+{
+    auto found = indices.emplace(material, materials->size());
+    if(found.second) {
+        materials->push_back(material);
+    }
+    return found.first->second;
+}
+
+Mesh *Scene::createMesh(ObjMeshData &&data, const Affine3f &transform, MaterialTable *materials, const BVHBuildSettings &bvhSettings)
+{
+    // Map this file's materials into the scene's table; faces without one get a default material
+    std::vector<int> sceneIds(data.materials.size());
+    for(size_t i = 0; i < data.materials.size(); ++i) {
+        sceneIds[i] = materials->add(data.materials[i]);
+    }
+    int defaultMaterial = -1;
+    for(int &materialId : data.materialIds) {
+        if(materialId < 0) {
+            if(defaultMaterial < 0) {
+                defaultMaterial = materials->add(Material());
+            }
+            materialId = defaultMaterial;
+        } else {
+            materialId = sceneIds[materialId];
+        }
+    }
+    std::cout << "Loaded " << data.faces.size() << " faces, " << data.vertices.size() << " vertices" << std::endl;
 
     Mesh *m = new Mesh;
-    m->init(vertices,
-            normals,
-            uvs,
-            colors,
-            faces,
-            materialIds,
-            materials);
+    m->init(std::move(data.vertices),
+            std::move(data.normals),
+            std::move(data.uvs),
+            std::move(data.colors),
+            std::move(data.faces),
+            std::move(data.materialIds),
+            bvhSettings);
     m->setTransform(transform);
     return m;
 }
@@ -267,6 +731,51 @@ const std::vector<SceneLightData> &Scene::getLights()
 }
 
 bool Scene::getIntersection(const Ray& ray, IntersectionInfo* I) const{
-    return getBVH().getIntersection(ray, I, false);
+    bool hit = false;
+    if(m_flatPrims) {
+        // Every leaf holds Triangles, which are tested a whole block at a time
+        hit = getBVH().traverse(ray, I, false, [&](uint32_t start, uint32_t count, IntersectionInfo *closest) {
+            return m_triangleBlocks->intersect(start, count, ray, closest, false);
+        });
+        I->data = I->object;
+    } else if(m_bvh) {
+        hit = getBVH().getIntersection(ray, I, false);
+    }
+    if(!m_instanceBvh) {
+        return hit;
+    }
+
+    // Only instances closer than the hit so far are worth looking into
+    IntersectionInfo instanceHit;
+    const std::vector<Object *> &instances = m_instanceBvh->getPrimitives();
+    bool instanceFound = m_instanceBvh->traverse(ray, &instanceHit, false, [&](uint32_t start, uint32_t count, IntersectionInfo *closest) {
+        bool found = false;
+        for(uint32_t o = 0; o < count; ++o) {
+            IntersectionInfo current;
+            if(instances[start + o]->getIntersection(ray, &current) && current.t < closest->t) {
+                *closest = current;
+                found = true;
+            }
+        }
+        return found;
+    }, hit ? I->t : 999999999.f);
+    if(instanceFound) {
+        *I = instanceHit;
+    }
+    return hit || instanceFound;
 }
 
+bool Scene::occluded(const Ray& ray, float tmax) const{
+    if(m_flatPrims) {
+        IntersectionInfo I;
+        bool blocked = getBVH().traverse(ray, &I, true, [&](uint32_t start, uint32_t count, IntersectionInfo *closest) {
+            return m_triangleBlocks->intersect(start, count, ray, closest, true);
+        }, tmax);
+        if(blocked) {
+            return true;
+        }
+    } else if(m_bvh && getBVH().occluded(ray, tmax)) {
+        return true;
+    }
+    return m_instanceBvh && m_instanceBvh->occluded(ray, tmax);
+}
@@ -1,6 +1,7 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <QFile>
 #include <QString>
 
 #include "BVH/BVH.h"
@@ -10,8 +11,18 @@
 #include "util/SceneData.h"
 
 #include "shape/mesh.h"
+#include "shape/meshinstance.h"
+#include "shape/triangleblocks.h"
+
+#include "material.h"
+#include "lightsampler.h"
+#include "objloader.h"
 
 #include <memory>
+#include <set>
+#include <unordered_map>
+
+struct SceneCacheHeader;
 
 class Scene
 {
@@ -19,9 +30,17 @@ public:
     Scene();
     virtual ~Scene();
 
-    static bool load(QString filename, Scene **scenePointer, float imageWidth, float imageHeight);
+    // With a cacheDir, the meshes and BVHs are read from a scene cache there if one matches the
+    // scene and its files, and a new one is written there if not. The .obj files of the meshes
+    // are read at the same time, each with objLoader.
+    static bool load(QString filename, Scene **scenePointer, float imageWidth, float imageHeight,
+                     const BVHBuildSettings &bvhSettings = BVHBuildSettings(), const QString &cacheDir = QString(),
+                     ObjLoaderType objLoader = ObjLoaderType::Parallel);
+
+    // Hash of the scene file at filename and every file it uses, which tells renders of an
+    // edited scene apart. Reads them all in full; false if the scene file can't be parsed.
+    static bool sourceKey(QString filename, uint64_t *key);
 
-    void setBVH(const BVH &bvh);
     const BVH& getBVH() const;
 
     const BasicCamera& getCamera() const;
@@ -34,25 +53,75 @@ public:
 
     bool getIntersection(const Ray& ray, IntersectionInfo* I) const;
 
+    // Whether anything blocks the ray before tmax; stops at the first blocker found
+    bool occluded(const Ray& ray, float tmax) const;
+
+    const Material& getMaterial(uint32_t index) const { return m_materials[index]; }
+    const Material& getMaterial(const Triangle *triangle) const { return m_materials[triangle->getMaterialIndex()]; }
+
     // returns all triangles in the scene whose material has non-zero emission
     const std::vector<Triangle*>& getEmissives() const { return m_emissives; };
 
+    // samples points on the emissive triangles for direct lighting
+    const LightSampler& getLightSampler() const { return m_lightSampler; }
+
 private:
 
     BVH *m_bvh;
     std::vector<Object *> *_objects;
+    // The triangles of every mesh, if m_bvh was built over them directly. Null for a BVH of meshes.
+    std::vector<Object *> *m_flatPrims;
+    // The leaves of a flat m_bvh packed for SIMD triangle tests. Null for a BVH of meshes.
+    TriangleBlocks *m_triangleBlocks;
+
+    // Meshes placed more than once, each kept once in the space of its .obj file, and a
+    // MeshInstance for every placement with a top level BVH over them. The other meshes are
+    // in _objects, in world space; m_bvh is null if there are none.
+    std::vector<Mesh *> m_instancedMeshes;
+    std::vector<Object *> *m_instances;
+    BVH *m_instanceBvh;
 
     BasicCamera m_camera;
 
+    // The materials of every mesh; triangles refer to them by index
+    std::vector<Material> m_materials;
+
     SceneGlobalData m_globalData;
     std::vector<Triangle*> m_emissives;
+    LightSampler m_lightSampler;
 
     std::vector<SceneLightData> m_lights;
 
-    static bool parseTree(SceneNode *root, Scene *scene, const std::string& baseDir);
-    static void parseNode(SceneNode *node, const Eigen::Affine3f &parentTransform, std::vector<Object *> *objects, const std::string& baseDir);
-    static void addPrimitive(ScenePrimitive *prim, const Eigen::Affine3f &transform, std::vector<Object *> *objects, const std::string& baseDir);
-    static Mesh *loadMesh(std::string filePath, const Eigen::Affine3f &transform, const std::string& baseDir);
+    // The mapped scene cache the meshes and BVH read from, if the scene was loaded from one
+    std::unique_ptr<QFile> m_cacheFile;
+
+    // Sets up light sampling over m_emissives, takes over the meshes and the scene BVH, which is
+    // over flatPrims if it is flat, and builds the top level BVH over the instances
+    void finishLoading(std::vector<Object *> *objects, std::vector<Object *> *flatPrims, BVH *bvh,
+                       std::vector<Mesh *> &&instancedMeshes, std::vector<Object *> *instances, const BVHBuildSettings &bvhSettings);
+    bool loadCache(std::unique_ptr<QFile> file, const SceneCacheHeader &header, const BVHBuildSettings &bvhSettings);
+    bool writeCache(const std::string &path, uint64_t key) const;
+
+    // A mesh primitive of the scene file: the absolute path of its .obj and the transform of its node
+    struct MeshFile {
+        std::string path;
+        Eigen::Affine3f transform;
+    };
+
+    // The scene's material table while meshes are added to it; identical materials, from one
+    // file or several, are stored once
+    struct MaterialTable {
+        std::vector<Material> *materials;
+        std::unordered_map<Material, int, MaterialHash> indices;
+        int add(const Material &material);
+    };
+
+    static void collectMeshFiles(SceneNode *node, const std::string &baseDir, std::set<std::string> *meshFiles);
+    static bool parseTree(SceneNode *root, Scene *scene, const std::string& baseDir, const BVHBuildSettings &bvhSettings, ObjLoaderType objLoader);
+    static void parseNode(SceneNode *node, const Eigen::Affine3f &parentTransform, std::vector<MeshFile> *meshFiles, const std::string& baseDir);
+    static void addPrimitive(ScenePrimitive *prim, const Eigen::Affine3f &transform, std::vector<MeshFile> *meshFiles, const std::string& baseDir);
+    static void loadMeshFiles(const std::vector<MeshFile> &meshFiles, ObjLoaderType objLoader, int numThreads, std::vector<ObjMeshData> *meshData);
+    static Mesh *createMesh(ObjMeshData &&data, const Eigen::Affine3f &transform, MaterialTable *materials, const BVHBuildSettings &bvhSettings);
 };
 
 #endif // SCENE_H
@@ -0,0 +1,199 @@
+#include "scenecache.h"
+
+#include "material.h"
+
+#include "BVH/Log.h"
+
+#include <QFileInfo>
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const char Magic[8] = {'P', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t Version = 3;
+
+uint64_t mix(uint64_t hash, uint64_t word)
+{
+    hash ^= word * 0x9e3779b97f4a7c15ull;
+    hash = (hash << 27) | (hash >> 37);
+    return hash * 0xff51afd7ed558ccdull;
+}
+
+uint64_t hashBytes(uint64_t hash, const uchar *data, size_t size)
+{
+    // A word at a time, since this reads every byte of the .obj files on each load
+    size_t words = size / 8;
+    for(size_t i = 0; i < words; ++i) {
+        uint64_t word;
+        memcpy(&word, data + 8 * i, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + 8 * words, size - 8 * words);
+    return mix(mix(hash, tail), size);
+}
+
+uint64_t hashString(uint64_t hash, const std::string &s)
+{
+    return hashBytes(hash, reinterpret_cast<const uchar *>(s.data()), s.size());
+}
+
+// Hashes the file's path and contents, or only its path if it can't be read. If mtllibs is
+// given, the .mtl files named by the file's mtllib lines are added to it.
+uint64_t hashFile(uint64_t hash, const std::string &path, std::vector<std::string> *mtllibs)
+{
+    hash = hashString(hash, path);
+    QFile file(QString::fromStdString(path));
+    if(!file.open(QIODevice::ReadOnly) || file.size() == 0) {
+        return mix(hash, 0);
+    }
+    const uchar *data = file.map(0, file.size());
+    if(!data) {
+        return mix(hash, 0);
+    }
+    size_t size = file.size();
+    hash = hashBytes(hash, data, size);
+
+    if(mtllibs) {
+        std::string dir = QFileInfo(QString::fromStdString(path)).absolutePath().toStdString() + "/";
+        const char *text = reinterpret_cast<const char *>(data);
+        for(size_t line = 0; line < size; ) {
+            size_t end = line;
+            while(end < size && text[end] != '\n') {
+                ++end;
+            }
+            if(end - line > 7 && strncmp(text + line, "mtllib", 6) == 0 && (text[line + 6] == ' ' || text[line + 6] == '\t')) {
+                // tinyobj takes every whitespace separated name on the line
+                size_t name = line + 7;
+                while(name < end) {
+                    while(name < end && isspace((unsigned char)text[name])) {
+                        ++name;
+                    }
+                    size_t nameEnd = name;
+                    while(nameEnd < end && !isspace((unsigned char)text[nameEnd])) {
+                        ++nameEnd;
+                    }
+                    if(nameEnd > name) {
+                        mtllibs->push_back(dir + std::string(text + name, nameEnd - name));
+                    }
+                    name = nameEnd;
+                }
+            }
+            line = end + 1;
+        }
+    }
+    return hash;
+}
+
+uint64_t hashSources(uint64_t hash, const std::string &sceneFile, const std::set<std::string> &meshFiles)
+{
+    hash = hashFile(hash, sceneFile, nullptr);
+    std::vector<std::string> mtllibs;
+    for(const std::string &meshFile : meshFiles) {
+        hash = hashFile(hash, meshFile, &mtllibs);
+    }
+    // Files often share one .mtl
+    std::sort(mtllibs.begin(), mtllibs.end());
+    mtllibs.erase(std::unique(mtllibs.begin(), mtllibs.end()), mtllibs.end());
+    for(const std::string &mtllib : mtllibs) {
+        hash = hashFile(hash, mtllib, nullptr);
+    }
+    return hash;
+}
+
+}
+
+uint64_t SceneCache::key(const std::string &sceneFile, const std::set<std::string> &meshFiles, const BVHBuildSettings &settings)
+{
+    uint64_t hash = mix(0, Version);
+    // Layouts the file is read with in place
+    hash = mix(hash, sizeof(BVHFlatNode));
+    hash = mix(hash, sizeof(Material));
+    hash = mix(hash, sizeof(Eigen::Vector3f));
+
+    // Settings that change the trees. Not numThreads: a parallel build orders the leaves
+    // differently, but is as good a tree. Not width: wide trees are collapsed at load.
+    hash = mix(hash, (uint64_t)settings.splitMethod);
+    hash = mix(hash, settings.leafSize);
+    hash = mix(hash, settings.maxLeafSize);
+    hash = mix(hash, settings.sahBins);
+    uint32_t traversalCost;
+    memcpy(&traversalCost, &settings.traversalCost, sizeof(traversalCost));
+    hash = mix(hash, traversalCost);
+    hash = mix(hash, settings.flattenScene);
+
+    return hashSources(hash, sceneFile, meshFiles);
+}
+
+uint64_t SceneCache::sourceKey(const std::string &sceneFile, const std::set<std::string> &meshFiles)
+{
+    return hashSources(0, sceneFile, meshFiles);
+}
+
+std::string SceneCache::path(const std::string &dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.scenecache", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+std::unique_ptr<QFile> SceneCache::open(const std::string &path, uint64_t key, const SceneCacheHeader **header)
+{
+    std::unique_ptr<QFile> file(new QFile(QString::fromStdString(path)));
+    if(!file->exists() || !file->open(QIODevice::ReadOnly) || file->size() < (qint64)sizeof(SceneCacheHeader)) {
+        return nullptr;
+    }
+    const uchar *data = file->map(0, file->size());
+    if(!data) {
+        LOG_ERROR("Could not map scene cache %s", path.c_str());
+        return nullptr;
+    }
+    const SceneCacheHeader *h = reinterpret_cast<const SceneCacheHeader *>(data);
+    if(memcmp(h->magic, Magic, sizeof(Magic)) != 0 || h->version != Version || h->key != key) {
+        LOG_ERROR("Scene cache %s is from another version or scene, ignoring it", path.c_str());
+        return nullptr;
+    }
+    *header = h;
+    return file;
+}
+
+SceneCacheWriter::SceneCacheWriter(const std::string &path)
+    : m_path(path), m_file(path + ".tmp", std::ios::binary | std::ios::trunc)
+{
+    // room for the header, written last
+    SceneCacheHeader header = {};
+    m_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void SceneCacheWriter::pad()
+{
+    static const char zeros[SceneCache::CacheAlignment] = {};
+    uint64_t offset = m_file.tellp();
+    m_file.write(zeros, (SceneCache::CacheAlignment - offset % SceneCache::CacheAlignment) % SceneCache::CacheAlignment);
+}
+
+bool SceneCacheWriter::finish(SceneCacheHeader header)
+{
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    m_file.seekp(0);
+    m_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    m_file.close();
+    std::string tempPath = m_path + ".tmp";
+    if(!m_file) {
+        LOG_ERROR("Could not write scene cache %s", tempPath.c_str());
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    if(std::rename(tempPath.c_str(), m_path.c_str()) != 0) {
+        LOG_ERROR("Could not move scene cache to %s", m_path.c_str());
+        return false;
+    }
+    return true;
+}
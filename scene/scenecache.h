@@ -0,0 +1,109 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <QFile>
+
+#include "BVH/BVH.h"
+
+#include <fstream>
+#include <memory>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A scene's meshes, materials, emitters and BVHs in one binary file, mapped and used in place
+// the next time the scene is loaded instead of parsing the .obj files and building the BVHs.
+// Files are named by a hash of the scene file, every .obj and .mtl it uses and the BVH build
+// settings, so changing any of them misses the cache. All offsets are from the start of the
+// file and every array starts on a CacheAlignment boundary.
+
+// One BVH: its nodes in preorder, and the index of the primitive in each slot of the leaf ranges
+struct SceneCacheBVH {
+    uint64_t nodeOffset, orderOffset;
+    uint32_t nodeCount, primCount;
+};
+
+struct SceneCacheMesh {
+    float transform[16]; // column major
+    uint64_t vertexOffset, normalOffset, colorOffset, uvOffset, faceOffset, materialOffset;
+    int32_t vertexCount, faceCount;
+    SceneCacheBVH bvh; // over the faces; empty with a flat scene BVH
+};
+
+// One placement of an instanced mesh
+struct SceneCacheInstance {
+    float transform[16]; // column major
+    uint32_t mesh;
+    uint32_t reserved;
+};
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flattened; // the scene BVH is over every triangle, by its index in mesh order, or over the meshes
+    uint64_t key;
+    uint32_t materialCount, meshCount, emissiveCount, reserved;
+    uint64_t materialOffset, meshOffset, emissiveOffset; // emissives are triangle indices in mesh order
+    SceneCacheBVH sceneBVH; // empty if every mesh is instanced
+    // The last instancedMeshCount meshes are in the space of their files, always have a BVH and
+    // are only placed by the instances; the scene BVH is over the others
+    uint32_t instancedMeshCount, instanceCount;
+    uint64_t instanceOffset;
+};
+
+namespace SceneCache {
+
+const size_t CacheAlignment = 64;
+
+// Hash of everything the cached data is made from. Reads every file in full.
+uint64_t key(const std::string &sceneFile, const std::set<std::string> &meshFiles, const BVHBuildSettings &settings);
+
+// Hash of the scene file and the .obj and .mtl files it uses, paths and contents, alone
+uint64_t sourceKey(const std::string &sceneFile, const std::set<std::string> &meshFiles);
+
+std::string path(const std::string &dir, uint64_t key);
+
+// Maps the cache file and checks its header. Null if there is none or it is from another
+// version or key; the mapping lives as long as the returned file.
+std::unique_ptr<QFile> open(const std::string &path, uint64_t key, const SceneCacheHeader **header);
+
+// The count Ts at offset in the mapped file, or null if they don't lie inside it
+template<typename T>
+const T *array(const uchar *data, uint64_t size, uint64_t offset, uint64_t count)
+{
+    if(offset % alignof(T) != 0 || offset > size || count > (size - offset) / sizeof(T)) {
+        return nullptr;
+    }
+    return reinterpret_cast<const T *>(data + offset);
+}
+
+}
+
+// Appends the arrays of a new cache file to a temporary file next to it, which finish()
+// moves into place once the header is written, so a half written cache is never mapped
+class SceneCacheWriter
+{
+public:
+    explicit SceneCacheWriter(const std::string &path);
+
+    // Returns the offset of the array
+    template<typename T>
+    uint64_t append(const T *data, size_t count)
+    {
+        pad();
+        uint64_t offset = m_file.tellp();
+        m_file.write(reinterpret_cast<const char *>(data), count * sizeof(T));
+        return offset;
+    }
+
+    bool finish(SceneCacheHeader header);
+
+private:
+    std::string m_path;
+    std::ofstream m_file;
+
+    void pad();
+};
+
+#endif // SCENECACHE_H
@@ -6,23 +6,48 @@
 using namespace Eigen;
 using namespace std;
 
-void Mesh::init(const std::vector<Vector3f> &vertices,
-           const std::vector<Vector3f> &normals,
-           const std::vector<Vector2f> &uvs,
-           const std::vector<Vector3f> &colors,
-           const std::vector<Vector3i> &faces,
-           const std::vector<int> &materialIds,
-           const std::vector<tinyobj::material_t> &materials)
-{
-    _vertices = vertices;
-    _normals = normals;
-    _colors = colors;
-    _uvs = uvs;
-    _faces = faces;
-    _materialIds = materialIds;
-    _materials = materials;
+void Mesh::init(std::vector<Vector3f> &&vertices,
+           std::vector<Vector3f> &&normals,
+           std::vector<Vector2f> &&uvs,
+           std::vector<Vector3f> &&colors,
+           std::vector<Vector3i> &&faces,
+           std::vector<int> &&materialIds,
+           const BVHBuildSettings &bvhSettings)
+{
+    _vertices = std::move(vertices);
+    _normals = std::move(normals);
+    _colors = std::move(colors);
+    _uvs = std::move(uvs);
+    _faces = std::move(faces);
+    _materialIds = std::move(materialIds);
+    // These live as long as the scene, so drop the slack left from growing them
+    _vertices.shrink_to_fit();
+    _normals.shrink_to_fit();
+    _colors.shrink_to_fit();
+    _uvs.shrink_to_fit();
+    _arrays = {_vertices.data(), _normals.data(), _colors.data(), _uvs.data(), _faces.data(), _materialIds.data(),
+               (int)_vertices.size(), (int)_faces.size()};
     calculateMeshStats();
-    createMeshBVH();
+    createTriangles();
+    createMeshBVH(bvhSettings);
+}
+
+void Mesh::init(const MeshArrays &arrays, const BVHFlatNode *bvhNodes, uint32_t bvhNodeCount, const uint32_t *bvhOrder,
+                const BVHBuildSettings &bvhSettings)
+{
+    _arrays = arrays;
+    calculateMeshStats();
+    createTriangles();
+    if(bvhSettings.flattenScene || !bvhNodes) {
+        _objects = nullptr;
+        _meshBvh = nullptr;
+        return;
+    }
+    _objects = new std::vector<Object *>(_arrays.faceCount);
+    for(int i = 0; i < _arrays.faceCount; ++i) {
+        (*_objects)[i] = &_triangles[bvhOrder[i]];
+    }
+    _meshBvh = new BVH(_objects, bvhNodes, bvhNodeCount, bvhSettings);
 }
 
 Mesh::~Mesh()
@@ -34,10 +59,15 @@ Mesh::~Mesh()
 
 bool Mesh::getIntersection(const Ray &ray, IntersectionInfo *intersection) const
 {
+    if(!_meshBvh) {
+        return false;
+    }
     IntersectionInfo i;
     bool col = _meshBvh->getIntersection(ray, &i, false);
     if(col) {
         intersection->t = i.t;
+        intersection->u = i.u;
+        intersection->v = i.v;
         intersection->object = this;
         intersection->data = i.object;
 
@@ -46,6 +76,11 @@ bool Mesh::getIntersection(const Ray &ray, IntersectionInfo *intersection) const
     return false;
 }
 
+bool Mesh::occluded(const Ray &ray, float tmax) const
+{
+    return _meshBvh && _meshBvh->occluded(ray, tmax);
+}
+
 Vector3f Mesh::getNormal(const IntersectionInfo &I) const
 {
     return static_cast<const Object *>(I.data)->getNormal(I);
@@ -63,39 +98,24 @@ Vector3f Mesh::getCentroid() const
     return _centroid;
 }
 
-const Vector3i Mesh::getTriangleIndices(int faceIndex) const
-{
-    return _faces[faceIndex];
-}
-
-const tinyobj::material_t &Mesh::getMaterial(int faceIndex) const
+int Mesh::getMaterialIndex(int faceIndex) const
 {
-    return _materials[_materialIds[faceIndex]];
-}
-
-const Vector3f Mesh::getVertex(int vertexIndex) const
-{
-    return _vertices[vertexIndex];
-}
-
-const Vector3f Mesh::getNormal(int vertexIndex) const
-{
-    return _normals[vertexIndex];
+    return _arrays.materialIds[faceIndex];
 }
 
 const Vector3f Mesh::getColor(int vertexIndex) const
 {
-    return _colors[vertexIndex];
+    return _arrays.colors[vertexIndex];
 }
 
 const Vector2f Mesh::getUV(int vertexIndex) const
 {
-    return _uvs[vertexIndex];
+    return _arrays.uvs[vertexIndex];
 }
 
 void Mesh::setTransform(Affine3f transform)
 {
-    Object::setTransform(transform);
+    TransformedObject::setTransform(transform);
     transformed_bbox = BBox();
     Vector3f min = _bbox.min;
     transformed_bbox.setP(transform * min);
@@ -104,32 +124,45 @@ void Mesh::setTransform(Affine3f transform)
 
 void Mesh::calculateMeshStats()
 {
-    _bbox.setP(_vertices[0]);
-    for(auto v : _vertices) {
-        _centroid += v;
-        _bbox.expandToInclude(v);
+    _centroid = Vector3f::Zero();
+    _bbox.setP(_arrays.vertices[0]);
+    for(int i = 0; i < _arrays.vertexCount; ++i) {
+        _centroid += _arrays.vertices[i];
+        _bbox.expandToInclude(_arrays.vertices[i]);
     }
     transformed_bbox = _bbox;
-    _centroid /= _vertices.size();
+    _centroid /= _arrays.vertexCount;
 }
 
-void Mesh::createMeshBVH()
+void Mesh::createTriangles()
 {
-    _triangles = new Triangle[_faces.size()];
+    _triangles = new Triangle[_arrays.faceCount];
+    for(int i = 0; i < _arrays.faceCount; ++i) {
+        _triangles[i] = Triangle(this, i, getMaterialIndex(i));
+    }
+}
+
+void Mesh::createMeshBVH(const BVHBuildSettings &bvhSettings)
+{
+    // A flattened scene BVH intersects the triangles directly, so the mesh doesn't need its own
+    if(bvhSettings.flattenScene) {
+        _objects = nullptr;
+        _meshBvh = nullptr;
+        return;
+    }
     _objects = new std::vector<Object *>;
     _objects->resize(_faces.size());
     for(unsigned int i = 0; i < _faces.size(); ++i) {
-        Vector3i face = _faces[i];
-        Vector3f v1 = _vertices[face(0)];
-        Vector3f v2 = _vertices[face(1)];
-        Vector3f v3 = _vertices[face(2)];
-        Vector3f n1 = _normals[face[0]];
-        Vector3f n2 = _normals[face[1]];
-        Vector3f n3 = _normals[face[2]];
-        _triangles[i] = Triangle(v1, v2, v3, n1, n2, n3, i);
-        _triangles[i].setMaterial(getMaterial(i));
         (*_objects)[i] = &_triangles[i];
     }
+    _meshBvh = new BVH(_objects, bvhSettings);
+}
 
-    _meshBvh = new BVH(_objects);
+size_t Mesh::getMemoryBytes() const
+{
+    // Arrays read in place from a scene cache count too; they are paged in all the same
+    return _arrays.vertexCount * (3 * sizeof(Vector3f) + sizeof(Vector2f))
+            + _arrays.faceCount * (sizeof(Vector3i) + sizeof(int))
+            + _arrays.faceCount * sizeof(Triangle)
+            + (_objects ? _objects->capacity() * sizeof(Object *) : 0);
 }
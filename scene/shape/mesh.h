@@ -18,20 +18,37 @@ EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix2f)
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix3f)
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(Eigen::Matrix3i)
 
-class Mesh : public Object
+// The vertex and face arrays of a mesh, read in place rather than owned (from a mapped scene cache)
+struct MeshArrays {
+    const Eigen::Vector3f *vertices;
+    const Eigen::Vector3f *normals;
+    const Eigen::Vector3f *colors;
+    const Eigen::Vector2f *uvs;
+    const Eigen::Vector3i *faces;
+    const int *materialIds;
+    int vertexCount, faceCount;
+};
+
+class Mesh : public TransformedObject
 {
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
     virtual ~Mesh();
-    void init(const std::vector<Eigen::Vector3f> &vertices,
-         const std::vector<Eigen::Vector3f> &normals,
-         const std::vector<Eigen::Vector2f> &uvs,
-         const std::vector<Eigen::Vector3f> &colors,
-         const std::vector<Eigen::Vector3i> &faces,
-         const std::vector<int> &materialIds,
-         const std::vector<tinyobj::material_t> &materials);
+    // Takes over the arrays. Vertices, normals, uvs and colors are indexed by faces.
+    void init(std::vector<Eigen::Vector3f> &&vertices,
+         std::vector<Eigen::Vector3f> &&normals,
+         std::vector<Eigen::Vector2f> &&uvs,
+         std::vector<Eigen::Vector3f> &&colors,
+         std::vector<Eigen::Vector3i> &&faces,
+         std::vector<int> &&materialIds,
+         const BVHBuildSettings &bvhSettings = BVHBuildSettings());
+    // Reads the arrays in place, so they must outlive the mesh. With a flat scene BVH there is no
+    // mesh BVH; otherwise bvhNodes is the mesh BVH as built before, over the faces in bvhOrder.
+    void init(const MeshArrays &arrays, const BVHFlatNode *bvhNodes, uint32_t bvhNodeCount, const uint32_t *bvhOrder,
+              const BVHBuildSettings &bvhSettings = BVHBuildSettings());
 
     bool getIntersection(const Ray &ray, IntersectionInfo *intersection) const override;
+    bool occluded(const Ray &ray, float tmax) const override;
 
     Eigen::Vector3f getNormal(const IntersectionInfo &I) const override;
 
@@ -39,18 +56,28 @@ public:
 
     Eigen::Vector3f getCentroid() const override;
 
-    const Eigen::Vector3i getTriangleIndices(int faceIndex) const;
-    const tinyobj::material_t& getMaterial(int faceIndex) const;
+    // Inline, since triangles go through these for their vertices on every test
+    const Eigen::Vector3i getTriangleIndices(int faceIndex) const { return _arrays.faces[faceIndex]; }
+    // Index of the face's material in the scene's material table
+    int getMaterialIndex(int faceIndex) const;
 
-    const Eigen::Vector3f getVertex(int vertexIndex) const;
-    const Eigen::Vector3f getNormal(int vertexIndex) const;
+    const Eigen::Vector3f getVertex(int vertexIndex) const { return _arrays.vertices[vertexIndex]; }
+    const Eigen::Vector3f getNormal(int vertexIndex) const { return _arrays.normals[vertexIndex]; }
     const Eigen::Vector3f getColor(int vertexIndex) const;
     const Eigen::Vector2f getUV(int vertexIndex) const;
 
     virtual void setTransform(Eigen::Affine3f transform) override;
 
-    int getTriangleCount() { return _faces.size(); }
+    int getTriangleCount() const { return _arrays.faceCount; }
     Triangle* getTriangles() { return _triangles; }
+    const Triangle* getTriangles() const { return _triangles; }
+
+    const MeshArrays &getArrays() const { return _arrays; }
+    // Null with a flat scene BVH
+    const BVH *getBVH() const { return _meshBvh; }
+
+    // Bytes held by the mesh's vertex data, faces and triangles (not its BVH)
+    size_t getMemoryBytes() const;
 
 private:
     // Properties from the scene file
@@ -63,7 +90,8 @@ private:
     std::vector<Eigen::Vector2f> _uvs;
     std::vector<Eigen::Vector3i> _faces;
     std::vector<int> _materialIds;
-    std::vector<tinyobj::material_t> _materials;
+    // What the accessors read: the vectors above, or arrays the mesh doesn't own
+    MeshArrays _arrays;
 
     BVH *_meshBvh;
 
@@ -76,7 +104,8 @@ private:
     Triangle *_triangles;
 
     void calculateMeshStats();
-    void createMeshBVH();
+    void createTriangles();
+    void createMeshBVH(const BVHBuildSettings &bvhSettings);
 };
 
 #endif // MESH_H
@@ -0,0 +1,60 @@
+#include "meshinstance.h"
+
+using namespace Eigen;
+
+MeshInstance::MeshInstance(const Mesh *mesh, const Affine3f &transform)
+    : m_mesh(mesh)
+{
+    setTransform(transform);
+}
+
+Ray MeshInstance::toMesh(const Ray &ray, float *scale) const
+{
+    // Ray normalizes its direction, so distances along the mesh space ray are scaled by the
+    // length the transform gives the world space direction
+    Vector3f d = inverseTransform.linear() * ray.d;
+    *scale = d.norm();
+    return Ray(inverseTransform * ray.o, d);
+}
+
+bool MeshInstance::getIntersection(const Ray &ray, IntersectionInfo *intersection) const
+{
+    float scale;
+    IntersectionInfo i;
+    if(!m_mesh->getBVH()->getIntersection(toMesh(ray, &scale), &i, false)) {
+        return false;
+    }
+    intersection->t = i.t / scale;
+    intersection->u = i.u;
+    intersection->v = i.v;
+    intersection->object = this;
+    intersection->data = i.object;
+    return true;
+}
+
+bool MeshInstance::occluded(const Ray &ray, float tmax) const
+{
+    float scale;
+    Ray meshRay = toMesh(ray, &scale);
+    return m_mesh->getBVH()->occluded(meshRay, tmax * scale);
+}
+
+Vector3f MeshInstance::getNormal(const IntersectionInfo &I) const
+{
+    Vector3f n = static_cast<const Object *>(I.data)->getNormal(I);
+    return (inverseNormalTransform.linear() * n).normalized();
+}
+
+void MeshInstance::setTransform(Affine3f transform)
+{
+    TransformedObject::setTransform(transform);
+    const BBox &bounds = m_mesh->getBBox();
+    m_bbox.setP(transform * bounds.min);
+    for(int corner = 1; corner < 8; ++corner) {
+        Vector3f p((corner & 1) ? bounds.max.x() : bounds.min.x(),
+                   (corner & 2) ? bounds.max.y() : bounds.min.y(),
+                   (corner & 4) ? bounds.max.z() : bounds.min.z());
+        m_bbox.expandToInclude(transform * p);
+    }
+    m_centroid = transform * m_mesh->getCentroid();
+}
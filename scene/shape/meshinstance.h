@@ -0,0 +1,43 @@
+#ifndef MESHINSTANCE_H
+#define MESHINSTANCE_H
+
+#include <BVH/Object.h>
+
+#include "mesh.h"
+
+// One placement of a mesh that the scene uses more than once. The mesh and its BVH are kept
+// once, in the space of its .obj file; an instance only holds its transform, and intersects
+// by moving the ray into that space. Hits report the instance as the object and the mesh's
+// triangle as the data, so getNormal() can bring the normal back into world space.
+class MeshInstance : public TransformedObject
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    // The mesh must have a BVH of its own
+    MeshInstance(const Mesh *mesh, const Eigen::Affine3f &transform);
+
+    bool getIntersection(const Ray &ray, IntersectionInfo *intersection) const override;
+    bool occluded(const Ray &ray, float tmax) const override;
+
+    Eigen::Vector3f getNormal(const IntersectionInfo &I) const override;
+
+    BBox getBBox() const override { return m_bbox; }
+
+    Eigen::Vector3f getCentroid() const override { return m_centroid; }
+
+    void setTransform(Eigen::Affine3f transform) override;
+
+    const Mesh *getMesh() const { return m_mesh; }
+
+private:
+    const Mesh *m_mesh;
+
+    // World space bounds and centroid
+    BBox m_bbox;
+    Eigen::Vector3f m_centroid;
+
+    // The ray in mesh space, and the factor from world to mesh space distances along it
+    Ray toMesh(const Ray &ray, float *scale) const;
+};
+
+#endif // MESHINSTANCE_H
@@ -1,29 +1,33 @@
 #include "triangle.h"
 
+#include "mesh.h"
+
 #include "util/Common.h"
 
 using namespace Eigen;
 
 Triangle::Triangle()
+    : m_mesh(nullptr), m_index(0), m_materialIndex(0)
 {
 }
 
-Triangle::Triangle(Vector3f v1, Vector3f v2, Vector3f v3, Vector3f n1, Vector3f n2, Vector3f n3, int index)
-    : _v1(v1), _v2(v2), _v3(v3), _n1(n1), _n2(n2), _n3(n3), m_index(index)
+Triangle::Triangle(const Mesh *mesh, int index, uint32_t materialIndex)
+    : m_mesh(mesh), m_index(index), m_materialIndex(materialIndex)
 {
-    _centroid = (_v1 + _v2 + _v3) / 3.f;
-    _bbox.setP(_v1);
-    _bbox.expandToInclude(_v2);
-    _bbox.expandToInclude(_v3);
 }
 
 bool Triangle::getIntersection(const Ray &ray, IntersectionInfo *intersection) const
 {
     //https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    const Vector3f p1 = m_mesh->getVertex(face[0]);
+    const Vector3f p2 = m_mesh->getVertex(face[1]);
+    const Vector3f p3 = m_mesh->getVertex(face[2]);
+
     Vector3f edge1, edge2, h, s, q;
     float a, f, u, v;
-    edge1 = _v2 - _v1;
-    edge2 = _v3 - _v1;
+    edge1 = p2 - p1;
+    edge2 = p3 - p1;
 
     h = ray.d.cross(edge2);
     a = edge1.dot(h);
@@ -32,7 +36,7 @@ bool Triangle::getIntersection(const Ray &ray, IntersectionInfo *intersection) c
         return false;
     }
     f = 1/a;
-    s = ray.o - _v1;
+    s = ray.o - p1;
     u = f * s.dot(h);
     if(u < 0.f || u > 1.f) {
         return false;
@@ -45,6 +49,8 @@ bool Triangle::getIntersection(const Ray &ray, IntersectionInfo *intersection) c
     float t = f * edge2.dot(q);
     if(t > FLOAT_EPSILON) {
         intersection->t = t;
+        intersection->u = u;
+        intersection->v = v;
         intersection->object = this;
         return true;
     } else {
@@ -55,15 +61,31 @@ bool Triangle::getIntersection(const Ray &ray, IntersectionInfo *intersection) c
 
 Vector3f Triangle::getNormal(const IntersectionInfo &I) const
 {
-    //Calculate Barycentric coordinates to get interpolated normal
-    Vector3f p = I.hit;
-    return getNormal(p);
+    //Interpolate with the barycentric coordinates the intersection test already found
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    const Vector3f p1 = m_mesh->getVertex(face[0]);
+    const Vector3f vn1 = m_mesh->getNormal(face[0]);
+    const Vector3f vn2 = m_mesh->getNormal(face[1]);
+    const Vector3f vn3 = m_mesh->getNormal(face[2]);
+    Vector3f n = (m_mesh->getVertex(face[1]) - p1).cross(m_mesh->getVertex(face[2]) - p1);
+    //If normals weren't loaded from file, calculate them instead (This will be flat shading, not smooth shading)
+    Vector3f n1 = floatEpsEqual(vn1.squaredNorm(), 0) ? n : vn1;
+    Vector3f n2 = floatEpsEqual(vn2.squaredNorm(), 0) ? n : vn2;
+    Vector3f n3 = floatEpsEqual(vn3.squaredNorm(), 0) ? n : vn3;
+    return ((1.f - I.u - I.v) * n1 + I.u * n2 + I.v * n3).normalized();
 }
 
 Vector3f Triangle::getNormal(const Vector3f &p) const{
-    Vector3f v0 = _v2 - _v1;
-    Vector3f v1 = _v3 - _v1;
-    Vector3f v2 = p - _v1;
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    const Vector3f p1 = m_mesh->getVertex(face[0]);
+    const Vector3f p2 = m_mesh->getVertex(face[1]);
+    const Vector3f p3 = m_mesh->getVertex(face[2]);
+    const Vector3f vn1 = m_mesh->getNormal(face[0]);
+    const Vector3f vn2 = m_mesh->getNormal(face[1]);
+    const Vector3f vn3 = m_mesh->getNormal(face[2]);
+    Vector3f v0 = p2 - p1;
+    Vector3f v1 = p3 - p1;
+    Vector3f v2 = p - p1;
     float d00 = v0.dot(v0);
     float d01 = v0.dot(v1);
     float d11 = v1.dot(v1);
@@ -76,21 +98,27 @@ Vector3f Triangle::getNormal(const Vector3f &p) const{
 
     Vector3f n = v0.cross(v1);
     //If normals weren't loaded from file, calculate them instead (This will be flat shading, not smooth shading)
-    Vector3f n1 = floatEpsEqual(_n1.squaredNorm(), 0) ? n : _n1;
-    Vector3f n2 = floatEpsEqual(_n2.squaredNorm(), 0) ? n : _n2;
-    Vector3f n3 = floatEpsEqual(_n3.squaredNorm(), 0) ? n : _n3;
+    Vector3f n1 = floatEpsEqual(vn1.squaredNorm(), 0) ? n : vn1;
+    Vector3f n2 = floatEpsEqual(vn2.squaredNorm(), 0) ? n : vn2;
+    Vector3f n3 = floatEpsEqual(vn3.squaredNorm(), 0) ? n : vn3;
     Vector3f interpolated_normal = (u * n1 + v * n2 + w * n3).normalized();
     return interpolated_normal;
 }
 
 BBox Triangle::getBBox() const
 {
-    return _bbox;
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    BBox bbox;
+    bbox.setP(m_mesh->getVertex(face[0]));
+    bbox.expandToInclude(m_mesh->getVertex(face[1]));
+    bbox.expandToInclude(m_mesh->getVertex(face[2]));
+    return bbox;
 }
 
 Vector3f Triangle::getCentroid() const
 {
-    return (_v1 + _v2 + _v3) / 3.f;
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    return (m_mesh->getVertex(face[0]) + m_mesh->getVertex(face[1]) + m_mesh->getVertex(face[2])) / 3.f;
 }
 
 int Triangle::getIndex() const
@@ -98,12 +126,14 @@ int Triangle::getIndex() const
     return m_index;
 }
 
-tinyobj::material_t Triangle::getMaterial() const
+Eigen::Vector3<Vector3f> Triangle::getVertices() const
 {
-    return m_material;
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    return Eigen::Vector3<Vector3f>(m_mesh->getVertex(face[0]), m_mesh->getVertex(face[1]), m_mesh->getVertex(face[2]));
 }
 
-void Triangle::setMaterial(const tinyobj::material_t &material)
+Eigen::Vector3<Vector3f> Triangle::getNormals() const
 {
-    m_material = material;
+    const Vector3i face = m_mesh->getTriangleIndices(m_index);
+    return Eigen::Vector3<Vector3f>(m_mesh->getNormal(face[0]), m_mesh->getNormal(face[1]), m_mesh->getNormal(face[2]));
 }
@@ -2,16 +2,16 @@
 #define TRIANGLE_H
 
 #include <BVH/Object.h>
-#include <util/tiny_obj_loader.h>
 
+class Mesh;
+
+// A face of a Mesh. It only refers to the mesh's shared vertex and normal arrays,
+// so its bounds and centroid are computed from them when asked for.
 class Triangle : public Object
 {
 public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
     Triangle();
-    Triangle(Eigen::Vector3f v1, Eigen::Vector3f v2, Eigen::Vector3f v3,
-             Eigen::Vector3f n1, Eigen::Vector3f n2, Eigen::Vector3f n3,
-             int index);
+    Triangle(const Mesh *mesh, int index, uint32_t materialIndex);
 
     bool getIntersection(const Ray &ray, IntersectionInfo *intersection) const override;
 
@@ -23,25 +23,21 @@ public:
     Eigen::Vector3f getCentroid() const override;
 
     int getIndex() const;
+    const Mesh *getMesh() const { return m_mesh; }
 
-    tinyobj::material_t getMaterial() const;
-    void setMaterial(const tinyobj::material_t &material);
+    // Index into the scene's material table (Scene::getMaterial)
+    uint32_t getMaterialIndex() const { return m_materialIndex; }
+    void setMaterialIndex(uint32_t materialIndex) { m_materialIndex = materialIndex; }
 
-    Eigen::Vector3<Eigen::Vector3f> getVertices() { return Eigen::Vector3<Eigen::Vector3f>(_v1, _v2, _v3); }
-    Eigen::Vector3<Eigen::Vector3f> getNormals()  { return Eigen::Vector3<Eigen::Vector3f>(_n1, _n2, _n3); }
+    Eigen::Vector3<Eigen::Vector3f> getVertices() const;
+    Eigen::Vector3<Eigen::Vector3f> getNormals() const;
 
 private:
-    Eigen::Vector3f _v1, _v2, _v3;
-    Eigen::Vector3f _n1, _n2, _n3;
-
-    tinyobj::material_t m_material;
+    const Mesh *m_mesh;
 
     int m_index;
 
-    BBox _bbox;
-
-    Eigen::Vector3f _centroid;
-
+    uint32_t m_materialIndex;
 };
 
 #endif // TRIANGLE_H
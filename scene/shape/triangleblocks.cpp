@@ -0,0 +1,181 @@
+#include "triangleblocks.h"
+
+#include "triangle.h"
+
+#include "util/Common.h"
+
+#include <bit>
+#include <cmath>
+
+using namespace Eigen;
+
+TriangleBlocks::TriangleBlocks(const BVH &bvh)
+{
+    const std::vector<Object *> &prims = bvh.getPrimitives();
+    m_leafFirstBlock.resize(prims.size() + 1);
+
+    bvh.forEachLeaf([&](uint32_t start, uint32_t count) {
+        m_leafFirstBlock[start] = m_blocks.size();
+        for(uint32_t first = 0; first < count; first += TRIANGLE_BLOCK_WIDTH) {
+            TriangleBlock block = {};
+            for(int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; ++lane) {
+                block.prim[lane] = nullptr;
+                if(first + lane >= count) {
+                    continue;
+                }
+                Triangle *tri = static_cast<Triangle *>(prims[start + first + lane]);
+                Eigen::Vector3<Vector3f> v = tri->getVertices();
+                Vector3f e1 = v[1] - v[0];
+                Vector3f e2 = v[2] - v[0];
+                for(int a = 0; a < 3; ++a) {
+                    block.v0[a][lane] = v[0][a];
+                    block.e1[a][lane] = e1[a];
+                    block.e2[a][lane] = e2[a];
+                }
+                block.prim[lane] = tri;
+            }
+            m_blocks.push_back(block);
+        }
+    });
+}
+
+size_t TriangleBlocks::getMemoryBytes() const
+{
+    return m_blocks.size() * sizeof(TriangleBlock) + m_leafFirstBlock.size() * sizeof(uint32_t);
+}
+
+#if defined(__AVX__) || defined(__INTEL_SSE)
+// The same Möller–Trumbore test as Triangle::getIntersection, on every lane at once
+#if defined(__AVX__)
+typedef __m256 lanes;
+#define loadps      _mm256_load_ps
+#define set1ps      _mm256_set1_ps
+#define addps       _mm256_add_ps
+#define subps       _mm256_sub_ps
+#define mulps       _mm256_mul_ps
+#define divps       _mm256_div_ps
+#define andps       _mm256_and_ps
+#define andnotps    _mm256_andnot_ps
+#define storeps     _mm256_storeu_ps
+#define movemaskps  _mm256_movemask_ps
+#define cmpgeps(a, b) _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define cmpleps(a, b) _mm256_cmp_ps((a), (b), _CMP_LE_OQ)
+#define cmpltps(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define cmpgtps(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#else
+typedef __m128 lanes;
+#define loadps      _mm_load_ps
+#define set1ps      _mm_set1_ps
+#define addps       _mm_add_ps
+#define subps       _mm_sub_ps
+#define mulps       _mm_mul_ps
+#define divps       _mm_div_ps
+#define andps       _mm_and_ps
+#define andnotps    _mm_andnot_ps
+#define storeps     _mm_storeu_ps
+#define movemaskps  _mm_movemask_ps
+#define cmpgeps     _mm_cmpge_ps
+#define cmpleps     _mm_cmple_ps
+#define cmpltps     _mm_cmplt_ps
+#define cmpgtps     _mm_cmpgt_ps
+#endif
+
+static inline uint32_t intersectBlock(const TriangleBlock &b, const float o[3], const float d[3], float tmax,
+                                      float t[TRIANGLE_BLOCK_WIDTH], float u[TRIANGLE_BLOCK_WIDTH], float v[TRIANGLE_BLOCK_WIDTH])
+{
+    const lanes dx = set1ps(d[0]), dy = set1ps(d[1]), dz = set1ps(d[2]);
+    const lanes e1x = loadps(b.e1[0]), e1y = loadps(b.e1[1]), e1z = loadps(b.e1[2]);
+    const lanes e2x = loadps(b.e2[0]), e2y = loadps(b.e2[1]), e2z = loadps(b.e2[2]);
+
+    // h = d x e2, a = e1 . h
+    const lanes hx = subps(mulps(dy, e2z), mulps(dz, e2y));
+    const lanes hy = subps(mulps(dz, e2x), mulps(dx, e2z));
+    const lanes hz = subps(mulps(dx, e2y), mulps(dy, e2x));
+    const lanes a = addps(addps(mulps(e1x, hx), mulps(e1y, hy)), mulps(e1z, hz));
+
+    // |a| >= epsilon, otherwise the ray is parallel to the triangle
+    const lanes absa = andnotps(set1ps(-0.f), a);
+    lanes valid = cmpgeps(absa, set1ps(FLOAT_EPSILON));
+    const lanes f = divps(set1ps(1.f), a);
+
+    // s = o - v0, u = f * (s . h)
+    const lanes sx = subps(set1ps(o[0]), loadps(b.v0[0]));
+    const lanes sy = subps(set1ps(o[1]), loadps(b.v0[1]));
+    const lanes sz = subps(set1ps(o[2]), loadps(b.v0[2]));
+    const lanes uu = mulps(f, addps(addps(mulps(sx, hx), mulps(sy, hy)), mulps(sz, hz)));
+    valid = andps(valid, andps(cmpgeps(uu, set1ps(0.f)), cmpleps(uu, set1ps(1.f))));
+
+    // q = s x e1, v = f * (d . q)
+    const lanes qx = subps(mulps(sy, e1z), mulps(sz, e1y));
+    const lanes qy = subps(mulps(sz, e1x), mulps(sx, e1z));
+    const lanes qz = subps(mulps(sx, e1y), mulps(sy, e1x));
+    const lanes vv = mulps(f, addps(addps(mulps(dx, qx), mulps(dy, qy)), mulps(dz, qz)));
+    valid = andps(valid, andps(cmpgeps(vv, set1ps(0.f)), cmpleps(addps(uu, vv), set1ps(1.f))));
+
+    // t = f * (e2 . q), in (epsilon, tmax)
+    const lanes tt = mulps(f, addps(addps(mulps(e2x, qx), mulps(e2y, qy)), mulps(e2z, qz)));
+    valid = andps(valid, andps(cmpgtps(tt, set1ps(FLOAT_EPSILON)), cmpltps(tt, set1ps(tmax))));
+
+    storeps(t, tt);
+    storeps(u, uu);
+    storeps(v, vv);
+    return movemaskps(valid);
+}
+
+#else
+
+static inline uint32_t intersectBlock(const TriangleBlock &b, const float o[3], const float d[3], float tmax,
+                                      float t[TRIANGLE_BLOCK_WIDTH], float u[TRIANGLE_BLOCK_WIDTH], float v[TRIANGLE_BLOCK_WIDTH])
+{
+    uint32_t mask = 0;
+    for(int i = 0; i < TRIANGLE_BLOCK_WIDTH; ++i) {
+        float hx = d[1] * b.e2[2][i] - d[2] * b.e2[1][i];
+        float hy = d[2] * b.e2[0][i] - d[0] * b.e2[2][i];
+        float hz = d[0] * b.e2[1][i] - d[1] * b.e2[0][i];
+        float a = b.e1[0][i] * hx + b.e1[1][i] * hy + b.e1[2][i] * hz;
+        float f = 1.f / a;
+        float sx = o[0] - b.v0[0][i], sy = o[1] - b.v0[1][i], sz = o[2] - b.v0[2][i];
+        u[i] = f * (sx * hx + sy * hy + sz * hz);
+        float qx = sy * b.e1[2][i] - sz * b.e1[1][i];
+        float qy = sz * b.e1[0][i] - sx * b.e1[2][i];
+        float qz = sx * b.e1[1][i] - sy * b.e1[0][i];
+        v[i] = f * (d[0] * qx + d[1] * qy + d[2] * qz);
+        t[i] = f * (b.e2[0][i] * qx + b.e2[1][i] * qy + b.e2[2][i] * qz);
+        bool hit = std::fabs(a) >= FLOAT_EPSILON && u[i] >= 0.f && u[i] <= 1.f && v[i] >= 0.f && u[i] + v[i] <= 1.f
+                   && t[i] > FLOAT_EPSILON && t[i] < tmax;
+        mask |= (uint32_t)hit << i;
+    }
+    return mask;
+}
+
+#endif
+
+bool TriangleBlocks::intersect(uint32_t leafStart, uint32_t leafCount, const Ray &ray, IntersectionInfo *closest, bool anyHit) const
+{
+    const float o[3] = { ray.o.x(), ray.o.y(), ray.o.z() };
+    const float d[3] = { ray.d.x(), ray.d.y(), ray.d.z() };
+    alignas(32) float t[TRIANGLE_BLOCK_WIDTH], u[TRIANGLE_BLOCK_WIDTH], v[TRIANGLE_BLOCK_WIDTH];
+
+    bool hit = false;
+    uint32_t first = m_leafFirstBlock[leafStart];
+    uint32_t nBlocks = (leafCount + TRIANGLE_BLOCK_WIDTH - 1) / TRIANGLE_BLOCK_WIDTH;
+    for(uint32_t b = first; b < first + nBlocks; ++b) {
+        uint32_t mask = intersectBlock(m_blocks[b], o, d, closest->t, t, u, v);
+        while(mask) {
+            int lane = std::countr_zero(mask);
+            mask &= mask - 1;
+            // Lanes were tested against the closest t before this block; keep only closer ones
+            if(t[lane] < closest->t) {
+                closest->t = t[lane];
+                closest->u = u[lane];
+                closest->v = v[lane];
+                closest->object = m_blocks[b].prim[lane];
+                hit = true;
+                if(anyHit) {
+                    return true;
+                }
+            }
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,44 @@
+#ifndef TRIANGLEBLOCKS_H
+#define TRIANGLEBLOCKS_H
+
+#include <BVH/BVH.h>
+
+#include <vector>
+
+// Triangles tested together by one SIMD intersection test
+#if defined(__AVX__)
+#define TRIANGLE_BLOCK_WIDTH 8
+#else
+#define TRIANGLE_BLOCK_WIDTH 4
+#endif
+
+// A block of triangles in SoA form, with the Möller–Trumbore edges precomputed.
+// Unused lanes have zero edges, which the determinant test always rejects.
+struct alignas(32) TriangleBlock {
+    float v0[3][TRIANGLE_BLOCK_WIDTH];
+    float e1[3][TRIANGLE_BLOCK_WIDTH]; // v1 - v0
+    float e2[3][TRIANGLE_BLOCK_WIDTH]; // v2 - v0
+    const Object *prim[TRIANGLE_BLOCK_WIDTH];
+};
+
+// The leaves of a triangle-only BVH repacked into triangle blocks, so a leaf is
+// intersected a whole block at a time instead of one virtual call per triangle.
+class TriangleBlocks
+{
+public:
+    // Packs every leaf of bvh, whose primitives must all be Triangles
+    TriangleBlocks(const BVH &bvh);
+
+    // Leaf test for BVH::traverse: intersects the leaf starting at leafStart and keeps the closest
+    // hit in *closest (t, u, v, object). With anyHit it returns on the first hit.
+    bool intersect(uint32_t leafStart, uint32_t leafCount, const Ray &ray, IntersectionInfo *closest, bool anyHit) const;
+
+    size_t getMemoryBytes() const;
+
+private:
+    std::vector<TriangleBlock> m_blocks;
+    // First block of the leaf whose primitive range starts at the index
+    std::vector<uint32_t> m_leafFirstBlock;
+};
+
+#endif // TRIANGLEBLOCKS_H
@@ -0,0 +1,117 @@
+#include "tilescheduler.h"
+
+#include "BVH/Log.h"
+#include "BVH/Stopwatch.h"
+
+#include <algorithm>
+#include <thread>
+
+TileScheduler::TileScheduler(int width, int height, int tileSize, int numThreads, int rowBegin, int rowEnd)
+    : m_numThreads(numThreads), m_wallSeconds(0)
+{
+    if(m_numThreads <= 0) {
+        m_numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    tileSize = std::max(1, tileSize);
+    if(rowEnd < 0 || rowEnd > height) {
+        rowEnd = height;
+    }
+
+    for(int y = rowBegin; y < rowEnd; y += tileSize) {
+        for(int x = 0; x < width; x += tileSize) {
+            m_tiles.push_back({x, y, std::min(x + tileSize, width), std::min(y + tileSize, rowEnd)});
+        }
+    }
+    m_numThreads = std::min<int>(m_numThreads, std::max<size_t>(1, m_tiles.size()));
+    m_stats.assign(m_numThreads, WorkerStats{0.0, 0, 0});
+}
+
+void TileScheduler::run(const std::function<void(const Tile &)> &renderTile)
+{
+    // Hand each thread a contiguous run of tiles in scanline order. The owner
+    // works from the front, thieves take from the back, so the two rarely meet
+    // and each thread keeps touching neighbouring pixels.
+    m_queues = std::vector<WorkerQueue>(m_numThreads);
+    int nTiles = m_tiles.size();
+    for(int t = 0; t < m_numThreads; ++t) {
+        int begin = (int)((long long)nTiles * t / m_numThreads);
+        int end = (int)((long long)nTiles * (t + 1) / m_numThreads);
+        for(int i = begin; i < end; ++i) {
+            m_queues[t].tiles.push_back(i);
+        }
+    }
+
+    Stopwatch sw;
+    std::vector<std::thread> threads;
+    for(int t = 1; t < m_numThreads; ++t) {
+        threads.emplace_back(&TileScheduler::worker, this, t, std::cref(renderTile));
+    }
+    // The calling thread is worker 0
+    worker(0, renderTile);
+    for(std::thread &thread : threads) {
+        thread.join();
+    }
+    m_wallSeconds += sw.read();
+}
+
+void TileScheduler::worker(int thread, const std::function<void(const Tile &)> &renderTile)
+{
+    WorkerStats &stats = m_stats[thread];
+    int tile;
+    // No new tiles are ever added, so once every queue is empty we are done.
+    while(true) {
+        if(!popLocal(thread, tile)) {
+            if(!steal(thread, tile)) {
+                break;
+            }
+            stats.tilesStolen++;
+        }
+        Stopwatch sw;
+        renderTile(m_tiles[tile]);
+        stats.busySeconds += sw.read();
+        stats.tilesRendered++;
+    }
+}
+
+bool TileScheduler::popLocal(int thread, int &tile)
+{
+    WorkerQueue &queue = m_queues[thread];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::steal(int thread, int &tile)
+{
+    for(int i = 1; i < m_numThreads; ++i) {
+        WorkerQueue &victim = m_queues[(thread + i) % m_numThreads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TileScheduler::reportUtilization() const
+{
+    double busyTotal = 0;
+    int tilesTotal = 0;
+    for(int t = 0; t < (int)m_stats.size(); ++t) {
+        const WorkerStats &stats = m_stats[t];
+        double utilization = m_wallSeconds > 0 ? stats.busySeconds / m_wallSeconds : 0;
+        busyTotal += stats.busySeconds;
+        tilesTotal += stats.tilesRendered;
+        LOG_STAT("Thread %d: %d tiles (%d stolen), busy %d ms, utilization %.1f%%",
+                 t, stats.tilesRendered, stats.tilesStolen, (int)(1000*stats.busySeconds), 100*utilization);
+    }
+    double average = m_wallSeconds > 0 && !m_stats.empty() ? busyTotal / (m_wallSeconds * m_stats.size()) : 0;
+    LOG_STAT("Rendered %d tiles on %d threads in %d ms, average utilization %.1f%%",
+             tilesTotal, m_numThreads, (int)(1000*m_wallSeconds), 100*average);
+}
@@ -0,0 +1,58 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// A rectangular block of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Splits the image into square tiles and renders them on a pool of threads.
+// Every thread owns a deque of tiles; once its own deque runs dry it steals
+// from the far end of another thread's deque, so expensive tiles (glass,
+// caustics) don't leave the other threads idle at the tail of a frame.
+class TileScheduler
+{
+public:
+    // numThreads <= 0 uses every hardware thread. Only the rows [rowBegin, rowEnd) are split
+    // into tiles; rowEnd < 0 stands for the image height.
+    TileScheduler(int width, int height, int tileSize, int numThreads, int rowBegin = 0, int rowEnd = -1);
+
+    // Calls renderTile once for every tile, from the worker threads. Blocks until all tiles are done.
+    void run(const std::function<void(const Tile &)> &renderTile);
+
+    // Prints per-thread busy time, tile counts and steals, summed over every run() so far
+    void reportUtilization() const;
+
+    int getNumThreads() const { return m_numThreads; }
+    int getNumTiles() const { return m_tiles.size(); }
+
+private:
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<int> tiles; // indices into m_tiles
+    };
+
+    struct WorkerStats {
+        double busySeconds;
+        int tilesRendered;
+        int tilesStolen;
+    };
+
+    int m_numThreads;
+    std::vector<Tile> m_tiles;
+    std::vector<WorkerQueue> m_queues;
+    std::vector<WorkerStats> m_stats;
+    double m_wallSeconds;
+
+    void worker(int thread, const std::function<void(const Tile &)> &renderTile);
+    bool popLocal(int thread, int &tile);
+    bool steal(int thread, int &tile);
+};
+
+#endif // TILESCHEDULER_H
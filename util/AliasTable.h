@@ -0,0 +1,86 @@
+/**
+ * @file AliasTable.h
+ *
+ * Constant time sampling of a discrete distribution (Walker's alias method).
+ */
+#ifndef __ALIASTABLE_H__
+#define __ALIASTABLE_H__
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+class AliasTable
+{
+public:
+    AliasTable() : m_total(0) {}
+
+    // Weights must be non-negative; entries with zero weight are never sampled
+    explicit AliasTable(const std::vector<float> &weights)
+        : m_total(0)
+    {
+        size_t n = weights.size();
+        m_bins.resize(n);
+        for(float w : weights) {
+            m_total += w;
+        }
+        if(n == 0 || m_total <= 0.0) {
+            m_bins.clear();
+            return;
+        }
+
+        // Split the entries into those under and over the average weight, then let every
+        // underfull bin borrow the rest of its probability from an overfull one.
+        std::vector<uint32_t> under, over;
+        std::vector<double> scaled(n);
+        for(size_t i = 0; i < n; ++i) {
+            m_bins[i].pmf = (float)(weights[i] / m_total);
+            scaled[i] = weights[i] / m_total * n;
+            (scaled[i] < 1.0 ? under : over).push_back(i);
+        }
+        while(!under.empty() && !over.empty()) {
+            uint32_t small = under.back(), large = over.back();
+            under.pop_back();
+            m_bins[small].threshold = (float)scaled[small];
+            m_bins[small].alias = large;
+            scaled[large] -= 1.0 - scaled[small];
+            if(scaled[large] < 1.0) {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+        // What is left is 1 up to rounding
+        for(uint32_t i : under) {
+            m_bins[i].threshold = 1.f;
+            m_bins[i].alias = i;
+        }
+        for(uint32_t i : over) {
+            m_bins[i].threshold = 1.f;
+            m_bins[i].alias = i;
+        }
+    }
+
+    bool empty() const { return m_bins.empty(); }
+    size_t size() const { return m_bins.size(); }
+
+    // Picks an entry with two uniform numbers in [0, 1)
+    uint32_t sample(float u1, float u2) const
+    {
+        uint32_t i = std::min<uint32_t>((uint32_t)(u1 * m_bins.size()), m_bins.size() - 1);
+        return u2 < m_bins[i].threshold ? i : m_bins[i].alias;
+    }
+
+    // Probability of sampling entry i
+    float pmf(uint32_t i) const { return m_bins[i].pmf; }
+
+private:
+    struct Bin {
+        float threshold; // probability of keeping this bin's own entry
+        uint32_t alias; // the entry picked otherwise
+        float pmf;
+    };
+    std::vector<Bin> m_bins;
+    double m_total;
+};
+
+#endif
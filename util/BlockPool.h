@@ -0,0 +1,39 @@
+/**
+ * @file BlockPool.h
+ *
+ * Allocates objects of one type in blocks and frees them all at once with the pool.
+ */
+#ifndef __BLOCKPOOL_H__
+#define __BLOCKPOOL_H__
+
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+template<typename T, size_t BlockSize = 256>
+class BlockPool
+{
+public:
+    BlockPool() : m_used(BlockSize) {}
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    // A value-initialized T, like new T(), that stays where it is until the pool is destroyed
+    T *create()
+    {
+        if(m_used == BlockSize) {
+            m_blocks.emplace_back(new T[BlockSize]());
+            m_used = 0;
+        }
+        return &m_blocks.back()[m_used++];
+    }
+
+    size_t size() const { return m_blocks.empty() ? 0 : (m_blocks.size() - 1) * BlockSize + m_used; }
+
+private:
+    std::vector<std::unique_ptr<T[]>> m_blocks;
+    size_t m_used; // in the last block
+};
+
+#endif
@@ -0,0 +1,56 @@
+/**
+ * @file RandomStream.h
+ *
+ * Stateless, counter-based random numbers for the path tracer.
+ */
+#ifndef __RANDOMSTREAM_H__
+#define __RANDOMSTREAM_H__
+
+#include <stdint.h>
+
+// PCG output permutation used as an integer hash (Jarzynski & Olano, "Hash Functions for GPU Rendering")
+inline uint32_t pcgHash(uint32_t v)
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Maps the top 24 bits of a hash to a float in [0, 1)
+inline float hashToUnitFloat(uint32_t h)
+{
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+/**
+ * Random numbers for one camera sample. Every value is a pure function of
+ * (pixel, sample index, bounce, dimension), so there is no generator state to
+ * advance or share between threads, and a render is bit-identical no matter
+ * how many threads there are or in which order tiles are traced.
+ */
+class RandomStream
+{
+public:
+    RandomStream(uint32_t pixel, uint32_t sample)
+        : m_sampleKey(pcgHash(pixel ^ pcgHash(sample))), m_key(pcgHash(m_sampleKey)), m_dimension(0) {}
+
+    // Switch to the dimensions of the given path vertex (0 is the camera) and restart the dimension counter
+    void setBounce(uint32_t bounce)
+    {
+        m_key = pcgHash(m_sampleKey + bounce);
+        m_dimension = 0;
+    }
+
+    // Uniform float in [0, 1) for the next dimension of the current bounce
+    float next()
+    {
+        return hashToUnitFloat(pcgHash(m_key ^ pcgHash(m_dimension++)));
+    }
+
+private:
+    uint32_t m_sampleKey;
+    uint32_t m_key;
+    uint32_t m_dimension;
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "Sampler.h"
+
+#include <algorithm>
+
+namespace {
+
+const float OneMinusEpsilon = 0.99999994f;
+
+uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash that only lets each bit depend on the bits below it (Laine & Karras), which on
+// bit-reversed values is a random permutation of every subtree: base 2 Owen scrambling
+uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Generator matrices of the first four Sobol dimensions, one column per index bit,
+// from the Joe & Kuo primitive polynomials and initial direction numbers
+struct SobolMatrices {
+    uint32_t columns[4][32];
+
+    SobolMatrices()
+    {
+        static const uint32_t degree[4] = {0, 1, 2, 3};
+        static const uint32_t coefficients[4] = {0, 0, 1, 1};
+        static const uint32_t initial[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+        for(int bit = 0; bit < 32; ++bit) {
+            columns[0][bit] = 1u << (31 - bit);
+        }
+        for(int d = 1; d < 4; ++d) {
+            uint32_t s = degree[d];
+            uint32_t *v = columns[d];
+            for(uint32_t bit = 0; bit < 32; ++bit) {
+                if(bit < s) {
+                    v[bit] = initial[d][bit] << (31 - bit);
+                    continue;
+                }
+                v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+                for(uint32_t k = 1; k < s; ++k) {
+                    v[bit] ^= ((coefficients[d] >> (s - 1 - k)) & 1u) * v[bit - k];
+                }
+            }
+        }
+    }
+
+    uint32_t sample(uint32_t index, int dimension) const
+    {
+        // branch free, the scrambled indices have random bits
+        uint32_t result = 0;
+        for(int bit = 0; index; index >>= 1, ++bit) {
+            result ^= columns[dimension][bit] & (0u - (index & 1u));
+        }
+        return result;
+    }
+};
+
+const SobolMatrices sobolMatrices;
+
+const uint32_t Primes[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+const uint32_t NumPrimes = sizeof(Primes) / sizeof(Primes[0]);
+
+// Element i of a random permutation of [0, n) chosen by seed, without building the
+// permutation (Kensler, "Correlated Multi-Jittered Sampling")
+uint32_t permutationElement(uint32_t i, uint32_t n, uint32_t seed)
+{
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1u | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while(i >= n);
+    return (i + seed) % n;
+}
+
+// Radical inverse of index in the given base, Owen scrambled: every digit goes through a
+// random permutation that depends on the digits before it
+float scrambledRadicalInverse(uint32_t base, uint32_t index, uint32_t seed)
+{
+    double invBase = 1.0 / base, invBaseM = 1.0, result = 0.0;
+    uint32_t node = seed; // identifies the digits so far
+    while(index > 0) {
+        uint32_t next = index / base;
+        uint32_t digit = index - next * base;
+        invBaseM *= invBase;
+        result += permutationElement(digit, base, node) * invBaseM;
+        node = pcgHash(node ^ pcgHash(digit + 1));
+        index = next;
+    }
+    // The digits past the index's are scrambled zeros, which is a uniform point in what is left
+    result += hashToUnitFloat(pcgHash(node)) * invBaseM;
+    return std::min((float)result, OneMinusEpsilon);
+}
+
+}
+
+std::unique_ptr<Sampler> Sampler::create(SamplerType type)
+{
+    switch(type) {
+    case SamplerType::Sobol:
+        return std::unique_ptr<Sampler>(new SobolSampler());
+    case SamplerType::Halton:
+        return std::unique_ptr<Sampler>(new HaltonSampler());
+    default:
+        return std::unique_ptr<Sampler>(new IndependentSampler());
+    }
+}
+
+void SobolSampler::startSample(uint32_t pixel, uint32_t index)
+{
+    m_seed = pcgHash(pixel);
+    m_index = index;
+    setBounce(0);
+}
+
+void SobolSampler::setBounce(uint32_t bounce)
+{
+    m_bounce = bounce;
+    m_dimension = 0;
+}
+
+float SobolSampler::next()
+{
+    uint32_t component = m_dimension % 4;
+    if(component == 0) {
+        m_groupSeed = pcgHash(m_seed ^ pcgHash(m_bounce ^ pcgHash(m_dimension)));
+        m_groupIndex = nestedUniformScramble(m_index, m_groupSeed);
+    }
+    ++m_dimension;
+
+    uint32_t value = sobolMatrices.sample(m_groupIndex, component);
+    value = nestedUniformScramble(value, pcgHash(m_groupSeed + component));
+    return hashToUnitFloat(value);
+}
+
+void SobolSampler::next2D(float *u1, float *u2)
+{
+    // Skip a dimension if needed so both come from the same group
+    m_dimension = (m_dimension + 1) / 2 * 2;
+    *u1 = next();
+    *u2 = next();
+}
+
+void HaltonSampler::startSample(uint32_t pixel, uint32_t index)
+{
+    m_seed = pcgHash(pixel);
+    m_index = index;
+    m_fallback = RandomStream(pixel, index);
+    setBounce(0);
+}
+
+void HaltonSampler::setBounce(uint32_t bounce)
+{
+    m_bounce = bounce;
+    m_dimension = 0;
+    m_fallback.setBounce(bounce);
+}
+
+float HaltonSampler::next()
+{
+    uint32_t dimension = m_bounce * DimensionsPerBounce + m_dimension;
+    bool inTable = m_dimension < DimensionsPerBounce && dimension < NumPrimes;
+    ++m_dimension;
+
+    if(!inTable) {
+        return m_fallback.next();
+    }
+    return scrambledRadicalInverse(Primes[dimension], m_index, pcgHash(m_seed ^ pcgHash(dimension)));
+}
@@ -0,0 +1,118 @@
+/**
+ * @file Sampler.h
+ *
+ * Sample values for the path tracer. A camera sample asks for its numbers one
+ * dimension at a time, grouped by the path vertex that consumes them, and a Sampler
+ * decides how those numbers are spread over the samples of a pixel.
+ */
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include "RandomStream.h"
+
+#include <memory>
+#include <stdint.h>
+
+enum class SamplerType {
+    Independent, // uncorrelated hashed random numbers
+    Sobol, // Owen-scrambled Sobol points, padded in groups of four dimensions
+    Halton // Owen-scrambled Halton points, one prime base per dimension
+};
+
+/**
+ * Every value is a pure function of (pixel, sample index, bounce, dimension), as
+ * with RandomStream, so renders are deterministic regardless of threading. The
+ * low-discrepancy samplers spread the samples of a pixel evenly over each
+ * dimension, so any sample count works and error falls faster than with
+ * independent samples.
+ */
+class Sampler
+{
+public:
+    virtual ~Sampler() {}
+
+    // Start sample number index of the pixel, at the camera dimensions (bounce 0)
+    virtual void startSample(uint32_t pixel, uint32_t index) = 0;
+
+    // Switch to the dimensions of the given path vertex (0 is the camera) and restart the dimension counter
+    virtual void setBounce(uint32_t bounce) = 0;
+
+    // Uniform float in [0, 1) for the next dimension of the current bounce
+    virtual float next() = 0;
+
+    // The next two dimensions, for a draw that uses them together (a point on a light, a
+    // direction), so samplers that are stratified in 2D can keep the pair one of their pairs
+    virtual void next2D(float *u1, float *u2)
+    {
+        *u1 = next();
+        *u2 = next();
+    }
+
+    static std::unique_ptr<Sampler> create(SamplerType type);
+};
+
+class IndependentSampler : public Sampler
+{
+public:
+    IndependentSampler() : m_stream(0, 0) {}
+
+    void startSample(uint32_t pixel, uint32_t index) override { m_stream = RandomStream(pixel, index); }
+    void setBounce(uint32_t bounce) override { m_stream.setBounce(bounce); }
+    float next() override { return m_stream.next(); }
+
+private:
+    RandomStream m_stream;
+};
+
+/**
+ * Burley, "Practical Hash-based Owen Scrambling". The dimensions of a bounce are
+ * taken four at a time from the first four Sobol dimensions, with the sample index
+ * shuffled differently for each group, so there is no limit on dimensions and no
+ * correlation between groups. A 2D draw starts at an even dimension, so it takes the
+ * first or last two of a group; split over two groups its numbers would come from
+ * differently shuffled indices and not be stratified together.
+ */
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler() : m_seed(0), m_index(0), m_bounce(0), m_dimension(0) {}
+
+    void startSample(uint32_t pixel, uint32_t index) override;
+    void setBounce(uint32_t bounce) override;
+    float next() override;
+    void next2D(float *u1, float *u2) override;
+
+private:
+    uint32_t m_seed;
+    uint32_t m_index;
+    uint32_t m_bounce;
+    uint32_t m_dimension;
+    uint32_t m_groupSeed; // seed of the group of four dimensions being handed out
+    uint32_t m_groupIndex; // the shuffled sample index for that group
+};
+
+/**
+ * Every dimension of the first bounces gets its own prime base, with a random digit
+ * permutation per pixel (Owen scrambling). Dimensions past the prime table fall back
+ * to independent numbers.
+ */
+class HaltonSampler : public Sampler
+{
+public:
+    HaltonSampler() : m_seed(0), m_index(0), m_bounce(0), m_dimension(0), m_fallback(0, 0) {}
+
+    void startSample(uint32_t pixel, uint32_t index) override;
+    void setBounce(uint32_t bounce) override;
+    float next() override;
+
+    static const int DimensionsPerBounce = 8;
+
+private:
+    uint32_t m_seed;
+    uint32_t m_index;
+    uint32_t m_bounce;
+    uint32_t m_dimension;
+    RandomStream m_fallback;
+};
+
+#endif
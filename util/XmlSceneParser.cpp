@@ -7,16 +7,20 @@
 
 #include <Eigen/Dense>
 
+#include <QFile>
+
 #include <assert.h>
+#include <cmath>
 #include <iostream>
 #include <string.h>
 #include <string>
 
-#define ERROR_AT(e) "error at line " << e.lineNumber() << " col " << e.columnNumber() << ": "
-#define PARSE_ERROR(e) std::cout << ERROR_AT(e) << "could not parse <" << e.tagName().toStdString() \
+// These report the element the reader is at
+#define ERROR_AT(xml) "error at line " << xml.lineNumber() << " col " << xml.columnNumber() << ": "
+#define PARSE_ERROR(xml) std::cout << ERROR_AT(xml) << "could not parse <" << xml.name().toString().toStdString() \
     << ">" << std::endl
-#define UNSUPPORTED_ELEMENT(e) std::cout << ERROR_AT(e) << "unsupported element <" \
-    << e.tagName().toStdString() << ">" << std::endl;
+#define UNSUPPORTED_ELEMENT(xml) std::cout << ERROR_AT(xml) << "unsupported element <" \
+    << xml.name().toString().toStdString() << ">" << std::endl;
 
 XmlSceneParser::XmlSceneParser(const std::string& name)
 {
@@ -26,7 +30,6 @@ XmlSceneParser::XmlSceneParser(const std::string& name)
     memset(&m_globalData, 0, sizeof(SceneGlobalData));
     m_objects.clear();
     m_lights.clear();
-    m_nodes.clear();
 }
 
 XmlSceneParser::~XmlSceneParser()
@@ -36,23 +39,7 @@ XmlSceneParser::~XmlSceneParser()
         delete *lights;
     }
 
-    // Delete all Scene Nodes
-    for (unsigned int node = 0; node < m_nodes.size(); node++) {
-        for (size_t i = 0; i < (m_nodes[node])->transformations.size(); i++) {
-            delete (m_nodes[node])->transformations[i];
-        }
-        for (size_t i = 0; i < (m_nodes[node])->primitives.size(); i++) {
-//            delete (m_nodes[node])->primitives[i]->material.textureMap;
-//            delete (m_nodes[node])->primitives[i]->material(2)umpMap;
-            delete (m_nodes[node])->primitives[i];
-        }
-        (m_nodes[node])->transformations.clear();
-        (m_nodes[node])->primitives.clear();
-        (m_nodes[node])->children.clear();
-        delete m_nodes[node];
-    }
-
-    m_nodes.clear();
+    // The scene nodes, transformations and primitives go with their pools
     m_lights.clear();
     m_objects.clear();
 }
@@ -96,21 +83,15 @@ bool XmlSceneParser::parse() {
         return false;
     }
 
-    // Load the XML document
-    QDomDocument doc;
-    QString errorMessage;
-    int errorLine, errorColumn;
-    if (!doc.setContent(&file, &errorMessage, &errorLine, &errorColumn)) {
-        std::cout << "parse error at line " << errorLine << " col " << errorColumn << ": "
-             << errorMessage.toStdString() << std::endl;
-        return false;
-    }
-    file.close();
-
-    // Get the root element
-    QDomElement scenefile = doc.documentElement();
-    if (scenefile.tagName() != "scenefile") {
-        std::cout << "missing <scenefile>" << std::endl;
+    // Stream the XML document, building the scene graph as its elements are reached
+    QXmlStreamReader xml(&file);
+    if (!xml.readNextStartElement() || xml.name() != u"scenefile") {
+        if (xml.hasError()) {
+            std::cout << "parse error at line " << xml.lineNumber() << " col " << xml.columnNumber() << ": "
+                 << xml.errorString().toStdString() << std::endl;
+        } else {
+            std::cout << "missing <scenefile>" << std::endl;
+        }
         return false;
     }
 
@@ -127,29 +108,35 @@ bool XmlSceneParser::parse() {
     m_globalData.ks = 0.5f;
 
     // Iterate over child elements
-    QDomNode childNode = scenefile.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "globaldata") {
-            if (!parseGlobalData(e))
+    while (xml.readNextStartElement()) {
+        if (xml.name() == u"globaldata") {
+            if (!parseGlobalData(xml))
                 return false;
-        } else if (e.tagName() == "lightdata") {
-            if (!parseLightData(e))
+        } else if (xml.name() == u"lightdata") {
+            if (!parseLightData(xml))
                 return false;
-        } else if (e.tagName() == "cameradata") {
-            if (!parseCameraData(e))
+        } else if (xml.name() == u"cameradata") {
+            if (!parseCameraData(xml))
                 return false;
-        } else if (e.tagName() == "object") {
-            if (!parseObjectData(e))
+        } else if (xml.name() == u"object") {
+            if (!parseObjectData(xml))
                 return false;
-        } else if (!e.isNull()) {
-            UNSUPPORTED_ELEMENT(e);
+        } else {
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
     }
 
-    std::cout << "finished parsing " << file_name << std::endl;
+    // A malformed document ends the elements early rather than failing one of them
+    if (xml.hasError()) {
+        std::cout << "parse error at line " << xml.lineNumber() << " col " << xml.columnNumber() << ": "
+             << xml.errorString().toStdString() << std::endl;
+        return false;
+    }
+    file.close();
+
+    std::cout << "finished parsing " << file_name << ": " << m_nodes.size() << " nodes, "
+              << m_transformations.size() << " transformations, " << m_primitives.size() << " primitives" << std::endl;
     return true;
 }
 
@@ -157,10 +144,10 @@ bool XmlSceneParser::parse() {
  * Helper function to parse a single value, the name of which is stored in
  * name.  For example, to parse <length v="0"/>, name would need to be "v".
  */
-bool parseInt(const QDomElement &single, int &a, const char *name) {
+bool parseInt(const QXmlStreamAttributes &single, int &a, const char *name) {
     if (!single.hasAttribute(name))
         return false;
-    a = single.attribute(name).toInt();
+    a = single.value(name).toInt();
     return true;
 }
 
@@ -168,10 +155,10 @@ bool parseInt(const QDomElement &single, int &a, const char *name) {
  * Helper function to parse a single value, the name of which is stored in
  * name.  For example, to parse <length v="0"/>, name would need to be "v".
  */
-template <typename T> bool parseSingle(const QDomElement &single, T &a, const QString &str) {
+template <typename T> bool parseSingle(const QXmlStreamAttributes &single, T &a, const QString &str) {
     if (!single.hasAttribute(str))
         return false;
-    a = single.attribute(str).toDouble();
+    a = single.value(str).toDouble();
     return true;
 }
 
@@ -181,7 +168,7 @@ template <typename T> bool parseSingle(const QDomElement &single, T &a, const QS
  * <pos x="0" y="0" z="0"/>, chars would need to be "xyz".
  */
 template <typename T> bool parseTriple(
-        const QDomElement &triple,
+        const QXmlStreamAttributes &triple,
         T &a,
         T &b,
         T &c,
@@ -192,9 +179,9 @@ template <typename T> bool parseTriple(
         !triple.hasAttribute(str_b) ||
         !triple.hasAttribute(str_c))
         return false;
-    a = triple.attribute(str_a).toDouble();
-    b = triple.attribute(str_b).toDouble();
-    c = triple.attribute(str_c).toDouble();
+    a = triple.value(str_a).toDouble();
+    b = triple.value(str_b).toDouble();
+    c = triple.value(str_c).toDouble();
     return true;
 }
 
@@ -204,7 +191,7 @@ template <typename T> bool parseTriple(
  * <color r="0" g="0" b="0" a="0"/>, chars would need to be "rgba".
  */
 template <typename T> bool parseQuadruple(
-        const QDomElement &quadruple,
+        const QXmlStreamAttributes &quadruple,
         T &a,
         T &b,
         T &c,
@@ -218,10 +205,10 @@ template <typename T> bool parseQuadruple(
         !quadruple.hasAttribute(str_c) ||
         !quadruple.hasAttribute(str_d))
         return false;
-    a = quadruple.attribute(str_a).toDouble();
-    b = quadruple.attribute(str_b).toDouble();
-    c = quadruple.attribute(str_c).toDouble();
-    d = quadruple.attribute(str_d).toDouble();
+    a = quadruple.value(str_a).toDouble();
+    b = quadruple.value(str_b).toDouble();
+    c = quadruple.value(str_c).toDouble();
+    d = quadruple.value(str_d).toDouble();
     return true;
 }
 
@@ -238,26 +225,25 @@ template <typename T> bool parseQuadruple(
  *   <row a="0" b="0" c="0" d="1"/>
  * </matrix>
  */
-bool parseMatrix(const QDomElement &matrix, Eigen::Matrix4f &m) {
-    QDomNode childNode = matrix.firstChild();
+bool parseMatrix(QXmlStreamReader &xml, Eigen::Matrix4f &m) {
     int col = 0;
 
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.isElement()) {
+    // Elements after the fourth are skipped
+    while (xml.readNextStartElement()) {
+        if (col < 4) {
             float a, b, c, d;
-            if (!parseQuadruple(e, a, b, c, d, "a", "b", "c", "d")
-                    && !parseQuadruple(e, a, b, c, d, "v1", "v2", "v3", "v4")) {
-                PARSE_ERROR(e);
+            if (!parseQuadruple(xml.attributes(), a, b, c, d, "a", "b", "c", "d")
+                    && !parseQuadruple(xml.attributes(), a, b, c, d, "v1", "v2", "v3", "v4")) {
+                PARSE_ERROR(xml);
                 return false;
             }
             m(0, col) = a;
             m(1, col) = b;
             m(2, col) = c;
             m(3, col) = d;
-            if (++col == 4) break;
+            ++col;
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     return (col == 4);
@@ -267,7 +253,7 @@ bool parseMatrix(const QDomElement &matrix, Eigen::Matrix4f &m) {
  * Helper function to parse a color.  Will parse an element with r, g, b, and
  * a attributes (the a attribute is optional and defaults to 1).
  */
-bool parseColor(const QDomElement &color, SceneColor &c) {
+bool parseColor(const QXmlStreamAttributes &color, SceneColor &c) {
     c(3) = 1;
     return parseQuadruple(color, c(0), c(1), c(2), c(3), "r", "g", "b", "a") ||
            parseQuadruple(color, c(0), c(1), c(2), c(3), "x", "y", "z", "w") ||
@@ -279,12 +265,12 @@ bool parseColor(const QDomElement &color, SceneColor &c) {
  * Helper function to parse a texture map tag.  Example texture map tag:
  * <texture file="/course/cs224/data/image/andyVanDam.jpg" u="1" v="1"/>
  */
-bool parseMap(const QDomElement &e, SceneFileMap &map) {
+bool parseMap(const QXmlStreamAttributes &e, SceneFileMap &map) {
     if (!e.hasAttribute("file"))
         return false;
-    map.filename = e.attribute("file").toStdString();
-    map.repeatU = e.hasAttribute("u") ? e.attribute("u").toFloat() : 1;
-    map.repeatV = e.hasAttribute("v") ? e.attribute("v").toFloat() : 1;
+    map.filename = e.value("file").toString().toStdString();
+    map.repeatU = e.hasAttribute("u") ? e.value("u").toFloat() : 1;
+    map.repeatV = e.hasAttribute("v") ? e.value("v").toFloat() : 1;
     map.isUsed = true;
     return true;
 }
@@ -292,33 +278,32 @@ bool parseMap(const QDomElement &e, SceneFileMap &map) {
 /**
  * Parse a <globaldata> tag and fill in m_globalData.
  */
-bool XmlSceneParser::parseGlobalData(const QDomElement &globaldata) {
+bool XmlSceneParser::parseGlobalData(QXmlStreamReader &xml) {
     // Iterate over child elements
-    QDomNode childNode = globaldata.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "ambientcoeff") {
+    while (xml.readNextStartElement()) {
+        const QXmlStreamAttributes e = xml.attributes();
+        if (xml.name() == u"ambientcoeff") {
             if (!parseSingle(e, m_globalData.ka, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "diffusecoeff") {
+        } else if (xml.name() == u"diffusecoeff") {
             if (!parseSingle(e, m_globalData.kd, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "specularcoeff") {
+        } else if (xml.name() == u"specularcoeff") {
             if (!parseSingle(e, m_globalData.ks, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "transparentcoeff") {
+        } else if (xml.name() == u"transparentcoeff") {
             if (!parseSingle(e, m_globalData.kt, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     return true;
@@ -327,7 +312,7 @@ bool XmlSceneParser::parseGlobalData(const QDomElement &globaldata) {
 /**
  * Parse a <lightdata> tag and add a new SceneLightData to m_lights.
  */
-bool XmlSceneParser::parseLightData(const QDomElement &lightdata) {
+bool XmlSceneParser::parseLightData(QXmlStreamReader &xml) {
     // Create a default light
     SceneLightData* light = new SceneLightData();
     m_lights.push_back(light);
@@ -338,107 +323,106 @@ bool XmlSceneParser::parseLightData(const QDomElement &lightdata) {
     light->function = Eigen::Vector3f(1, 0, 0);
 
     // Iterate over child elements
-    QDomNode childNode = lightdata.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "id") {
+    while (xml.readNextStartElement()) {
+        const QXmlStreamAttributes e = xml.attributes();
+        if (xml.name() == u"id") {
             if (!parseInt(e, light->id, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "type") {
+        } else if (xml.name() == u"type") {
             if (!e.hasAttribute("v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-            if (e.attribute("v") == "directional") light->type = LightType::LIGHT_DIRECTIONAL;
-            else if (e.attribute("v") == "point") light->type = LightType::LIGHT_POINT;
-            else if (e.attribute("v") == "spot") light->type = LightType::LIGHT_SPOT;
-            else if (e.attribute("v") == "area") light->type = LightType::LIGHT_AREA;
+            if (e.value("v") == u"directional") light->type = LightType::LIGHT_DIRECTIONAL;
+            else if (e.value("v") == u"point") light->type = LightType::LIGHT_POINT;
+            else if (e.value("v") == u"spot") light->type = LightType::LIGHT_SPOT;
+            else if (e.value("v") == u"area") light->type = LightType::LIGHT_AREA;
             else {
-                std::cout << ERROR_AT(e) << "unknown light type " << e.attribute("v").toStdString() << std::endl;
+                std::cout << ERROR_AT(xml) << "unknown light type " << e.value("v").toString().toStdString() << std::endl;
                 return false;
             }
-        } else if (e.tagName() == "color") {
+        } else if (xml.name() == u"color") {
             if (!parseColor(e, light->color)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "function") {
+        } else if (xml.name() == u"function") {
             if (!parseTriple(e, light->function(0), light->function(1), light->function(2), "a", "b", "c") &&
                 !parseTriple(e, light->function(0), light->function(1), light->function(2), "x", "y", "z") &&
                 !parseTriple(e, light->function(0), light->function(1), light->function(2), "v1", "v2", "v3")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "position") {
+        } else if (xml.name() == u"position") {
             if (light->type == LightType::LIGHT_DIRECTIONAL) {
-                std::cout << ERROR_AT(e) << "position is not applicable to directional lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "position is not applicable to directional lights" << std::endl;
                 return false;
             }
             if (!parseTriple(e, light->pos(0), light->pos(1), light->pos(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "direction") {
+        } else if (xml.name() == u"direction") {
             if (light->type == LightType::LIGHT_POINT) {
-                std::cout << ERROR_AT(e) << "direction is not applicable to point lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "direction is not applicable to point lights" << std::endl;
                 return false;
             }
             if (!parseTriple(e, light->dir(0), light->dir(1), light->dir(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "radius") {
+        } else if (xml.name() == u"radius") {
             if (light->type != LightType::LIGHT_SPOT) {
-                std::cout << ERROR_AT(e) << "radius is only applicable to spot lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "radius is only applicable to spot lights" << std::endl;
                 return false;
             }
             if (!parseSingle(e, light->radius, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "penumbra") {
+        } else if (xml.name() == u"penumbra") {
             if (light->type != LightType::LIGHT_SPOT) {
-                std::cout << ERROR_AT(e) << "penumbra is only applicable to spot lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "penumbra is only applicable to spot lights" << std::endl;
                 return false;
             }
             if (!parseSingle(e, light->penumbra, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "angle") {
+        } else if (xml.name() == u"angle") {
             if (light->type != LightType::LIGHT_SPOT) {
-                std::cout << ERROR_AT(e) << "angle is only applicable to spot lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "angle is only applicable to spot lights" << std::endl;
                 return false;
             }
             if (!parseSingle(e, light->angle, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "width") {
+        } else if (xml.name() == u"width") {
             if (light->type != LightType::LIGHT_AREA) {
-                std::cout << ERROR_AT(e) << "width is only applicable to area lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "width is only applicable to area lights" << std::endl;
                 return false;
             }
             if (!parseSingle(e, light->width, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "height") {
+        } else if (xml.name() == u"height") {
             if (light->type != LightType::LIGHT_AREA) {
-                std::cout << ERROR_AT(e) << "height is only applicable to area lights" << std::endl;
+                std::cout << ERROR_AT(xml) << "height is only applicable to area lights" << std::endl;
                 return false;
             }
             if (!parseSingle(e, light->height, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (!e.isNull()) {
-            UNSUPPORTED_ELEMENT(e);
+        } else {
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     return true;
@@ -447,27 +431,26 @@ bool XmlSceneParser::parseLightData(const QDomElement &lightdata) {
 /**
  * Parse a <cameradata> tag and fill in m_cameraData.
  */
-bool XmlSceneParser::parseCameraData(const QDomElement &cameradata) {
+bool XmlSceneParser::parseCameraData(QXmlStreamReader &xml) {
     bool focusFound = false;
     bool lookFound = false;
 
     // Iterate over child elements
-    QDomNode childNode = cameradata.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "pos") {
+    while (xml.readNextStartElement()) {
+        const QXmlStreamAttributes e = xml.attributes();
+        if (xml.name() == u"pos") {
             if (!parseTriple(e, m_cameraData.pos(0), m_cameraData.pos(1), m_cameraData.pos(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
             m_cameraData.pos(3) = 1;
-        } else if (e.tagName() == "look" || e.tagName() == "focus") {
+        } else if (xml.name() == u"look" || xml.name() == u"focus") {
             if (!parseTriple(e, m_cameraData.look(0), m_cameraData.look(1), m_cameraData.look(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
 
-            if (e.tagName() == "focus") {
+            if (xml.name() == u"focus") {
                 // Store the focus point in the look vector (we will later subtract
                 // the camera position from this to get the actual look vector)
                 m_cameraData.look(3) = 1;
@@ -477,42 +460,42 @@ bool XmlSceneParser::parseCameraData(const QDomElement &cameradata) {
                 m_cameraData.look(3) = 0;
                 lookFound = true;
             }
-        } else if (e.tagName() == "up") {
+        } else if (xml.name() == u"up") {
             if (!parseTriple(e, m_cameraData.up(0), m_cameraData.up(1), m_cameraData.up(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
             m_cameraData.up(3) = 0;
-        } else if (e.tagName() == "heightangle") {
+        } else if (xml.name() == u"heightangle") {
             if (!parseSingle(e, m_cameraData.heightAngle, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "aspectratio") {
+        } else if (xml.name() == u"aspectratio") {
             if (!parseSingle(e, m_cameraData.aspectRatio, "v"))
             {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "aperture") {
+        } else if (xml.name() == u"aperture") {
             if (!parseSingle(e, m_cameraData.aperture, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "focallength") {
+        } else if (xml.name() == u"focallength") {
             if (!parseSingle(e, m_cameraData.focalLength, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (!e.isNull()) {
-            UNSUPPORTED_ELEMENT(e);
+        } else {
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     if (focusFound && lookFound) {
-        std::cout << ERROR_AT(cameradata) << "camera can not have both look and focus" << std::endl;
+        std::cout << ERROR_AT(xml) << "camera can not have both look and focus" << std::endl;
         return false;
     }
 
@@ -528,47 +511,42 @@ bool XmlSceneParser::parseCameraData(const QDomElement &cameradata) {
 /**
  * Parse an <object> tag and create a new SceneNode in m_nodes.
  */
-bool XmlSceneParser::parseObjectData(const QDomElement &object) {
+bool XmlSceneParser::parseObjectData(QXmlStreamReader &xml) {
+    const QXmlStreamAttributes object = xml.attributes();
     if (!object.hasAttribute("name")) {
-        PARSE_ERROR(object);
+        PARSE_ERROR(xml);
         return false;
     }
 
-    if (object.attribute("type") != "tree") {
+    if (object.value("type") != u"tree") {
         std::cout << "top-level <object> elements must be of type tree" << std::endl;
         return false;
     }
 
-    std::string name = object.attribute("name").toStdString();
+    std::string name = object.value("name").toString().toStdString();
 
     // Check that this object does not exist
     if (m_objects[name]) {
-        std::cout << ERROR_AT(object) << "two objects with the same name: " << name << std::endl;
+        std::cout << ERROR_AT(xml) << "two objects with the same name: " << name << std::endl;
         return false;
     }
 
     // Create the object and add to the map
-    SceneNode *node = new SceneNode;
-    m_nodes.push_back(node);
+    SceneNode *node = m_nodes.create();
     m_objects[name] = node;
 
     // Iterate over child elements
-    QDomNode childNode = object.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "transblock") {
-            SceneNode *child = new SceneNode;
-            m_nodes.push_back(child);
-            if (!parseTransBlock(e, child)) {
-                PARSE_ERROR(e);
+    while (xml.readNextStartElement()) {
+        if (xml.name() == u"transblock") {
+            SceneNode *child = m_nodes.create();
+            if (!parseTransBlock(xml, child)) {
                 return false;
             }
             node->children.push_back(child);
-        } else if (!e.isNull()) {
-            UNSUPPORTED_ELEMENT(e);
+        } else {
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
     }
 
     return true;
@@ -588,91 +566,89 @@ bool XmlSceneParser::parseObjectData(const QDomElement &object) {
  *   <object type="primitive" name="sphere"/>
  * </transblock>
  */
-bool XmlSceneParser::parseTransBlock(const QDomElement &transblock, SceneNode* node) {
+bool XmlSceneParser::parseTransBlock(QXmlStreamReader &xml, SceneNode* node) {
     // Iterate over child elements
-    QDomNode childNode = transblock.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "translate") {
-            SceneTransformation *t = new SceneTransformation();
+    while (xml.readNextStartElement()) {
+        const QXmlStreamAttributes e = xml.attributes();
+        if (xml.name() == u"translate") {
+            SceneTransformation *t = m_transformations.create();
             node->transformations.push_back(t);
             t->type = TRANSFORMATION_TRANSLATE;
 
             if (!parseTriple(e, t->translate(0), t->translate(1), t->translate(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "rotate") {
-            SceneTransformation *t = new SceneTransformation();
+        } else if (xml.name() == u"rotate") {
+            SceneTransformation *t = m_transformations.create();
             node->transformations.push_back(t);
             t->type = TRANSFORMATION_ROTATE;
 
             float angle;
             if (!parseQuadruple(e, t->rotate(0), t->rotate(1), t->rotate(2), angle, "x", "y", "z", "angle")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
 
             // Convert to radians
             t->angle = angle * M_PI / 180;
-        } else if (e.tagName() == "scale") {
-            SceneTransformation *t = new SceneTransformation();
+        } else if (xml.name() == u"scale") {
+            SceneTransformation *t = m_transformations.create();
             node->transformations.push_back(t);
             t->type = TRANSFORMATION_SCALE;
 
             if (!parseTriple(e, t->scale(0), t->scale(1), t->scale(2), "x", "y", "z")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "matrix") {
-            SceneTransformation* t = new SceneTransformation();
+        } else if (xml.name() == u"matrix") {
+            SceneTransformation* t = m_transformations.create();
             node->transformations.push_back(t);
             t->type = TRANSFORMATION_MATRIX;
 
-            if (!parseMatrix(e, t->matrix)) {
-                PARSE_ERROR(e);
+            // Reads up to the end of the matrix
+            if (!parseMatrix(xml, t->matrix)) {
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "object") {
-            if (e.attribute("type") == "master") {
-                std::string masterName = e.attribute("name").toStdString();
+            continue;
+        } else if (xml.name() == u"object") {
+            if (e.value("type") == u"master") {
+                std::string masterName = e.value("name").toString().toStdString();
                 if (!m_objects[masterName]) {
-                    std::cout << ERROR_AT(e) << "invalid master object reference: " << masterName << std::endl;
+                    std::cout << ERROR_AT(xml) << "invalid master object reference: " << masterName << std::endl;
                     return false;
                 }
                 node->children.push_back(m_objects[masterName]);
-            } else if (e.attribute("type") == "tree") {
-                QDomNode subNode = e.firstChild();
-                while (!subNode.isNull()) {
-                    QDomElement e = subNode.toElement();
-                    if (e.tagName() == "transblock") {
-                        SceneNode* n = new SceneNode;
-                        m_nodes.push_back(n);
+            } else if (e.value("type") == u"tree") {
+                while (xml.readNextStartElement()) {
+                    if (xml.name() == u"transblock") {
+                        SceneNode* n = m_nodes.create();
                         node->children.push_back(n);
-                        if (!parseTransBlock(e, n)) {
-                            PARSE_ERROR(e);
+                        if (!parseTransBlock(xml, n)) {
                             return false;
                         }
-                    } else if (!e.isNull()) {
-                        UNSUPPORTED_ELEMENT(e);
+                    } else {
+                        UNSUPPORTED_ELEMENT(xml);
                         return false;
                     }
-                    subNode = subNode.nextSibling();
                 }
-            } else if (e.attribute("type") == "primitive") {
-                if (!parsePrimitive(e, node)) {
-                    PARSE_ERROR(e);
+                continue;
+            } else if (e.value("type") == u"primitive") {
+                // Reads up to the end of the primitive
+                if (!parsePrimitive(xml, node)) {
                     return false;
                 }
+                continue;
             } else {
-                std::cout << ERROR_AT(e) << "invalid object type: " << e.attribute("type").toStdString() << std::endl;
+                std::cout << ERROR_AT(xml) << "invalid object type: " << e.value("type").toString().toStdString() << std::endl;
                 return false;
             }
-        } else if (!e.isNull()) {
-            UNSUPPORTED_ELEMENT(e);
+        } else {
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     return true;
@@ -681,11 +657,10 @@ bool XmlSceneParser::parseTransBlock(const QDomElement &transblock, SceneNode* n
 /**
  * Parse an <object type="primitive"> tag into node.
  */
-bool XmlSceneParser::parsePrimitive(const QDomElement &prim, SceneNode* node) {
+bool XmlSceneParser::parsePrimitive(QXmlStreamReader &xml, SceneNode* node) {
     // Default primitive
-    ScenePrimitive* primitive = new ScenePrimitive();
+    ScenePrimitive* primitive = m_primitives.create();
     SceneMaterial& mat = primitive->material;
-//    memset(&mat, 0, sizeof(SceneMaterial));
     mat.clear();
     primitive->type = PrimitiveType::PRIMITIVE_CUBE;
     mat.textureMap.isUsed = false;
@@ -694,18 +669,19 @@ bool XmlSceneParser::parsePrimitive(const QDomElement &prim, SceneNode* node) {
     node->primitives.push_back(primitive);
 
     // Parse primitive type
-    std::string primType = prim.attribute("name").toStdString();
-    if (primType == "sphere") primitive->type = PrimitiveType::PRIMITIVE_SPHERE;
-    else if (primType == "cube") primitive->type = PrimitiveType::PRIMITIVE_CUBE;
-    else if (primType == "cylinder") primitive->type = PrimitiveType::PRIMITIVE_CYLINDER;
-    else if (primType == "cone") primitive->type = PrimitiveType::PRIMITIVE_CONE;
-    else if (primType == "torus") primitive->type = PrimitiveType::PRIMITIVE_TORUS;
-    else if (primType == "mesh") {
+    const QXmlStreamAttributes prim = xml.attributes();
+    QStringView primType = prim.value("name");
+    if (primType == u"sphere") primitive->type = PrimitiveType::PRIMITIVE_SPHERE;
+    else if (primType == u"cube") primitive->type = PrimitiveType::PRIMITIVE_CUBE;
+    else if (primType == u"cylinder") primitive->type = PrimitiveType::PRIMITIVE_CYLINDER;
+    else if (primType == u"cone") primitive->type = PrimitiveType::PRIMITIVE_CONE;
+    else if (primType == u"torus") primitive->type = PrimitiveType::PRIMITIVE_TORUS;
+    else if (primType == u"mesh") {
         primitive->type = PrimitiveType::PRIMITIVE_MESH;
         if (prim.hasAttribute("meshfile")) {
-            primitive->meshfile = prim.attribute("meshfile").toStdString();
+            primitive->meshfile = prim.value("meshfile").toString().toStdString();
         } else if (prim.hasAttribute("filename")) {
-            primitive->meshfile = prim.attribute("filename").toStdString();
+            primitive->meshfile = prim.value("filename").toString().toStdString();
         } else {
             std::cout << "mesh object must specify filename" << std::endl;
             return false;
@@ -713,69 +689,68 @@ bool XmlSceneParser::parsePrimitive(const QDomElement &prim, SceneNode* node) {
     }
 
     // Iterate over child elements
-    QDomNode childNode = prim.firstChild();
-    while (!childNode.isNull()) {
-        QDomElement e = childNode.toElement();
-        if (e.tagName() == "diffuse") {
+    while (xml.readNextStartElement()) {
+        const QXmlStreamAttributes e = xml.attributes();
+        if (xml.name() == u"diffuse") {
             if (!parseColor(e, mat.cDiffuse)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "ambient") {
+        } else if (xml.name() == u"ambient") {
             if (!parseColor(e, mat.cAmbient)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "reflective") {
+        } else if (xml.name() == u"reflective") {
             if (!parseColor(e, mat.cReflective)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "specular") {
+        } else if (xml.name() == u"specular") {
             if (!parseColor(e, mat.cSpecular)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "emissive") {
+        } else if (xml.name() == u"emissive") {
             if (!parseColor(e, mat.cEmissive)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "transparent") {
+        } else if (xml.name() == u"transparent") {
             if (!parseColor(e, mat.cTransparent)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "shininess") {
+        } else if (xml.name() == u"shininess") {
             if (!parseSingle(e, mat.shininess, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "ior") {
+        } else if (xml.name() == u"ior") {
             if (!parseSingle(e, mat.ior, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "texture") {
+        } else if (xml.name() == u"texture") {
             if (!parseMap(e, mat.textureMap)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "bumpmap") {
+        } else if (xml.name() == u"bumpmap") {
             if (!parseMap(e, mat.bumpMap)) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
-        } else if (e.tagName() == "blend") {
+        } else if (xml.name() == u"blend") {
             if (!parseSingle(e, mat.blend, "v")) {
-                PARSE_ERROR(e);
+                PARSE_ERROR(xml);
                 return false;
             }
         } else {
-            UNSUPPORTED_ELEMENT(e);
+            UNSUPPORTED_ELEMENT(xml);
             return false;
         }
-        childNode = childNode.nextSibling();
+        xml.skipCurrentElement();
     }
 
     return true;
@@ -3,19 +3,21 @@
 
 #include "ISceneParser.h"
 #include "SceneData.h"
+#include "BlockPool.h"
 
 #include <vector>
 #include <map>
 
-#include <QtXml>
+#include <QXmlStreamReader>
 
 /**
  * @class XmlSceneParser
  *
  * This class parses the scene graph specified by the Xml file format.
  *
- * The parser is designed to replace the TinyXML parser that was in turn designed to replace the
- * Flex/Yacc/Bison parser.
+ * The file is read in a single pass with a QXmlStreamReader, building the scene graph as each
+ * element is reached without keeping a document tree. Nodes, transformations and primitives
+ * are allocated from pools owned by the parser.
  */
 class XmlSceneParser : public ISceneParser {
 
@@ -44,19 +46,22 @@ public:
 private:
     // The filename should be contained within this parser implementation.
     // If you want to parse a new file, instantiate a different parser.
-    bool parseGlobalData(const QDomElement &globaldata);
-    bool parseCameraData(const QDomElement &cameradata);
-    bool parseLightData(const QDomElement &lightdata);
-    bool parseObjectData(const QDomElement &object);
-    bool parseTransBlock(const QDomElement &transblock, SceneNode* node);
-    bool parsePrimitive(const QDomElement &prim, SceneNode* node);
+    // Each is called with the reader at the element's start and leaves it at the element's end
+    bool parseGlobalData(QXmlStreamReader &xml);
+    bool parseCameraData(QXmlStreamReader &xml);
+    bool parseLightData(QXmlStreamReader &xml);
+    bool parseObjectData(QXmlStreamReader &xml);
+    bool parseTransBlock(QXmlStreamReader &xml, SceneNode* node);
+    bool parsePrimitive(QXmlStreamReader &xml, SceneNode* node);
 
     std::string file_name;
     mutable std::map<std::string, SceneNode*> m_objects;
     SceneCameraData m_cameraData;
     std::vector<SceneLightData*> m_lights;
     SceneGlobalData m_globalData;
-    std::vector<SceneNode*> m_nodes;
+    BlockPool<SceneNode> m_nodes;
+    BlockPool<SceneTransformation> m_transformations;
+    BlockPool<ScenePrimitive> m_primitives;
 };
 
 #endif